@@ -0,0 +1,305 @@
+#include <stdint.h>
+#include "cpu.h"
+#include "decoder.h"
+#include "alu.h"
+
+/*
+    Data processing kernels.
+
+    Each kernel is the combination of an operand 2 function (barrel shifter) and an
+    operation, both forced inline with the S bit as a compile time constant, so the
+    compiler strips out everything a given (opcode, S, form) doesn't need. The shifter
+    special cases are handled with 64 bit arithmetic and selects instead of branches.
+*/
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+#define FLAG_N (1u << 31)
+#define FLAG_Z (1u << 30)
+#define FLAG_C (1u << 29)
+#define FLAG_V (1u << 28)
+
+static ALWAYS_INLINE void set_nzc(CPU *cpu, uint32_t result, uint32_t carry) {
+    uint32_t cpsr = psr_to_word(cpu->cpsr) & ~(FLAG_N | FLAG_Z | FLAG_C);
+
+    cpsr |= result & FLAG_N;
+    cpsr |= (uint32_t)(result == 0) << 30;
+    cpsr |= carry << 29;
+
+    cpu->cpsr = psr_from_word(cpsr);
+}
+
+static ALWAYS_INLINE void set_nzcv(CPU *cpu, uint32_t result, uint32_t carry, uint32_t overflow) {
+    uint32_t cpsr = psr_to_word(cpu->cpsr) & ~(FLAG_N | FLAG_Z | FLAG_C | FLAG_V);
+
+    cpsr |= result & FLAG_N;
+    cpsr |= (uint32_t)(result == 0) << 30;
+    cpsr |= carry << 29;
+    cpsr |= overflow << 28;
+
+    cpu->cpsr = psr_from_word(cpsr);
+}
+
+// operand 2
+
+static ALWAYS_INLINE uint32_t operand_imm(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    *carry = cpu->cpsr.c;
+    return instruction->imm;
+}
+
+static ALWAYS_INLINE uint32_t operand_imm_rotated(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    (void)cpu;
+    *carry = instruction->imm >> 31;
+    return instruction->imm;
+}
+
+static ALWAYS_INLINE uint32_t operand_reg(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    *carry = cpu->cpsr.c;
+    return cpu->registers[instruction->rm];
+}
+
+// shift_amount is 1-31
+static ALWAYS_INLINE uint32_t operand_lsl_imm(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+    uint8_t amount = instruction->shift_amount;
+
+    *carry = (value >> (32 - amount)) & 0x1;
+    return value << amount;
+}
+
+// shift_amount is 1-32
+static ALWAYS_INLINE uint32_t operand_lsr_imm(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint64_t value = cpu->registers[instruction->rm];
+    uint8_t amount = instruction->shift_amount;
+
+    *carry = (value >> (amount - 1)) & 0x1;
+    return value >> amount;
+}
+
+// shift_amount is 1-32
+static ALWAYS_INLINE uint32_t operand_asr_imm(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    int64_t value = (int32_t)cpu->registers[instruction->rm];
+    uint8_t amount = instruction->shift_amount;
+
+    *carry = (value >> (amount - 1)) & 0x1;
+    return value >> amount;
+}
+
+// shift_amount is 1-31
+static ALWAYS_INLINE uint32_t operand_ror_imm(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+    uint8_t amount = instruction->shift_amount;
+
+    *carry = (value >> (amount - 1)) & 0x1;
+    return (value >> amount) | (value << (32 - amount));
+}
+
+static ALWAYS_INLINE uint32_t operand_rrx(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+
+    *carry = value & 0x1;
+    return ((uint32_t)cpu->cpsr.c << 31) | (value >> 1);
+}
+
+/*
+    Register specified shifts use the bottom byte of Rs (0-255). A shift by 0 leaves
+    the value and C alone, anything from 32 up shifts everything out.
+*/
+static ALWAYS_INLINE uint32_t operand_lsl_reg(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+    uint32_t amount = cpu->registers[instruction->rs] & 0xFF;
+    uint32_t clamped = amount > 33 ? 33 : amount;
+    uint64_t shifted = (uint64_t)value << clamped;
+
+    *carry = amount ? (shifted >> 32) & 0x1 : cpu->cpsr.c;
+    return shifted;
+}
+
+static ALWAYS_INLINE uint32_t operand_lsr_reg(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+    uint32_t amount = cpu->registers[instruction->rs] & 0xFF;
+    uint32_t clamped = amount > 33 ? 33 : amount;
+
+    // one extra bit at the bottom catches the last bit shifted out
+    uint64_t shifted = ((uint64_t)value << 1) >> clamped;
+
+    *carry = amount ? shifted & 0x1 : cpu->cpsr.c;
+    return shifted >> 1;
+}
+
+static ALWAYS_INLINE uint32_t operand_asr_reg(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+    uint32_t amount = cpu->registers[instruction->rs] & 0xFF;
+    uint32_t clamped = amount > 32 ? 32 : amount;
+    int64_t shifted = (int64_t)((uint64_t)(int64_t)(int32_t)value << 1) >> clamped;
+
+    *carry = amount ? shifted & 0x1 : cpu->cpsr.c;
+    return shifted >> 1;
+}
+
+static ALWAYS_INLINE uint32_t operand_ror_reg(CPU *cpu, const DecodedInstruction *instruction, uint32_t *carry) {
+    uint32_t value = cpu->registers[instruction->rm];
+    uint32_t amount = cpu->registers[instruction->rs] & 0xFF;
+    uint32_t rotate = amount & 31;
+
+    *carry = amount ? (value >> ((amount - 1) & 31)) & 0x1 : cpu->cpsr.c;
+    return (value >> rotate) | (value << ((32 - rotate) & 31));
+}
+
+// operations
+
+#define LOGICAL(name, expression, writes_result) \
+    static ALWAYS_INLINE void execute_##name(CPU *cpu, const DecodedInstruction *instruction, uint32_t op2, uint32_t carry, int set_flags) { \
+        uint32_t op1 = cpu->registers[instruction->rn]; \
+        uint32_t result = (expression); \
+        (void)op1; \
+        if (writes_result) { \
+            cpu->registers[instruction->rd] = result; \
+        } \
+        if (set_flags) { \
+            set_nzc(cpu, result, carry); \
+        } \
+    }
+
+// op1 + op2 + carry_in, subtraction is op1 + ~op2 + 1 (carry is NOT borrow)
+#define ARITHMETIC(name, a, b, carry_in, writes_result) \
+    static ALWAYS_INLINE void execute_##name(CPU *cpu, const DecodedInstruction *instruction, uint32_t op2, uint32_t carry, int set_flags) { \
+        uint32_t op1 = cpu->registers[instruction->rn]; \
+        uint32_t x = (a); \
+        uint32_t y = (b); \
+        uint64_t sum = (uint64_t)x + y + (carry_in); \
+        uint32_t result = sum; \
+        (void)carry; \
+        if (writes_result) { \
+            cpu->registers[instruction->rd] = result; \
+        } \
+        if (set_flags) { \
+            set_nzcv(cpu, result, sum >> 32, (~(x ^ y) & (x ^ result)) >> 31); \
+        } \
+    }
+
+LOGICAL(AND, op1 & op2, 1)
+LOGICAL(EOR, op1 ^ op2, 1)
+ARITHMETIC(SUB, op1, ~op2, 1, 1)
+ARITHMETIC(RSB, op2, ~op1, 1, 1)
+ARITHMETIC(ADD, op1, op2, 0, 1)
+ARITHMETIC(ADC, op1, op2, cpu->cpsr.c, 1)
+ARITHMETIC(SBC, op1, ~op2, cpu->cpsr.c, 1)
+ARITHMETIC(RSC, op2, ~op1, cpu->cpsr.c, 1)
+LOGICAL(TST, op1 & op2, 0)
+LOGICAL(TEQ, op1 ^ op2, 0)
+ARITHMETIC(CMP, op1, ~op2, 1, 0)
+ARITHMETIC(CMN, op1, op2, 0, 0)
+LOGICAL(ORR, op1 | op2, 1)
+LOGICAL(MOV, op2, 1)
+LOGICAL(BIC, op1 & ~op2, 1)
+LOGICAL(MVN, ~op2, 1)
+
+// kernels
+
+#define KERNEL(name, set_flags, form) \
+    static void alu_##name##_##set_flags##_##form(CPU *cpu, const DecodedInstruction *instruction) { \
+        uint32_t carry; \
+        uint32_t op2 = operand_##form(cpu, instruction, &carry); \
+        execute_##name(cpu, instruction, op2, carry, set_flags); \
+    }
+
+#define KERNELS_FOR_OPERATION(name) \
+    KERNEL(name, 0, imm) KERNEL(name, 0, imm_rotated) KERNEL(name, 0, reg) \
+    KERNEL(name, 0, lsl_imm) KERNEL(name, 0, lsr_imm) KERNEL(name, 0, asr_imm) KERNEL(name, 0, ror_imm) \
+    KERNEL(name, 0, rrx) \
+    KERNEL(name, 0, lsl_reg) KERNEL(name, 0, lsr_reg) KERNEL(name, 0, asr_reg) KERNEL(name, 0, ror_reg) \
+    KERNEL(name, 1, imm) KERNEL(name, 1, imm_rotated) KERNEL(name, 1, reg) \
+    KERNEL(name, 1, lsl_imm) KERNEL(name, 1, lsr_imm) KERNEL(name, 1, asr_imm) KERNEL(name, 1, ror_imm) \
+    KERNEL(name, 1, rrx) \
+    KERNEL(name, 1, lsl_reg) KERNEL(name, 1, lsr_reg) KERNEL(name, 1, asr_reg) KERNEL(name, 1, ror_reg)
+
+KERNELS_FOR_OPERATION(AND)
+KERNELS_FOR_OPERATION(EOR)
+KERNELS_FOR_OPERATION(SUB)
+KERNELS_FOR_OPERATION(RSB)
+KERNELS_FOR_OPERATION(ADD)
+KERNELS_FOR_OPERATION(ADC)
+KERNELS_FOR_OPERATION(SBC)
+KERNELS_FOR_OPERATION(RSC)
+KERNELS_FOR_OPERATION(TST)
+KERNELS_FOR_OPERATION(TEQ)
+KERNELS_FOR_OPERATION(CMP)
+KERNELS_FOR_OPERATION(CMN)
+KERNELS_FOR_OPERATION(ORR)
+KERNELS_FOR_OPERATION(MOV)
+KERNELS_FOR_OPERATION(BIC)
+KERNELS_FOR_OPERATION(MVN)
+
+#define FORMS(name, set_flags) { \
+    alu_##name##_##set_flags##_imm, alu_##name##_##set_flags##_imm_rotated, alu_##name##_##set_flags##_reg, \
+    alu_##name##_##set_flags##_lsl_imm, alu_##name##_##set_flags##_lsr_imm, \
+    alu_##name##_##set_flags##_asr_imm, alu_##name##_##set_flags##_ror_imm, \
+    alu_##name##_##set_flags##_rrx, \
+    alu_##name##_##set_flags##_lsl_reg, alu_##name##_##set_flags##_lsr_reg, \
+    alu_##name##_##set_flags##_asr_reg, alu_##name##_##set_flags##_ror_reg \
+}
+
+#define OPERATION(name) { FORMS(name, 0), FORMS(name, 1) }
+
+// [opcode][S][form]
+const AluKernel alu_kernels[16][2][ALU_FORM_COUNT] = {
+    OPERATION(AND), OPERATION(EOR), OPERATION(SUB), OPERATION(RSB),
+    OPERATION(ADD), OPERATION(ADC), OPERATION(SBC), OPERATION(RSC),
+    OPERATION(TST), OPERATION(TEQ), OPERATION(CMP), OPERATION(CMN),
+    OPERATION(ORR), OPERATION(MOV), OPERATION(BIC), OPERATION(MVN)
+};
+
+// rotated immediates, expanded by the preprocessor into all 4096 entries
+
+#define ROTATE_IMMEDIATE(index) \
+    ((((index) & 0xFFu) >> (((index) >> 8) * 2)) | (((index) & 0xFFu) << ((32 - ((index) >> 8) * 2) & 31)))
+
+#define IMMEDIATE(index) { \
+    ROTATE_IMMEDIATE(index), \
+    ((index) >> 8) ? ROTATE_IMMEDIATE(index) >> 31 : IMMEDIATE_CARRY_UNCHANGED \
+}
+
+#define IMMEDIATE_4(index) IMMEDIATE(index), IMMEDIATE((index) + 1), IMMEDIATE((index) + 2), IMMEDIATE((index) + 3)
+#define IMMEDIATE_16(index) IMMEDIATE_4(index), IMMEDIATE_4((index) + 4), IMMEDIATE_4((index) + 8), IMMEDIATE_4((index) + 12)
+#define IMMEDIATE_64(index) IMMEDIATE_16(index), IMMEDIATE_16((index) + 16), IMMEDIATE_16((index) + 32), IMMEDIATE_16((index) + 48)
+#define IMMEDIATE_256(index) IMMEDIATE_64(index), IMMEDIATE_64((index) + 64), IMMEDIATE_64((index) + 128), IMMEDIATE_64((index) + 192)
+#define IMMEDIATE_1024(index) IMMEDIATE_256(index), IMMEDIATE_256((index) + 256), IMMEDIATE_256((index) + 512), IMMEDIATE_256((index) + 768)
+
+const RotatedImmediate rotated_immediates[4096] = {
+    IMMEDIATE_1024(0), IMMEDIATE_1024(1024), IMMEDIATE_1024(2048), IMMEDIATE_1024(3072)
+};
+
+/*
+    Picks the kernel for a decoded data processing instruction. Shifts by an immediate
+    of 0 are special (LSR/ASR #0 mean #32, ROR #0 is RRX), they get normalised here so
+    the kernels don't have to check.
+*/
+void select_alu_kernel(DecodedInstruction *decoded) {
+    uint8_t form;
+
+    if (decoded->flags & DECODED_IMMEDIATE) {
+        form = decoded->shift_amount ? ALU_FORM_IMM_ROTATED : ALU_FORM_IMM;
+    } else if (decoded->flags & DECODED_SHIFT_BY_REGISTER) {
+        form = ALU_FORM_LSL_REG + decoded->shift_type;
+    } else {
+        switch (decoded->shift_type) {
+            case 0:
+                form = decoded->shift_amount ? ALU_FORM_LSL_IMM : ALU_FORM_REG;
+                break;
+            case 1:
+                form = ALU_FORM_LSR_IMM;
+                decoded->shift_amount = decoded->shift_amount ? decoded->shift_amount : 32;
+                break;
+            case 2:
+                form = ALU_FORM_ASR_IMM;
+                decoded->shift_amount = decoded->shift_amount ? decoded->shift_amount : 32;
+                break;
+            default:
+                form = decoded->shift_amount ? ALU_FORM_ROR_IMM : ALU_FORM_RRX;
+                break;
+        }
+    }
+
+    decoded->alu = alu_kernels[decoded->opcode][(decoded->flags & DECODED_SET_FLAGS) ? 1 : 0][form];
+}
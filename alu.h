@@ -0,0 +1,44 @@
+#ifndef ALU_H
+#define ALU_H
+#include <stdint.h>
+#include "decoder.h"
+
+/*
+    Operand 2 forms. Every data processing instruction is decoded into one of these
+    and gets a kernel specialised for its opcode, S bit and form.
+*/
+enum ALU_FORM {
+    ALU_FORM_IMM = 0,       // unrotated immediate, C unchanged
+    ALU_FORM_IMM_ROTATED,   // rotated immediate, C = bit 31
+    ALU_FORM_REG,           // Rm (LSL #0), C unchanged
+    ALU_FORM_LSL_IMM,       // Rm, LSL #1-31
+    ALU_FORM_LSR_IMM,       // Rm, LSR #1-32
+    ALU_FORM_ASR_IMM,       // Rm, ASR #1-32
+    ALU_FORM_ROR_IMM,       // Rm, ROR #1-31
+    ALU_FORM_RRX,           // Rm, RRX (encoded as ROR #0)
+    ALU_FORM_LSL_REG,       // Rm, <shift> Rs
+    ALU_FORM_LSR_REG,
+    ALU_FORM_ASR_REG,
+    ALU_FORM_ROR_REG,
+    ALU_FORM_COUNT
+};
+
+/*
+    ARM immediate operand 2 is an 8 bit value rotated right by twice a 4 bit amount, so
+    there are only 4096 of them. rotated_immediates is indexed by bits 0-11 of the
+    instruction. A rotate of 0 leaves C alone, otherwise C becomes bit 31.
+*/
+#define IMMEDIATE_CARRY_UNCHANGED 2
+
+typedef struct {
+    uint32_t value;
+    uint8_t carry;          // 0, 1 or IMMEDIATE_CARRY_UNCHANGED
+} RotatedImmediate;
+
+extern const RotatedImmediate rotated_immediates[4096];
+
+extern const AluKernel alu_kernels[16][2][ALU_FORM_COUNT];
+
+void select_alu_kernel(DecodedInstruction *decoded);
+
+#endif
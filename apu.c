@@ -0,0 +1,739 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "setup.h"
+#include "apu.h"
+
+#if !defined(NO_SIMD) && defined(__SSE2__)
+#define APU_SSE2
+#include <emmintrin.h>
+#endif
+
+static inline uint16_t io16(APU *apu, uint32_t offset) {
+    return *(uint16_t *)&apu->memory->io[offset];
+}
+
+static inline uint32_t io32(APU *apu, uint32_t offset) {
+    return *(uint32_t *)&apu->memory->io[offset];
+}
+
+// envelope (NRx2) and control (frequency, length enable, restart) register of each channel
+static const uint16_t envelope_registers[4] = {0x062, 0x068, 0x000, 0x078};
+static const uint16_t control_registers[4] = {0x064, 0x06C, 0x074, 0x07C};
+
+// Square 12.5%, 25%, 50% and 75%, one bit per duty step
+static const uint8_t duty_patterns[4] = {0x01, 0x03, 0x0F, 0xFC};
+
+// Timers
+
+static const uint16_t timer_prescalers[4] = {1, 64, 256, 1024};
+
+static uint32_t timer_period(APU *apu, int timer) {
+    uint16_t reload = io16(apu, IO_TM0CNT_L + timer * 4);
+    uint16_t control = io16(apu, IO_TM0CNT_L + timer * 4 + 2);
+
+    return (0x10000 - reload) * timer_prescalers[control & 0x3];
+}
+
+// timer 1 can count timer 0 overflows instead of cycles
+static int timer_counts_up(APU *apu, int timer) {
+    return timer == 1 && (io16(apu, IO_TM0CNT_L + 6) & 0x4);
+}
+
+// FIFOs
+
+static void fifo_push(SoundFifo *fifo, int8_t sample) {
+    // a full fifo drops the write
+    if (fifo->count == 32) {
+        return;
+    }
+
+    fifo->samples[(fifo->read + fifo->count) & 31] = sample;
+    fifo->count++;
+}
+
+/*
+    DMA1 and DMA2 in FIFO mode (start timing 3) send 4 words to whichever FIFO their
+    destination is every time that FIFO gets down to 16 bytes.
+*/
+static void fifo_refill(APU *apu, int channel) {
+    uint32_t fifo_address = 0x04000000 | (channel ? IO_FIFO_B : IO_FIFO_A);
+
+    for (int dma = 0; dma < 2; dma++) {
+        uint32_t registers = dma ? IO_DMA2SAD : IO_DMA1SAD;
+        uint16_t control = io16(apu, registers + 10);
+
+        if (!(control & 0x8000) || ((control >> 12) & 0x3) != 3 || io32(apu, registers + 4) != fifo_address) {
+            continue;
+        }
+
+        // source control: 0 increment, 1 decrement, 2 fixed, 3 increment
+        int32_t step = ((control >> 7) & 0x3) == 1 ? -4 : ((control >> 7) & 0x3) == 2 ? 0 : 4;
+
+        for (int i = 0; i < 4; i++) {
+            uint32_t word = fetch_memory_word(apu->memory, apu->dma_source[dma]);
+
+            for (int byte = 0; byte < 4; byte++) {
+                fifo_push(&apu->fifo[channel], (int8_t)(word >> (byte * 8)));
+            }
+
+            apu->dma_source[dma] += step;
+        }
+
+        return;
+    }
+}
+
+static void timer_overflow(APU *apu, int timer) {
+    uint16_t soundcnt_h = io16(apu, IO_SOUNDCNT_H);
+
+    // SOUNDCNT_H bit 10 and 14 pick the timer of FIFO A and B
+    for (int channel = 0; channel < 2; channel++) {
+        SoundFifo *fifo = &apu->fifo[channel];
+
+        if (((soundcnt_h >> (channel ? 14 : 10)) & 0x1) != timer) {
+            continue;
+        }
+
+        if (fifo->count > 0) {
+            fifo->current = fifo->samples[fifo->read];
+            fifo->read = (fifo->read + 1) & 31;
+            fifo->count--;
+        }
+
+        if (fifo->count <= 16) {
+            fifo_refill(apu, channel);
+        }
+    }
+
+    if (timer == 0 && apu->timers[1].running && timer_counts_up(apu, 1)) {
+        SoundTimer *cascade = &apu->timers[1];
+
+        if (++cascade->count_up_value > 0xFFFF) {
+            cascade->count_up_value = io16(apu, IO_TM0CNT_L + 4);
+            timer_overflow(apu, 1);
+        }
+    }
+}
+
+// PSG
+
+static void trigger_channel(APU *apu, int channel, uint16_t control) {
+    PsgChannel *psg = &apu->psg[channel];
+
+    psg->on = 1;
+    psg->counter = 0;
+    psg->position = 0;
+
+    if (channel == 2) {
+        // wave, SOUND3CNT_L bit 7 is the channel's DAC
+        if (psg->length == 0) {
+            psg->length = 256;
+        }
+
+        psg->on = (io16(apu, 0x070) >> 7) & 0x1;
+        return;
+    }
+
+    uint16_t envelope = io16(apu, envelope_registers[channel]);
+
+    if (psg->length == 0) {
+        psg->length = 64;
+    }
+
+    psg->volume = envelope >> 12;
+    psg->envelope_step = (envelope >> 8) & 0x7;
+
+    // initial volume 0 going down turns the DAC off
+    if ((envelope & 0xF800) == 0) {
+        psg->on = 0;
+    }
+
+    if (channel == 0) {
+        psg->sweep_step = (io16(apu, IO_SOUND1CNT_L) >> 4) & 0x7;
+    }
+
+    if (channel == 3) {
+        // 15 or 7 bit lfsr
+        psg->position = (control & 0x8) ? 0x7F : 0x7FFF;
+    }
+}
+
+static void set_frequency(APU *apu, int channel, uint16_t control) {
+    PsgChannel *psg = &apu->psg[channel];
+
+    if (channel == 3) {
+        uint32_t ratio = control & 0x7;
+        uint32_t shift = (control >> 4) & 0xF;
+
+        psg->period = (ratio ? ratio * 64 : 32) << shift;
+        return;
+    }
+
+    psg->frequency = control & 0x7FF;
+    psg->period = (2048 - psg->frequency) * (channel == 2 ? 8 : 16);
+}
+
+// 512 Hz: length at 256 Hz, sweep at 128 Hz and envelopes at 64 Hz
+static void frame_sequencer(APU *apu) {
+    uint8_t step = apu->sequencer_step;
+
+    apu->sequencer_step = (step + 1) & 7;
+
+    for (int channel = 0; channel < 4; channel++) {
+        PsgChannel *psg = &apu->psg[channel];
+
+        if ((step & 1) == 0 && (io16(apu, control_registers[channel]) & 0x4000) && psg->length > 0) {
+            if (--psg->length == 0) {
+                psg->on = 0;
+            }
+        }
+
+        if (step == 7 && channel != 2) {
+            uint16_t envelope = io16(apu, envelope_registers[channel]);
+            uint8_t time = (envelope >> 8) & 0x7;
+
+            if (time != 0 && --psg->envelope_step == 0) {
+                psg->envelope_step = time;
+
+                if ((envelope & 0x800) && psg->volume < 15) {
+                    psg->volume++;
+                } else if (!(envelope & 0x800) && psg->volume > 0) {
+                    psg->volume--;
+                }
+            }
+        }
+    }
+
+    PsgChannel *sweep = &apu->psg[0];
+    uint16_t sweep_control = io16(apu, IO_SOUND1CNT_L);
+    uint8_t sweep_time = (sweep_control >> 4) & 0x7;
+
+    if ((step == 2 || step == 6) && sweep->on && sweep_time != 0 && --sweep->sweep_step == 0) {
+        uint8_t shift = sweep_control & 0x7;
+        int32_t change = sweep->frequency >> shift;
+        int32_t frequency = (sweep_control & 0x8) ? sweep->frequency - change : sweep->frequency + change;
+
+        sweep->sweep_step = sweep_time;
+
+        if (frequency > 2047) {
+            sweep->on = 0;
+        } else if (shift != 0 && frequency >= 0) {
+            sweep->frequency = frequency;
+            sweep->period = (2048 - frequency) * 16;
+        }
+    }
+}
+
+// advances the channel by one sample and returns its output, -15 to 15
+static int16_t channel_sample(APU *apu, int channel) {
+    PsgChannel *psg = &apu->psg[channel];
+
+    if (!psg->on || psg->period == 0) {
+        return 0;
+    }
+
+    psg->counter += APU_CYCLES_PER_SAMPLE;
+    uint32_t steps = psg->counter / psg->period;
+    psg->counter %= psg->period;
+
+    switch (channel) {
+        case 0:
+        case 1: {
+            // the duty is in the same register as the envelope
+            uint8_t duty = (io16(apu, envelope_registers[channel]) >> 6) & 0x3;
+
+            psg->position = (psg->position + steps) & 7;
+            return ((duty_patterns[duty] >> psg->position) & 0x1) ? psg->volume : -psg->volume;
+        }
+        case 2: {
+            uint16_t select = io16(apu, 0x070);
+            uint16_t control = io16(apu, 0x072);
+            uint8_t two_banks = (select >> 5) & 0x1;
+            uint8_t bank = (select >> 6) & 0x1;
+
+            psg->position = (psg->position + steps) & (two_banks ? 63 : 31);
+
+            // a 64 sample wave plays the selected bank first
+            if (two_banks) {
+                bank ^= psg->position >> 5;
+            }
+
+            uint8_t byte = apu->wave_ram[bank][(psg->position & 31) / 2];
+            int16_t sample = ((psg->position & 1) ? byte & 0xF : byte >> 4) * 2 - 15;
+
+            if (control & 0x8000) {
+                return sample * 3 / 4;
+            }
+
+            // 0%, 100%, 50%, 25%
+            switch ((control >> 13) & 0x3) {
+                case 0:
+                    return 0;
+                case 1:
+                    return sample;
+                case 2:
+                    return sample / 2;
+                default:
+                    return sample / 4;
+            }
+        }
+        default: {
+            uint8_t width_7 = (io16(apu, 0x07C) >> 3) & 0x1;
+
+            for (uint32_t i = 0; i < steps; i++) {
+                uint32_t bit = (psg->position ^ (psg->position >> 1)) & 0x1;
+
+                psg->position = (psg->position >> 1) | (bit << 14);
+
+                if (width_7) {
+                    psg->position = (psg->position & ~0x40u) | (bit << 6);
+                }
+            }
+
+            return (psg->position & 0x1) ? -psg->volume : psg->volume;
+        }
+    }
+}
+
+// Mixing
+
+static void write_sink(APU *apu, const int16_t *frames, uint32_t count) {
+    apu->frames_output += count;
+
+    if (apu->pcm_callback != NULL) {
+        apu->pcm_callback(apu->pcm_context, frames, count);
+    }
+
+    if (apu->sink == NULL) {
+        return;
+    }
+
+    apu->sink_bytes += fwrite(frames, 4, count, apu->sink) * 4;
+}
+
+typedef struct {
+    int16_t psg_shift;
+    int16_t gain[2][2];                 // [fifo][side], 0, 1 (50%) or 2 (100%)
+    int16_t bias;
+} MixLevels;
+
+/*
+    Each side is psg >> shift + fifo a * gain + fifo b * gain + bias, clamped to the
+    10 bit DAC range and centered. The scalar loop also finishes what the SSE2 one leaves.
+*/
+static void mix_scalar(APU *apu, const MixLevels *levels, uint32_t start, uint32_t count) {
+    for (uint32_t i = start; i < count; i++) {
+        int16_t psg[2] = {apu->psg_left[i], apu->psg_right[i]};
+
+        for (int side = 0; side < 2; side++) {
+            int32_t level = (psg[side] >> levels->psg_shift) + apu->fifo_a[i] * levels->gain[0][side] +
+                            apu->fifo_b[i] * levels->gain[1][side] + levels->bias;
+
+            level = level < 0 ? 0 : level > 0x3FF ? 0x3FF : level;
+            apu->mixed[(i + 1) * 2 + side] = (level - 0x200) << 6;
+        }
+    }
+}
+
+#ifdef APU_SSE2
+static uint32_t mix_sse2(APU *apu, const MixLevels *levels, uint32_t count) {
+    __m128i shift = _mm_cvtsi32_si128(levels->psg_shift);
+    __m128i gain_a_left = _mm_set1_epi16(levels->gain[0][0]);
+    __m128i gain_a_right = _mm_set1_epi16(levels->gain[0][1]);
+    __m128i gain_b_left = _mm_set1_epi16(levels->gain[1][0]);
+    __m128i gain_b_right = _mm_set1_epi16(levels->gain[1][1]);
+    __m128i bias = _mm_set1_epi16(levels->bias);
+    __m128i low = _mm_setzero_si128();
+    __m128i high = _mm_set1_epi16(0x3FF);
+    __m128i center = _mm_set1_epi16(0x200);
+    uint32_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&apu->fifo_a[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&apu->fifo_b[i]);
+        __m128i left = _mm_sra_epi16(_mm_loadu_si128((const __m128i *)&apu->psg_left[i]), shift);
+        __m128i right = _mm_sra_epi16(_mm_loadu_si128((const __m128i *)&apu->psg_right[i]), shift);
+
+        left = _mm_add_epi16(left, _mm_add_epi16(_mm_mullo_epi16(a, gain_a_left), _mm_mullo_epi16(b, gain_b_left)));
+        right = _mm_add_epi16(right, _mm_add_epi16(_mm_mullo_epi16(a, gain_a_right), _mm_mullo_epi16(b, gain_b_right)));
+        left = _mm_slli_epi16(_mm_sub_epi16(_mm_min_epi16(_mm_max_epi16(_mm_add_epi16(left, bias), low), high), center), 6);
+        right = _mm_slli_epi16(_mm_sub_epi16(_mm_min_epi16(_mm_max_epi16(_mm_add_epi16(right, bias), low), high), center), 6);
+
+        // interleave into stereo frames
+        _mm_storeu_si128((__m128i *)&apu->mixed[(i + 1) * 2], _mm_unpacklo_epi16(left, right));
+        _mm_storeu_si128((__m128i *)&apu->mixed[(i + 5) * 2], _mm_unpackhi_epi16(left, right));
+    }
+
+    return i;
+}
+#endif
+
+/*
+    Linear interpolation from APU_SAMPLE_RATE to AUDIO_HOST_RATE with a 14 bit weight,
+    frame n is mixed[n] * (1 - f) + mixed[n + 1] * f. Returns the number of frames made.
+*/
+static uint32_t resample_scalar(APU *apu, uint32_t count, uint32_t produced) {
+    const int16_t *mixed = apu->mixed;
+
+    while ((apu->resample_position >> 32) < count) {
+        uint32_t n = apu->resample_position >> 32;
+        int32_t f = (apu->resample_position >> 18) & 0x3FFF;
+
+        for (int side = 0; side < 2; side++) {
+            apu->output[produced * 2 + side] = (mixed[n * 2 + side] * (0x4000 - f) + mixed[(n + 1) * 2 + side] * f) >> 14;
+        }
+
+        produced++;
+        apu->resample_position += apu->resample_step;
+    }
+
+    return produced;
+}
+
+#ifdef APU_SSE2
+static uint32_t resample_sse2(APU *apu, uint32_t count) {
+    const uint32_t *frames = (const uint32_t *)apu->mixed;
+    uint64_t step = apu->resample_step;
+    uint32_t produced = 0;
+
+    // 4 frames at a time, both channels of a frame are one 32 bit lane
+    while (((apu->resample_position + step * 3) >> 32) < count) {
+        uint32_t n[4], weight[4];
+
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t position = apu->resample_position + step * lane;
+            uint32_t f = (position >> 18) & 0x3FFF;
+
+            n[lane] = position >> 32;
+            weight[lane] = (f << 16) | (0x4000 - f);
+        }
+
+        __m128i a = _mm_setr_epi32(frames[n[0]], frames[n[1]], frames[n[2]], frames[n[3]]);
+        __m128i b = _mm_setr_epi32(frames[n[0] + 1], frames[n[1] + 1], frames[n[2] + 1], frames[n[3] + 1]);
+
+        // (a, b) pairs per channel times ((1 - f), f) pairs
+        __m128i first = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), _mm_setr_epi32(weight[0], weight[0], weight[1], weight[1]));
+        __m128i second = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), _mm_setr_epi32(weight[2], weight[2], weight[3], weight[3]));
+
+        _mm_storeu_si128((__m128i *)&apu->output[produced * 2], _mm_packs_epi32(_mm_srai_epi32(first, 14), _mm_srai_epi32(second, 14)));
+
+        produced += 4;
+        apu->resample_position += step * 4;
+    }
+
+    return produced;
+}
+#endif
+
+static void mix_pending(APU *apu) {
+    uint32_t count = apu->pending;
+
+    if (count == 0) {
+        return;
+    }
+
+    uint16_t soundcnt_h = io16(apu, IO_SOUNDCNT_H);
+    MixLevels levels;
+
+    // 25%, 50%, 100% (3 is prohibited)
+    levels.psg_shift = (soundcnt_h & 0x3) >= 2 ? 0 : 2 - (soundcnt_h & 0x3);
+    // bits 1-9 are the bias on the 10 bit DAC scale, 0x200 by default
+    levels.bias = io16(apu, IO_SOUNDBIAS) & 0x3FE;
+
+    for (int fifo = 0; fifo < 2; fifo++) {
+        for (int side = 0; side < 2; side++) {
+            uint8_t enabled = (soundcnt_h >> (8 + fifo * 4 + (side ? 0 : 1))) & 0x1;
+            levels.gain[fifo][side] = enabled ? 1 + ((soundcnt_h >> (2 + fifo)) & 0x1) : 0;
+        }
+    }
+
+    uint32_t mixed = 0;
+    uint32_t produced = 0;
+
+#ifdef APU_SSE2
+    mixed = mix_sse2(apu, &levels, count);
+#endif
+    mix_scalar(apu, &levels, mixed, count);
+
+#ifdef APU_SSE2
+    produced = resample_sse2(apu, count);
+#endif
+    produced = resample_scalar(apu, count, produced);
+
+    write_sink(apu, apu->output, produced);
+
+    // the last frame is needed to interpolate up to the first one of the next block
+    apu->mixed[0] = apu->mixed[count * 2];
+    apu->mixed[1] = apu->mixed[count * 2 + 1];
+    apu->resample_position -= (uint64_t)count << 32;
+    apu->pending = 0;
+}
+
+static void generate_sample(APU *apu) {
+    if (--apu->sequencer_ticks == 0) {
+        apu->sequencer_ticks = 64;
+        frame_sequencer(apu);
+    }
+
+    uint16_t soundcnt_l = io16(apu, IO_SOUNDCNT_L);
+    int16_t left = 0, right = 0;
+    int16_t fifo_a = 0, fifo_b = 0;
+
+    // SOUNDCNT_X bit 7 is the master enable
+    if (io16(apu, IO_SOUNDCNT_X) & 0x80) {
+        for (int channel = 0; channel < 4; channel++) {
+            int16_t sample = channel_sample(apu, channel);
+
+            right += ((soundcnt_l >> (8 + channel)) & 0x1) ? sample : 0;
+            left += ((soundcnt_l >> (12 + channel)) & 0x1) ? sample : 0;
+        }
+
+        // master volumes are 1-8
+        left *= 1 + ((soundcnt_l >> 4) & 0x7);
+        right *= 1 + (soundcnt_l & 0x7);
+        fifo_a = apu->fifo[0].current;
+        fifo_b = apu->fifo[1].current;
+    }
+
+    apu->psg_left[apu->pending] = left;
+    apu->psg_right[apu->pending] = right;
+    apu->fifo_a[apu->pending] = fifo_a;
+    apu->fifo_b[apu->pending] = fifo_b;
+
+    if (++apu->pending == APU_BLOCK) {
+        mix_pending(apu);
+    }
+}
+
+// Interface
+
+APU *apu_create(Memory *memory, const uint64_t *clock) {
+    APU *apu = calloc(1, sizeof(APU));
+
+    if (apu == NULL) {
+        fprintf(stderr, "Could not allocate the apu\n");
+        return NULL;
+    }
+
+    apu->memory = memory;
+    apu->clock = clock;
+    apu->cycles = *clock;
+    apu->next_sample = *clock + APU_CYCLES_PER_SAMPLE;
+    apu->sequencer_ticks = 64;
+    apu->resample_step = ((uint64_t)APU_SAMPLE_RATE << 32) / AUDIO_HOST_RATE;
+
+    return apu;
+}
+
+static void put16(uint8_t *out, uint16_t value) {
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void put32(uint8_t *out, uint32_t value) {
+    put16(out, value);
+    put16(out + 2, value >> 16);
+}
+
+// 16 bit stereo PCM at AUDIO_HOST_RATE, write it again with the size when the data is done
+void wav_write_header(FILE *file, uint32_t data_size) {
+    uint8_t header[44];
+
+    memcpy(header, "RIFF", 4);
+    put32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put32(header + 16, 16);
+    put16(header + 20, 1);
+    put16(header + 22, 2);
+    put32(header + 24, AUDIO_HOST_RATE);
+    put32(header + 28, AUDIO_HOST_RATE * 4);
+    put16(header + 32, 4);
+    put16(header + 34, 16);
+    memcpy(header + 36, "data", 4);
+    put32(header + 40, data_size);
+
+    fwrite(header, 1, sizeof(header), file);
+}
+
+// a path ending in .wav gets a wav file, anything else raw 16 bit stereo little endian
+int apu_open_sink(APU *apu, const char *path) {
+    size_t length = strlen(path);
+
+    apu->sink = fopen(path, "wb");
+
+    if (apu->sink == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+
+    apu->sink_wav = length >= 4 && strcmp(path + length - 4, ".wav") == 0;
+
+    if (apu->sink_wav) {
+        wav_write_header(apu->sink, 0);
+    }
+
+    return 0;
+}
+
+void apu_run(APU *apu, uint64_t cycles) {
+    while (1) {
+        uint64_t next = apu->next_sample;
+        int timer = -1;
+
+        for (int i = 0; i < 2; i++) {
+            if (apu->timers[i].running && !timer_counts_up(apu, i) && apu->timers[i].next_overflow < next) {
+                next = apu->timers[i].next_overflow;
+                timer = i;
+            }
+        }
+
+        if (next > cycles) {
+            break;
+        }
+
+        if (timer >= 0) {
+            // the reload value is picked up again at every overflow
+            apu->timers[timer].next_overflow += timer_period(apu, timer);
+            timer_overflow(apu, timer);
+        } else {
+            apu->next_sample += APU_CYCLES_PER_SAMPLE;
+            generate_sample(apu);
+        }
+    }
+
+    apu->cycles = cycles;
+}
+
+// offset is an io offset, called before value is stored so the old value is still in io
+void apu_write(APU *apu, uint32_t offset, uint16_t value) {
+    uint16_t old = io16(apu, offset);
+
+    apu_run(apu, *apu->clock);
+
+    switch (offset) {
+        case 0x062:
+        case 0x068:
+        case 0x078:
+            apu->psg[offset == 0x062 ? 0 : offset == 0x068 ? 1 : 3].length = 64 - (value & 0x3F);
+            return;
+        case 0x072:
+            apu->psg[2].length = 256 - (value & 0xFF);
+            return;
+        case 0x064:
+        case 0x06C:
+        case 0x074:
+        case 0x07C: {
+            int channel = (offset - 0x064) / 8;
+
+            set_frequency(apu, channel, value);
+
+            if (value & 0x8000) {
+                trigger_channel(apu, channel, value);
+            }
+            return;
+        }
+        case 0x070:
+            if (!(value & 0x80)) {
+                apu->psg[2].on = 0;
+            }
+            return;
+        case IO_SOUNDBIAS:
+            mix_pending(apu);
+            return;
+        case IO_SOUNDCNT_H:
+            mix_pending(apu);
+
+            // bit 11 and 15 reset the FIFOs
+            for (int channel = 0; channel < 2; channel++) {
+                if (value & (channel ? 0x8000 : 0x800)) {
+                    apu->fifo[channel].count = 0;
+                    apu->fifo[channel].read = 0;
+                }
+            }
+            return;
+        case IO_SOUNDCNT_X:
+            if (!(value & 0x80)) {
+                memset(apu->psg, 0, sizeof(apu->psg));
+            }
+            return;
+        case IO_FIFO_A:
+        case IO_FIFO_A + 2:
+        case IO_FIFO_B:
+        case IO_FIFO_B + 2: {
+            SoundFifo *fifo = &apu->fifo[offset >= IO_FIFO_B];
+
+            fifo_push(fifo, (int8_t)value);
+            fifo_push(fifo, (int8_t)(value >> 8));
+            return;
+        }
+        case IO_DMA1CNT_H:
+        case IO_DMA2CNT_H:
+            // the source address is latched when the channel is enabled
+            if (!(old & 0x8000) && (value & 0x8000)) {
+                int dma = offset == IO_DMA2CNT_H;
+                apu->dma_source[dma] = io32(apu, dma ? IO_DMA2SAD : IO_DMA1SAD) & 0x0FFFFFFC;
+            }
+            return;
+        case IO_TM0CNT_L + 2:
+        case IO_TM0CNT_L + 6: {
+            int timer = offset == IO_TM0CNT_L + 6;
+            SoundTimer *sound_timer = &apu->timers[timer];
+
+            if (!(value & 0x80)) {
+                sound_timer->running = 0;
+            } else if (!(old & 0x80)) {
+                // started, counts from the reload value
+                uint16_t reload = io16(apu, IO_TM0CNT_L + timer * 4);
+
+                sound_timer->running = 1;
+                sound_timer->count_up_value = reload;
+                sound_timer->next_overflow = apu->cycles + (0x10000 - reload) * timer_prescalers[value & 0x3];
+            }
+            return;
+        }
+    }
+
+    // the cpu sees the wave bank that isn't playing
+    if (offset >= IO_WAVE_RAM && offset < IO_WAVE_RAM + 16) {
+        uint8_t bank = !((io16(apu, 0x070) >> 6) & 0x1);
+
+        apu->wave_ram[bank][offset - IO_WAVE_RAM] = value;
+        apu->wave_ram[bank][offset - IO_WAVE_RAM + 1] = value >> 8;
+    }
+}
+
+// gets every block of frames after resampling, on the emulation thread
+void apu_set_pcm_callback(APU *apu, void (*callback)(void *context, const int16_t *frames, uint32_t count), void *context) {
+    apu->pcm_callback = callback;
+    apu->pcm_context = context;
+}
+
+void apu_flush(APU *apu) {
+    apu_run(apu, *apu->clock);
+    mix_pending(apu);
+
+    if (apu->sink != NULL) {
+        fflush(apu->sink);
+    }
+}
+
+void apu_destroy(APU *apu) {
+    if (apu == NULL) {
+        return;
+    }
+
+    apu_flush(apu);
+
+    if (apu->sink != NULL) {
+        if (apu->sink_wav) {
+            fseek(apu->sink, 0, SEEK_SET);
+            wav_write_header(apu->sink, apu->sink_bytes);
+        }
+
+        fclose(apu->sink);
+    }
+
+    free(apu);
+}
@@ -0,0 +1,111 @@
+#ifndef APU_H
+#define APU_H
+#include <stdint.h>
+#include <stdio.h>
+#include "setup.h"
+
+/*
+    Sound: the four PSG channels and the two Direct Sound FIFOs.
+
+    The apu runs behind the cpu and catches up to the scheduler's cycle count at every
+    scheduler event and before every write to a register it cares about, so changes
+    land with block accuracy. It generates one sample every 512 cycles (32768 Hz, the
+    default SOUNDBIAS rate), mixes blocks of them and resamples to AUDIO_HOST_RATE.
+
+    Timers 0 and 1 and the DMA1/DMA2 FIFO transfers are done here as far as sound needs
+    them (overflows pop the FIFOs, a FIFO at half empty pulls 16 bytes). The apu never
+    writes emulated state (no timer/DMA IRQs, no status bits), so a run with --no-audio
+    behaves exactly the same.
+*/
+
+#define APU_SAMPLE_RATE 32768
+#define APU_CYCLES_PER_SAMPLE 512
+#define APU_BLOCK 1024                  // samples mixed at once
+#define AUDIO_HOST_RATE 48000
+
+// io registers the apu looks at (0x060-0x107)
+#define IO_SOUND1CNT_L 0x060
+#define IO_SOUNDCNT_L 0x080
+#define IO_SOUNDCNT_H 0x082
+#define IO_SOUNDCNT_X 0x084
+#define IO_SOUNDBIAS 0x088
+#define IO_WAVE_RAM 0x090
+#define IO_FIFO_A 0x0A0
+#define IO_FIFO_B 0x0A4
+#define IO_DMA1SAD 0x0BC
+#define IO_DMA1CNT_H 0x0C6
+#define IO_DMA2SAD 0x0C8
+#define IO_DMA2CNT_H 0x0D2
+#define IO_TM0CNT_L 0x100
+#define IO_APU_END 0x108
+
+typedef struct {
+    uint8_t on;
+    uint8_t volume;                     // 0-15, set by the envelope
+    uint8_t envelope_step;              // envelope ticks until the next change
+    uint8_t sweep_step;                 // channel 1 only
+    uint16_t length;                    // ticks left, only counts down with length enabled
+    uint16_t frequency;                 // 11 bit register value
+    uint32_t period;                    // cycles per duty step, wave sample or lfsr shift
+    uint32_t counter;                   // cycles into the current step
+    uint32_t position;                  // duty step, wave sample or lfsr
+} PsgChannel;
+
+typedef struct {
+    int8_t samples[32];
+    uint8_t read;
+    uint8_t count;
+    int8_t current;                     // last sample popped, what the channel outputs
+} SoundFifo;
+
+typedef struct {
+    uint8_t running;
+    uint64_t next_overflow;             // cycle of the next overflow (not used for count up)
+    uint32_t count_up_value;            // counter of a count up (cascade) timer
+} SoundTimer;
+
+typedef struct APU {
+    Memory *memory;
+    const uint64_t *clock;              // scheduler cycle count
+    uint64_t cycles;                    // caught up to here
+    uint64_t next_sample;
+    uint8_t sequencer_ticks;            // samples until the next 512 Hz frame sequencer step
+    uint8_t sequencer_step;
+
+    PsgChannel psg[4];
+    uint8_t wave_ram[2][16];
+    SoundFifo fifo[2];
+    SoundTimer timers[2];
+    uint32_t dma_source[2];             // internal source address of DMA1 and DMA2
+
+    // samples not mixed yet, psg already summed per side
+    int16_t psg_left[APU_BLOCK];
+    int16_t psg_right[APU_BLOCK];
+    int16_t fifo_a[APU_BLOCK];
+    int16_t fifo_b[APU_BLOCK];
+    uint32_t pending;
+
+    // mixed stereo frames at APU_SAMPLE_RATE, frame 0 is the last one of the previous block
+    int16_t mixed[(APU_BLOCK + 1) * 2];
+    uint64_t resample_position;         // 32.32 in frames of mixed
+    uint64_t resample_step;
+    int16_t output[(APU_BLOCK * 2 + 8) * 2];
+
+    FILE *sink;
+    void (*pcm_callback)(void *context, const int16_t *frames, uint32_t count);
+    void *pcm_context;
+    uint8_t sink_wav;
+    uint64_t sink_bytes;
+    uint64_t frames_output;
+} APU;
+
+APU *apu_create(Memory *memory, const uint64_t *clock);
+int apu_open_sink(APU *apu, const char *path);
+void apu_set_pcm_callback(APU *apu, void (*callback)(void *context, const int16_t *frames, uint32_t count), void *context);
+void apu_run(APU *apu, uint64_t cycles);
+void apu_write(APU *apu, uint32_t offset, uint16_t value);
+void apu_flush(APU *apu);
+void apu_destroy(APU *apu);
+void wav_write_header(FILE *file, uint32_t data_size);
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+typedef struct ArenaChunk {
+    uint8_t *base;
+    size_t size;
+    struct ArenaChunk *next;
+} ArenaChunk;
+
+typedef struct {
+    size_t slot_size;               // 0 for an unused pool
+    uint8_t huge_pages;
+    ArenaChunk *chunks;
+    uint8_t *carve;                 // next never used slot in the newest chunk
+    uint8_t *carve_end;
+    void *free_list;                // freed slots, linked through their first bytes
+} ArenaPool;
+
+static ArenaPool pools[ARENA_POOLS];
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t round_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// address space for at least one slot, 2 MByte aligned for huge pages
+static int add_chunk(ArenaPool *pool) {
+    size_t size = round_up(pool->slot_size, ARENA_CHUNK_SIZE);
+    size_t alignment = pool->huge_pages ? ARENA_HUGE_PAGE_SIZE : 0;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk));
+    uint8_t *mapping = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (chunk == NULL || mapping == MAP_FAILED) {
+        fprintf(stderr, "Could not map a %zu byte arena chunk\n", size);
+        free(chunk);
+        return -1;
+    }
+
+    uint8_t *base = mapping;
+
+    if (alignment) {
+        // trim to an aligned start, the kernel can only use huge pages for aligned 2 MBytes
+        base = (uint8_t *)round_up((uintptr_t)mapping, alignment);
+
+        if (base != mapping) {
+            munmap(mapping, base - mapping);
+        }
+
+        munmap(base + size, mapping + alignment - base);
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    chunk->base = base;
+    chunk->size = size;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->carve = base;
+    pool->carve_end = base + size;
+
+    return 0;
+}
+
+static ArenaPool *find_pool(size_t slot_size, uint8_t huge_pages) {
+    for (int i = 0; i < ARENA_POOLS; i++) {
+        if (pools[i].slot_size == slot_size && pools[i].huge_pages == huge_pages) {
+            return &pools[i];
+        }
+    }
+
+    for (int i = 0; i < ARENA_POOLS; i++) {
+        if (pools[i].slot_size == 0) {
+            pools[i].slot_size = slot_size;
+            pools[i].huge_pages = huge_pages;
+            return &pools[i];
+        }
+    }
+
+    fprintf(stderr, "More than %d arena block sizes\n", ARENA_POOLS);
+    return NULL;
+}
+
+// zeroed, ARENA_ALIGN aligned, NULL if out of memory
+void *arena_alloc(size_t size, int huge_pages) {
+    void *block = NULL;
+
+    pthread_mutex_lock(&arena_lock);
+
+    ArenaPool *pool = find_pool(round_up(size, ARENA_ALIGN), huge_pages != 0);
+
+    if (pool != NULL && pool->free_list != NULL) {
+        block = pool->free_list;
+        memcpy(&pool->free_list, block, sizeof(void *));
+        memset(block, 0, pool->slot_size);
+    } else if (pool != NULL) {
+        // fresh slots come straight from mmap, already zero
+        if ((size_t)(pool->carve_end - pool->carve) < pool->slot_size && add_chunk(pool) != 0) {
+            pthread_mutex_unlock(&arena_lock);
+            return NULL;
+        }
+
+        block = pool->carve;
+        pool->carve += pool->slot_size;
+    }
+
+    pthread_mutex_unlock(&arena_lock);
+
+    return block;
+}
+
+void arena_free(void *block) {
+    if (block == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&arena_lock);
+
+    for (int i = 0; i < ARENA_POOLS; i++) {
+        for (ArenaChunk *chunk = pools[i].chunks; chunk != NULL; chunk = chunk->next) {
+            if ((uint8_t *)block >= chunk->base && (uint8_t *)block < chunk->base + chunk->size) {
+                memcpy(block, &pools[i].free_list, sizeof(void *));
+                pools[i].free_list = block;
+                pthread_mutex_unlock(&arena_lock);
+                return;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&arena_lock);
+    fprintf(stderr, "%p isn't from the arena\n", block);
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Pooled allocator for the per-instance mutable regions (Memory, erased save
+    memory), so hundreds of instances pack tightly.
+
+    Blocks of one size come from a pool of slots, each slot aligned to a cache line
+    and back to back with the next. A pool gets ARENA_CHUNK_SIZE of address space at
+    a time with mmap, a freed slot goes on the pool's free list and is zeroed when it
+    is handed out again (arena_alloc returns zeroed memory like calloc).
+
+    With huge_pages the chunks are 2 MByte aligned and asked to be backed by
+    transparent huge pages (MADV_HUGEPAGE), so the hot regions of several instances
+    share one TLB entry. Whether the kernel does it depends on
+    /sys/kernel/mm/transparent_hugepage/enabled, nothing fails if it doesn't.
+
+    Chunks are kept for the life of the process. Everything is behind one mutex,
+    instances can be created and destroyed from any thread.
+*/
+
+#define ARENA_ALIGN 64                              // cache line
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_CHUNK_SIZE (8 * 1024 * 1024)          // multiple of ARENA_HUGE_PAGE_SIZE
+#define ARENA_POOLS 8                               // different (size, huge_pages) pairs
+
+void *arena_alloc(size_t size, int huge_pages);
+void arena_free(void *block);
+
+#endif
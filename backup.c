@@ -0,0 +1,322 @@
+#define _GNU_SOURCE                     // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "setup.h"
+#include "backup.h"
+#include "arena.h"
+
+// ids the chips answer with, the Panasonic 64 KByte and Macronix 128 KByte parts
+#define FLASH_64K_MANUFACTURER 0x32
+#define FLASH_64K_DEVICE 0x1B
+#define FLASH_128K_MANUFACTURER 0xC2
+#define FLASH_128K_DEVICE 0x09
+
+// the save library's id string in the rom tells which chip the cartridge has
+uint8_t backup_detect(Memory *memory) {
+    static const struct {
+        const char *id;
+        uint8_t type;
+    } ids[] = {
+        {"FLASH1M_V", BACKUP_FLASH_128K},
+        {"FLASH512_V", BACKUP_FLASH_64K},
+        {"FLASH_V", BACKUP_FLASH_64K},
+        {"SRAM_F_V", BACKUP_SRAM},
+        {"SRAM_V", BACKUP_SRAM},
+        {"EEPROM_V", BACKUP_NONE},
+    };
+
+    for (uint32_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+        if (memmem(memory->rom, memory->rom_size, ids[i].id, strlen(ids[i].id)) != NULL) {
+            if (ids[i].type == BACKUP_NONE) {
+                fprintf(stderr, "EEPROM saves aren't supported\n");
+            }
+
+            return ids[i].type;
+        }
+    }
+
+    return BACKUP_NONE;
+}
+
+static uint32_t backup_size(uint8_t type) {
+    switch (type) {
+        case BACKUP_SRAM:
+            return BACKUP_SRAM_SIZE;
+        case BACKUP_FLASH_64K:
+            return BACKUP_FLASH_BANK_SIZE;
+        case BACKUP_FLASH_128K:
+            return BACKUP_MAX_SIZE;
+        default:
+            return 0;
+    }
+}
+
+/*
+    Maps the first size bytes of path shared, growing the file with erased (0xFF) bytes
+    if it is short. With no path the storage is anonymous and starts erased.
+*/
+Backup *backup_create(uint8_t type, const char *path) {
+    uint32_t size = backup_size(type);
+
+    if (size == 0) {
+        return NULL;
+    }
+
+    Backup *backup = calloc(1, sizeof(Backup));
+
+    if (backup == NULL) {
+        fprintf(stderr, "Could not allocate the backup memory\n");
+        return NULL;
+    }
+
+    backup->type = type;
+    backup->size = size;
+
+    if (path == NULL) {
+        backup->data = arena_alloc(size, 0);
+
+        if (backup->data == NULL) {
+            fprintf(stderr, "Could not allocate the backup memory\n");
+            free(backup);
+            return NULL;
+        }
+
+        memset(backup->data, 0xFF, size);
+        return backup;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat file;
+
+    if (fd < 0 || fstat(fd, &file) != 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        free(backup);
+        return NULL;
+    }
+
+    uint32_t existing = file.st_size < size ? file.st_size : size;
+
+    if (existing < size && ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Could not resize %s\n", path);
+        close(fd);
+        free(backup);
+        return NULL;
+    }
+
+    backup->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (backup->data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        free(backup);
+        return NULL;
+    }
+
+    backup->mapped = 1;
+
+    if (existing < size) {
+        memset(backup->data + existing, 0xFF, size - existing);
+    }
+
+    return backup;
+}
+
+static inline void mark_dirty(Backup *backup, uint32_t offset, uint32_t size) {
+    for (uint32_t sector = offset / BACKUP_SECTOR_SIZE; sector <= (offset + size - 1) / BACKUP_SECTOR_SIZE; sector++) {
+        backup->dirty_sectors |= 1u << sector;
+    }
+
+    backup->written = 1;
+}
+
+uint8_t backup_read(Backup *backup, uint32_t address) {
+    uint32_t offset = address & 0xFFFF;
+
+    if (backup->type == BACKUP_SRAM) {
+        return backup->data[offset & (BACKUP_SRAM_SIZE - 1)];
+    }
+
+    if (backup->id_mode && offset < 2) {
+        if (backup->type == BACKUP_FLASH_128K) {
+            return offset == 0 ? FLASH_128K_MANUFACTURER : FLASH_128K_DEVICE;
+        }
+
+        return offset == 0 ? FLASH_64K_MANUFACTURER : FLASH_64K_DEVICE;
+    }
+
+    return backup->data[backup->bank + offset];
+}
+
+/*
+    Flash commands are 0xAA to 0x5555, 0x55 to 0x2AAA and then the command to 0x5555
+    (or, for a sector erase, 0x30 to the sector). Program and bank switch take the
+    write after the command as their data.
+*/
+void backup_write(Backup *backup, uint32_t address, uint8_t value) {
+    uint32_t offset = address & 0xFFFF;
+
+    if (backup->type == BACKUP_SRAM) {
+        offset &= BACKUP_SRAM_SIZE - 1;
+        backup->data[offset] = value;
+        mark_dirty(backup, offset, 1);
+        return;
+    }
+
+    // programming can only clear bits, setting them takes an erase
+    if (backup->mode == FLASH_PROGRAM) {
+        backup->data[backup->bank + offset] &= value;
+        mark_dirty(backup, backup->bank + offset, 1);
+        backup->mode = FLASH_READ;
+        return;
+    }
+
+    if (backup->mode == FLASH_BANK && offset == 0) {
+        backup->bank = (value & 1) * BACKUP_FLASH_BANK_SIZE;
+        backup->mode = FLASH_READ;
+        return;
+    }
+
+    if (offset == 0x5555 && value == 0xAA) {
+        backup->unlock = 1;
+        return;
+    }
+
+    if (backup->unlock == 1 && offset == 0x2AAA && value == 0x55) {
+        backup->unlock = 2;
+        return;
+    }
+
+    if (backup->unlock != 2) {
+        // a lone 0xF0 also leaves id mode
+        backup->unlock = 0;
+
+        if (value == 0xF0) {
+            backup->id_mode = 0;
+        }
+
+        return;
+    }
+
+    backup->unlock = 0;
+
+    if (backup->mode == FLASH_ERASE) {
+        backup->mode = FLASH_READ;
+
+        if (offset == 0x5555 && value == 0x10) {
+            memset(backup->data, 0xFF, backup->size);
+            mark_dirty(backup, 0, backup->size);
+        } else if (value == 0x30) {
+            uint32_t sector = backup->bank + (offset & ~(BACKUP_SECTOR_SIZE - 1));
+            memset(backup->data + sector, 0xFF, BACKUP_SECTOR_SIZE);
+            mark_dirty(backup, sector, BACKUP_SECTOR_SIZE);
+        }
+
+        return;
+    }
+
+    if (offset != 0x5555) {
+        return;
+    }
+
+    switch (value) {
+        case 0x90:
+            backup->id_mode = 1;
+            break;
+        case 0xF0:
+            backup->id_mode = 0;
+            break;
+        case 0x80:
+            backup->mode = FLASH_ERASE;
+            break;
+        case 0xA0:
+            backup->mode = FLASH_PROGRAM;
+            break;
+        case 0xB0:
+            if (backup->type == BACKUP_FLASH_128K) {
+                backup->mode = FLASH_BANK;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// one msync per run of dirty sectors
+static void flush_sectors(Backup *backup, int flags) {
+    uint32_t dirty = backup->dirty_sectors;
+    uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+
+    backup->dirty_sectors = 0;
+    backup->dirty_frames = 0;
+
+    if (!backup->mapped) {
+        return;
+    }
+
+    while (dirty) {
+        uint32_t first = __builtin_ctz(dirty);
+        // in 64 bits so a run up to sector 31 (a 128 KByte chip erase) still ends in a 0
+        uint32_t count = __builtin_ctzll(~((uint64_t)dirty >> first));
+
+        if (first + count >= 32) {
+            dirty = 0;
+        } else {
+            dirty &= ~0u << (first + count);
+        }
+
+        uintptr_t start = (uintptr_t)backup->data + first * BACKUP_SECTOR_SIZE;
+        uintptr_t end = start + count * BACKUP_SECTOR_SIZE;
+        start &= ~page_mask;
+
+        msync((void *)start, end - start, flags);
+    }
+
+    backup->flushes++;
+}
+
+// called once per frame, flushes when the game is done writing (or has written for too long)
+void backup_frame(Backup *backup) {
+    if (backup->dirty_sectors == 0) {
+        return;
+    }
+
+    backup->dirty_frames++;
+
+    if (backup->written && backup->dirty_frames < BACKUP_FLUSH_FRAMES) {
+        backup->written = 0;
+        return;
+    }
+
+    backup->written = 0;
+    flush_sectors(backup, MS_ASYNC);
+}
+
+// the only place that waits for the disk
+void backup_destroy(Backup *backup) {
+    if (backup == NULL) {
+        return;
+    }
+
+    if (backup->dirty_sectors != 0) {
+        flush_sectors(backup, MS_SYNC);
+    }
+
+    if (backup->mapped) {
+        munmap(backup->data, backup->size);
+    } else {
+        arena_free(backup->data);
+    }
+
+    free(backup);
+}
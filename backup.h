@@ -0,0 +1,68 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+#include <stdint.h>
+#include "setup.h"
+
+/*
+    Backup (save) memory at 0x0E000000, behind an 8 bit bus.
+
+    The type comes from the library id string the rom carries (SRAM_V, FLASH_V,
+    FLASH512_V, FLASH1M_V). SRAM is 32 KBytes of plain storage. Flash is 64 or 128
+    KBytes answering the command sequences of the chip (id mode, 4 KByte sector and
+    chip erase, byte program and, for 128 KBytes, switching between the two 64 KByte
+    banks). Operations finish immediately so status polling sees them done.
+
+    The storage is the .sav file mapped shared, so a write is a store into the page
+    cache. Written sectors are remembered and handed to the kernel with msync(MS_ASYNC)
+    from backup_frame, once the game has stopped writing for a frame (a save is many
+    frames of erases and programs) or after BACKUP_FLUSH_FRAMES. Nothing waits on the
+    disk until backup_destroy.
+*/
+
+#define BACKUP_SRAM_SIZE (32 * 1024)
+#define BACKUP_FLASH_BANK_SIZE (64 * 1024)
+#define BACKUP_MAX_SIZE (128 * 1024)
+#define BACKUP_SECTOR_SIZE 4096
+#define BACKUP_SECTORS (BACKUP_MAX_SIZE / BACKUP_SECTOR_SIZE)
+#define BACKUP_FLUSH_FRAMES 60          // longest a written sector stays unflushed
+
+enum BACKUP_TYPE {
+    BACKUP_NONE = 0,
+    BACKUP_SRAM = 1,
+    BACKUP_FLASH_64K = 2,
+    BACKUP_FLASH_128K = 3
+};
+
+enum FLASH_MODE {
+    FLASH_READ = 0,
+    FLASH_ERASE = 1,                    // after 0x80, the next command erases
+    FLASH_PROGRAM = 2,                  // after 0xA0, the next write stores a byte
+    FLASH_BANK = 3                      // after 0xB0, the next write to 0 picks the bank
+};
+
+typedef struct Backup {
+    uint8_t type;
+    uint8_t *data;
+    uint32_t size;
+    uint8_t mapped;                     // data is a file mapping (not anonymous)
+
+    // flash command state
+    uint8_t unlock;                     // 0, 1 after 0xAA to 0x5555, 2 after 0x55 to 0x2AAA
+    uint8_t mode;
+    uint8_t id_mode;                    // reads of 0 and 1 return the manufacturer and device
+    uint32_t bank;                      // offset of the selected bank
+
+    uint32_t dirty_sectors;             // one bit per BACKUP_SECTOR_SIZE
+    uint8_t written;                    // written since the last backup_frame
+    uint32_t dirty_frames;              // frames the oldest unflushed write has waited
+    uint64_t flushes;
+} Backup;
+
+uint8_t backup_detect(Memory *memory);
+Backup *backup_create(uint8_t type, const char *path);
+uint8_t backup_read(Backup *backup, uint32_t address);
+void backup_write(Backup *backup, uint32_t address, uint8_t value);
+void backup_frame(Backup *backup);
+void backup_destroy(Backup *backup);
+
+#endif
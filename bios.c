@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "setup.h"
+#include "cpu.h"
+#include "bios.h"
+#include "idle_loop.h"
+#include "ppu.h"
+
+/*
+    High level emulation of the bios. We don't ship a bios image, so the only real
+    code in the bios region is the irq dispatcher below, everything a SWI would do is
+    done here in C.
+*/
+
+#define SWI_REGISTER_RAM_RESET 0x01
+#define SWI_STOP 0x03
+#define SWI_DIV 0x06
+#define SWI_DIV_ARM 0x07
+#define SWI_SQRT 0x08
+#define SWI_CPU_SET 0x0B
+#define SWI_CPU_FAST_SET 0x0C
+#define SWI_LZ77_UNCOMP_WRAM 0x11
+#define SWI_LZ77_UNCOMP_VRAM 0x12
+#define SWI_RL_UNCOMP_WRAM 0x14
+#define SWI_RL_UNCOMP_VRAM 0x15
+
+/*
+    0x00000018: b 0x128
+    0x00000128: stmfd sp!, {r0-r3, r12, lr}
+                mov r0, #0x04000000
+                add lr, pc, #0
+                ldr pc, [r0, #-4]       ; user handler pointer at 0x03FFFFFC (mirror of 0x03007FFC)
+                ldmfd sp!, {r0-r3, r12, lr}
+                subs pc, lr, #4
+*/
+static const uint32_t irq_vector = 0xEA000042;
+
+static const uint32_t irq_handler[] = {
+    0xE92D500F,
+    0xE3A00301,
+    0xE28FE000,
+    0xE510F004,
+    0xE8BD500F,
+    0xE25EF004
+};
+
+// into the shared bios, once per process (see memory_create)
+void bios_install(uint8_t *bios) {
+    *(uint32_t *)&bios[BIOS_IRQ_VECTOR] = irq_vector;
+
+    for (uint32_t i = 0; i < sizeof(irq_handler) / sizeof(irq_handler[0]); i++) {
+        *(uint32_t *)&bios[BIOS_IRQ_HANDLER + i * 4] = irq_handler[i];
+    }
+}
+
+static void register_ram_reset(Memory *memory, uint32_t flags) {
+    if (flags & 0x01) {
+        for (uint32_t i = 0; i < WRAM1_SIZE; i++) {
+            memory->wram1[i] = 0;
+        }
+
+        mark_state_pages(memory, memory->wram1, WRAM1_SIZE);
+        code_pages_written(memory, 0x02000000, WRAM1_SIZE);
+    }
+
+    if (flags & 0x02) {
+        // the top 0x200 bytes hold the stacks and the irq handler pointer
+        for (uint32_t i = 0; i < WRAM2_SIZE - 0x200; i++) {
+            memory->wram2[i] = 0;
+        }
+
+        mark_state_pages(memory, memory->wram2, WRAM2_SIZE - 0x200);
+        code_pages_written(memory, 0x03000000, WRAM2_SIZE - 0x200);
+    }
+
+    if (flags & 0x04) {
+        for (uint32_t i = 0; i < PALETTE_SIZE; i++) {
+            memory->bg_obj_palette_ram[i] = 0;
+        }
+
+        mark_state_pages(memory, memory->bg_obj_palette_ram, PALETTE_SIZE);
+
+        if (memory->ppu != NULL) {
+            ppu_log_clear(memory->ppu, 0x05);
+        }
+    }
+
+    if (flags & 0x08) {
+        for (uint32_t i = 0; i < VRAM_SIZE; i++) {
+            memory->vram[i] = 0;
+        }
+
+        mark_state_pages(memory, memory->vram, VRAM_SIZE);
+
+        if (memory->ppu != NULL) {
+            ppu_log_clear(memory->ppu, 0x06);
+        }
+    }
+
+    if (flags & 0x10) {
+        for (uint32_t i = 0; i < OAM_SIZE; i++) {
+            memory->obj_attributes[i] = 0;
+        }
+
+        mark_state_pages(memory, memory->obj_attributes, OAM_SIZE);
+
+        if (memory->ppu != NULL) {
+            ppu_log_clear(memory->ppu, 0x07);
+        }
+    }
+}
+
+/*
+    The bios halts until one of the flags in r1 shows up at BIOS_IF_ADDRESS (the game's
+    irq handler sets them). Instead of looping inside the bios the SWI is executed again
+    after every interrupt, cpu->intr_wait tells us it is a re-entry.
+*/
+static void intr_wait(CPU *cpu, Memory *memory, uint32_t discard_old_flags, uint16_t wait_flags) {
+    uint16_t bios_if = fetch_memory_halfword(memory, BIOS_IF_ADDRESS);
+
+    if (!cpu->intr_wait) {
+        if (discard_old_flags) {
+            bios_if &= ~wait_flags;
+            store_memory_halfword(memory, BIOS_IF_ADDRESS, bios_if);
+        }
+
+        cpu->intr_wait = 1;
+        memory->io[IO_IME] = 1;
+    }
+
+    if (bios_if & wait_flags) {
+        store_memory_halfword(memory, BIOS_IF_ADDRESS, bios_if & ~wait_flags);
+        cpu->intr_wait = 0;
+        return;
+    }
+
+    cpu->halted = 1;
+
+    // back to the SWI so it runs again once the interrupt returns
+    cpu->registers[15] -= cpu->cpsr.t ? 2 : 4;
+}
+
+static void cpu_set(Memory *memory, uint32_t source, uint32_t destination, uint32_t control, uint8_t fast) {
+    uint32_t count = control & 0x1FFFFF;
+    uint8_t fill = (control >> 24) & 0x1;
+    uint8_t word = fast || ((control >> 26) & 0x1);
+
+    if (fast) {
+        // CpuFastSet works in blocks of 8 words
+        count = (count + 7) & ~7;
+    }
+
+    uint32_t step = word ? 4 : 2;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (word) {
+            store_memory_word(memory, destination, fetch_memory_word(memory, source));
+        } else {
+            store_memory_halfword(memory, destination, fetch_memory_halfword(memory, source));
+        }
+
+        destination += step;
+
+        if (!fill) {
+            source += step;
+        }
+    }
+}
+
+// vram can't take 8 bit writes, so everything is written out as halfwords
+static void write_uncompressed(Memory *memory, uint32_t destination, uint8_t *data, uint32_t size) {
+    uint32_t i;
+
+    for (i = 0; i + 1 < size; i += 2) {
+        store_memory_halfword(memory, destination + i, data[i] | (data[i + 1] << 8));
+    }
+
+    if (i < size) {
+        store_memory(memory, destination + i, data[i]);
+    }
+}
+
+static void lz77_uncomp(Memory *memory, uint32_t source, uint32_t destination) {
+    uint32_t header = fetch_memory_word(memory, source);
+    uint32_t size = header >> 8;
+    uint8_t *data = malloc(size ? size : 1);
+    uint32_t position = 0;
+
+    source += 4;
+
+    while (position < size) {
+        uint8_t flags = fetch_memory(memory, source++);
+
+        for (int i = 7; i >= 0 && position < size; i--) {
+            if (!((flags >> i) & 0x1)) {
+                data[position++] = fetch_memory(memory, source++);
+                continue;
+            }
+
+            // 4 bit length - 3, 12 bit displacement - 1
+            uint8_t high = fetch_memory(memory, source++);
+            uint8_t low = fetch_memory(memory, source++);
+            uint32_t length = (high >> 4) + 3;
+            uint32_t displacement = (((high & 0xF) << 8) | low) + 1;
+
+            for (uint32_t j = 0; j < length && position < size; j++) {
+                data[position] = (position >= displacement) ? data[position - displacement] : 0;
+                position++;
+            }
+        }
+    }
+
+    write_uncompressed(memory, destination, data, size);
+    free(data);
+}
+
+static void rl_uncomp(Memory *memory, uint32_t source, uint32_t destination) {
+    uint32_t header = fetch_memory_word(memory, source);
+    uint32_t size = header >> 8;
+    uint8_t *data = malloc(size ? size : 1);
+    uint32_t position = 0;
+
+    source += 4;
+
+    while (position < size) {
+        uint8_t flag = fetch_memory(memory, source++);
+
+        if (flag & 0x80) {
+            // compressed, length - 3
+            uint32_t length = (flag & 0x7F) + 3;
+            uint8_t value = fetch_memory(memory, source++);
+
+            for (uint32_t j = 0; j < length && position < size; j++) {
+                data[position++] = value;
+            }
+        } else {
+            // uncompressed, length - 1
+            uint32_t length = (flag & 0x7F) + 1;
+
+            for (uint32_t j = 0; j < length && position < size; j++) {
+                data[position++] = fetch_memory(memory, source++);
+            }
+        }
+    }
+
+    write_uncompressed(memory, destination, data, size);
+    free(data);
+}
+
+static void unsupported(uint8_t swi_number) {
+    static uint8_t reported[256];
+
+    if (!reported[swi_number]) {
+        fprintf(stderr, "Unsupported bios function: %.2x\n", swi_number);
+        reported[swi_number] = 1;
+    }
+}
+
+/*
+    Runs the bios function for swi_number. registers[15] has to already point to the
+    instruction after the SWI.
+*/
+void bios_call(CPU *cpu, Memory *memory, uint8_t swi_number) {
+    uint32_t *r = cpu->registers;
+
+    switch (swi_number) {
+        case SWI_REGISTER_RAM_RESET:
+            register_ram_reset(memory, r[0]);
+            return;
+        case SWI_HALT:
+        case SWI_STOP:
+            cpu->halted = 1;
+            return;
+        case SWI_INTR_WAIT:
+            intr_wait(cpu, memory, r[0], r[1]);
+            return;
+        case SWI_VBLANK_INTR_WAIT:
+            r[0] = 1;
+            r[1] = 1;
+            intr_wait(cpu, memory, 1, 1);
+            return;
+        case SWI_DIV_ARM: {
+            uint32_t temp = r[0];
+            r[0] = r[1];
+            r[1] = temp;
+        }
+        // fall through
+        case SWI_DIV: {
+            int32_t number = r[0];
+            int32_t denom = r[1];
+
+            if (denom == 0) {
+                fprintf(stderr, "Division by zero in bios Div\n");
+                return;
+            }
+
+            // INT_MIN / -1 traps on the host, the bios wraps around
+            uint32_t quotient = denom == -1 ? 0u - (uint32_t)number : (uint32_t)(number / denom);
+
+            r[0] = quotient;
+            r[1] = denom == -1 ? 0 : number % denom;
+            r[3] = (int32_t)quotient < 0 ? 0u - quotient : quotient;
+            return;
+        }
+        case SWI_SQRT: {
+            uint32_t value = r[0];
+            uint32_t result = 0;
+            uint32_t bit = 1 << 30;
+
+            while (bit > value) {
+                bit >>= 2;
+            }
+
+            while (bit != 0) {
+                if (value >= result + bit) {
+                    value -= result + bit;
+                    result = (result >> 1) + bit;
+                } else {
+                    result >>= 1;
+                }
+                bit >>= 2;
+            }
+
+            r[0] = result;
+            return;
+        }
+        case SWI_CPU_SET:
+            cpu_set(memory, r[0], r[1], r[2], 0);
+            return;
+        case SWI_CPU_FAST_SET:
+            cpu_set(memory, r[0], r[1], r[2], 1);
+            return;
+        case SWI_LZ77_UNCOMP_WRAM:
+        case SWI_LZ77_UNCOMP_VRAM:
+            lz77_uncomp(memory, r[0], r[1]);
+            return;
+        case SWI_RL_UNCOMP_WRAM:
+        case SWI_RL_UNCOMP_VRAM:
+            rl_uncomp(memory, r[0], r[1]);
+            return;
+        default:
+            unsupported(swi_number);
+            return;
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef BIOS_H
+#define BIOS_H
+#include <stdint.h>
+#include "setup.h"
+#include "cpu.h"
+
+#define BIOS_IRQ_VECTOR 0x00000018
+#define BIOS_IRQ_HANDLER 0x00000128
+
+// IntrWait checks (and clears) the flags the game's irq handler writes here
+#define BIOS_IF_ADDRESS 0x03007FF8
+
+void bios_install(uint8_t *bios);
+void bios_call(CPU *cpu, Memory *memory, uint8_t swi_number);
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "ppu.h"
+#include "apu.h"
+#include "scheduler.h"
+#include "capture.h"
+
+static int ends_with(const char *path, const char *suffix) {
+    size_t length = strlen(path);
+    size_t suffix_length = strlen(suffix);
+
+    return length >= suffix_length && strcmp(path + length - suffix_length, suffix) == 0;
+}
+
+// Writer thread
+
+// BT.601 limited range, one plane after the other
+static void write_y4m_frame(Capture *capture, const uint32_t *frame) {
+    static uint8_t planes[3][SCREEN_WIDTH * SCREEN_HEIGHT];
+
+    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+        int32_t r = frame[i] & 0xFF;
+        int32_t g = (frame[i] >> 8) & 0xFF;
+        int32_t b = (frame[i] >> 16) & 0xFF;
+
+        planes[0][i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        planes[1][i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        planes[2][i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+
+    fputs("FRAME\n", capture->video);
+    fwrite(planes, 1, sizeof(planes), capture->video);
+}
+
+// writes whatever is in the rings, returns 0 if there was nothing
+static int write_pending(Capture *capture) {
+    int work = 0;
+    uint32_t tail = atomic_load_explicit(&capture->video_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&capture->video_head, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        const uint32_t *frame = capture->frames[tail & (CAPTURE_VIDEO_SLOTS - 1)];
+
+        if (capture->y4m) {
+            write_y4m_frame(capture, frame);
+        } else {
+            fwrite(frame, 4, SCREEN_WIDTH * SCREEN_HEIGHT, capture->video);
+        }
+
+        atomic_store_explicit(&capture->video_tail, tail + 1, memory_order_release);
+        work = 1;
+    }
+
+    tail = atomic_load_explicit(&capture->audio_tail, memory_order_relaxed);
+    head = atomic_load_explicit(&capture->audio_head, memory_order_acquire);
+
+    while (tail != head) {
+        // up to the end of the ring, the rest goes on the next pass
+        uint32_t start = tail & (CAPTURE_AUDIO_FRAMES - 1);
+        uint32_t count = head - tail;
+
+        if (start + count > CAPTURE_AUDIO_FRAMES) {
+            count = CAPTURE_AUDIO_FRAMES - start;
+        }
+
+        capture->audio_bytes += fwrite(&capture->samples[start * 2], 4, count, capture->audio) * 4;
+        tail += count;
+        atomic_store_explicit(&capture->audio_tail, tail, memory_order_release);
+        work = 1;
+    }
+
+    return work;
+}
+
+static void *capture_thread(void *argument) {
+    Capture *capture = argument;
+
+    for (;;) {
+        // read stopping first so nothing pushed before it is missed
+        uint8_t stopping = atomic_load_explicit(&capture->stopping, memory_order_acquire);
+
+        if (write_pending(capture)) {
+            continue;
+        }
+
+        if (stopping) {
+            return NULL;
+        }
+
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Emulation thread
+
+// only every render_interval-th frame is rendered and captured, the frame rate is divided by it
+Capture *capture_create(const char *video_path, const char *audio_path, uint32_t render_interval) {
+    Capture *capture = aligned_alloc(64, sizeof(Capture));
+
+    if (capture == NULL) {
+        fprintf(stderr, "Could not allocate the capture\n");
+        return NULL;
+    }
+
+    memset(capture, 0, sizeof(Capture));
+    capture->frames = calloc(CAPTURE_VIDEO_SLOTS, sizeof(*capture->frames));
+    capture->samples = calloc(CAPTURE_AUDIO_FRAMES * 2, sizeof(int16_t));
+
+    if (capture->frames == NULL || capture->samples == NULL) {
+        fprintf(stderr, "Could not allocate the capture buffers\n");
+        capture_destroy(capture);
+        return NULL;
+    }
+
+    if (video_path != NULL) {
+        capture->video = fopen(video_path, "wb");
+
+        if (capture->video == NULL) {
+            fprintf(stderr, "Could not open %s\n", video_path);
+            capture_destroy(capture);
+            return NULL;
+        }
+
+        capture->y4m = ends_with(video_path, ".y4m");
+
+        // the frame rate is exact, 2^24 cycles per second over the cycles per captured frame
+        if (capture->y4m) {
+            fprintf(capture->video, "YUV4MPEG2 W%d H%d F%d:%llu Ip A1:1 C444\n",
+                    SCREEN_WIDTH, SCREEN_HEIGHT, 16777216,
+                    (unsigned long long)CYCLES_PER_FRAME * (render_interval ? render_interval : 1));
+        }
+    }
+
+    if (audio_path != NULL) {
+        capture->audio = fopen(audio_path, "wb");
+
+        if (capture->audio == NULL) {
+            fprintf(stderr, "Could not open %s\n", audio_path);
+            capture_destroy(capture);
+            return NULL;
+        }
+
+        capture->wav = ends_with(audio_path, ".wav");
+
+        if (capture->wav) {
+            wav_write_header(capture->audio, 0);
+        }
+    }
+
+    atomic_init(&capture->stopping, 0);
+    atomic_init(&capture->video_head, 0);
+    atomic_init(&capture->video_tail, 0);
+    atomic_init(&capture->audio_head, 0);
+    atomic_init(&capture->audio_tail, 0);
+
+    if (pthread_create(&capture->thread, NULL, capture_thread, capture) != 0) {
+        fprintf(stderr, "Could not start the capture thread\n");
+        capture_destroy(capture);
+        return NULL;
+    }
+
+    capture->thread_started = 1;
+
+    return capture;
+}
+
+void capture_frame(Capture *capture, const uint32_t *framebuffer) {
+    if (capture->video == NULL) {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&capture->video_head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&capture->video_tail, memory_order_acquire) == CAPTURE_VIDEO_SLOTS) {
+        capture->frames_dropped++;
+        return;
+    }
+
+    memcpy(capture->frames[head & (CAPTURE_VIDEO_SLOTS - 1)], framebuffer, sizeof(*capture->frames));
+    atomic_store_explicit(&capture->video_head, head + 1, memory_order_release);
+    capture->frames_captured++;
+}
+
+// the apu's pcm callback, a block that doesn't fit is dropped whole
+void capture_audio(void *context, const int16_t *frames, uint32_t count) {
+    Capture *capture = context;
+
+    if (capture->audio == NULL) {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&capture->audio_head, memory_order_relaxed);
+
+    if (CAPTURE_AUDIO_FRAMES - (head - atomic_load_explicit(&capture->audio_tail, memory_order_acquire)) < count) {
+        capture->audio_frames_dropped += count;
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t slot = (head + i) & (CAPTURE_AUDIO_FRAMES - 1);
+
+        capture->samples[slot * 2] = frames[i * 2];
+        capture->samples[slot * 2 + 1] = frames[i * 2 + 1];
+    }
+
+    atomic_store_explicit(&capture->audio_head, head + count, memory_order_release);
+}
+
+// waits for the writer to finish what is queued, closes the files and reports drops
+void capture_destroy(Capture *capture) {
+    if (capture == NULL) {
+        return;
+    }
+
+    if (capture->thread_started) {
+        atomic_store_explicit(&capture->stopping, 1, memory_order_release);
+        pthread_join(capture->thread, NULL);
+
+        fprintf(stderr, "capture: %llu frames written, %llu dropped, %llu audio frames dropped\n",
+                (unsigned long long)capture->frames_captured, (unsigned long long)capture->frames_dropped,
+                (unsigned long long)capture->audio_frames_dropped);
+    }
+
+    if (capture->video != NULL) {
+        fclose(capture->video);
+    }
+
+    if (capture->audio != NULL) {
+        if (capture->wav) {
+            fseek(capture->audio, 0, SEEK_SET);
+            wav_write_header(capture->audio, capture->audio_bytes);
+        }
+
+        fclose(capture->audio);
+    }
+
+    free(capture->frames);
+    free(capture->samples);
+    free(capture);
+}
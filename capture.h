@@ -0,0 +1,53 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ppu.h"
+
+/*
+    Recording to files without the emulation thread ever waiting on the disk.
+
+    Frames and audio go into bounded single producer/single consumer rings, a writer
+    thread converts and writes them. When a ring is full the frame (or block of audio)
+    is dropped and counted, capture_destroy reports the counts.
+
+    Video is Y4M (4:4:4, BT.601) for a path ending in .y4m and raw 0xAABBGGRR frames
+    otherwise. Audio is a wav for .wav and raw 16 bit stereo otherwise.
+*/
+
+#define CAPTURE_VIDEO_SLOTS 16                  // power of 2
+#define CAPTURE_AUDIO_FRAMES (1 << 18)          // stereo frames, power of 2 (5.4s at 48 kHz)
+
+typedef struct {
+    FILE *video;
+    FILE *audio;
+    uint8_t y4m;
+    uint8_t wav;
+    uint64_t audio_bytes;
+
+    pthread_t thread;
+    uint8_t thread_started;
+    _Atomic uint8_t stopping;
+
+    uint32_t (*frames)[SCREEN_WIDTH * SCREEN_HEIGHT];
+    _Alignas(64) _Atomic uint32_t video_head;   // written by the emulation thread
+    _Alignas(64) _Atomic uint32_t video_tail;   // written by the writer thread
+
+    int16_t *samples;                           // CAPTURE_AUDIO_FRAMES * 2
+    _Alignas(64) _Atomic uint32_t audio_head;
+    _Alignas(64) _Atomic uint32_t audio_tail;
+
+    // only touched by the emulation thread
+    _Alignas(64) uint64_t frames_captured;
+    uint64_t frames_dropped;
+    uint64_t audio_frames_dropped;
+} Capture;
+
+Capture *capture_create(const char *video_path, const char *audio_path, uint32_t render_interval);
+void capture_frame(Capture *capture, const uint32_t *framebuffer);
+void capture_audio(void *capture, const int16_t *frames, uint32_t count);
+void capture_destroy(Capture *capture);
+
+#endif
@@ -0,0 +1,583 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "setup.h"
+#include "cheats.h"
+
+// TEA keys of the two encrypted formats, decryption runs the 32 rounds backwards
+static const uint32_t gameshark_seeds[4] = {0x09F4FBBD, 0x9681884A, 0x352027E9, 0xF3DEE5A7};
+static const uint32_t action_replay_seeds[4] = {0x7AA9648F, 0x7FAE6994, 0xC0EFAAD5, 0x42712C57};
+
+#define TEA_DELTA 0x9E3779B9
+#define TEA_ROUNDS 32
+
+#define GAMESHARK_HOOK 0x001DC0DE           // value of the v1/v2 enable code
+#define GAMESHARK_RESEED 0xDEADFACE         // address of a v1/v2 encryption change
+
+static void tea_decrypt(uint32_t *address, uint32_t *value, const uint32_t *seeds) {
+    uint32_t sum = TEA_DELTA * TEA_ROUNDS;
+
+    for (int i = 0; i < TEA_ROUNDS; i++) {
+        *value -= ((*address << 4) + seeds[2]) ^ (*address + sum) ^ ((*address >> 5) + seeds[3]);
+        *address -= ((*value << 4) + seeds[0]) ^ (*value + sum) ^ ((*value >> 5) + seeds[1]);
+        sum -= TEA_DELTA;
+    }
+}
+
+// state while compiling one cheats_add call
+typedef struct {
+    Cheats *cheats;
+    uint8_t format;
+    int line;
+
+    // conditions whose skip is known once the next line is compiled
+    uint32_t pending[CHEAT_MAX_NESTING];
+    uint32_t pending_count;
+
+    // a CodeBreaker slide code is two lines
+    uint8_t slide;
+    uint32_t slide_address;
+    uint16_t slide_value;
+} Compiler;
+
+static int is_condition(uint8_t kind) {
+    return kind >= CHEAT_IF_EQUAL;
+}
+
+static uint32_t width_mask(uint8_t width) {
+    return width == 4 ? 0xFFFFFFFF : (1u << (width * 8)) - 1;
+}
+
+static int add_op(Compiler *compiler, uint8_t kind, uint8_t width, uint32_t address, uint32_t value) {
+    Cheats *cheats = compiler->cheats;
+
+    if (cheats->count == cheats->capacity) {
+        uint32_t capacity = cheats->capacity ? cheats->capacity * 2 : 64;
+        CheatOp *ops = realloc(cheats->ops, capacity * sizeof(CheatOp));
+
+        if (ops == NULL) {
+            fprintf(stderr, "Could not allocate the cheat list\n");
+            return -1;
+        }
+
+        cheats->ops = ops;
+        cheats->capacity = capacity;
+    }
+
+    if (is_condition(kind)) {
+        if (compiler->pending_count == CHEAT_MAX_NESTING) {
+            fprintf(stderr, "Cheat line %d: more than %d conditions in a row\n", compiler->line, CHEAT_MAX_NESTING);
+            return -1;
+        }
+
+        compiler->pending[compiler->pending_count++] = cheats->count;
+    }
+
+    CheatOp *op = &cheats->ops[cheats->count++];
+    op->address = address;
+    op->value = value & width_mask(width);
+    op->kind = kind;
+    op->width = width;
+    op->skip = 0;
+
+    return 0;
+}
+
+// address is a cpu address in 0x08000000-0x0DFFFFFF
+static int add_rom_patch(Compiler *compiler, uint32_t address, uint32_t value, uint8_t width) {
+    Cheats *cheats = compiler->cheats;
+    uint32_t offset = address & (ROM_SIZE - 1);
+
+    if ((address >> 24) < 0x08 || (address >> 24) > 0x0D || offset + width > ROM_SIZE) {
+        fprintf(stderr, "Cheat line %d: %.8x isn't in the rom\n", compiler->line, address);
+        return -1;
+    }
+
+    if (cheats->patch_count == cheats->patch_capacity) {
+        uint32_t capacity = cheats->patch_capacity ? cheats->patch_capacity * 2 : 16;
+        RomPatch *patches = realloc(cheats->patches, capacity * sizeof(RomPatch));
+
+        if (patches == NULL) {
+            fprintf(stderr, "Could not allocate the rom patch list\n");
+            return -1;
+        }
+
+        cheats->patches = patches;
+        cheats->patch_capacity = capacity;
+    }
+
+    RomPatch *patch = &cheats->patches[cheats->patch_count++];
+    patch->offset = offset;
+    patch->value = value & width_mask(width);
+    patch->original = 0;
+    patch->width = width;
+    patch->applied = 0;
+
+    return 0;
+}
+
+static int unsupported(Compiler *compiler, const char *what, uint32_t address, uint32_t value) {
+    fprintf(stderr, "Cheat line %d: %s code %.8x %.8x isn't supported\n", compiler->line, what, address, value);
+    return -1;
+}
+
+static int compile_gameshark(Compiler *compiler, uint32_t address, uint32_t value) {
+    tea_decrypt(&address, &value, gameshark_seeds);
+
+    if (address == GAMESHARK_RESEED) {
+        return unsupported(compiler, "GameShark encryption change", address, value);
+    }
+
+    // the game's hook, the emulator runs codes without one
+    if (value == GAMESHARK_HOOK) {
+        return 0;
+    }
+
+    uint32_t target = address & 0x0FFFFFFF;
+
+    switch (address >> 28) {
+        case 0x0: return add_op(compiler, CHEAT_WRITE, 1, target, value);
+        case 0x1: return add_op(compiler, CHEAT_WRITE, 2, target, value);
+        case 0x2: return add_op(compiler, CHEAT_WRITE, 4, target, value);
+        case 0x6:
+            // the halfword offset is stored shifted right once, above it 0xC marks a rom patch
+            if (((address << 1) >> 28) != 0xC) {
+                break;
+            }
+            return add_rom_patch(compiler, 0x08000000 | ((address << 1) & 0x01FFFFFE), value, 2);
+        case 0xD:
+            if (value >> 16) {
+                break;
+            }
+            return add_op(compiler, CHEAT_IF_EQUAL, 2, target, value);
+        case 0xF:
+            return 0;
+    }
+
+    return unsupported(compiler, "GameShark", address, value);
+}
+
+static int compile_action_replay(Compiler *compiler, uint32_t address, uint32_t value) {
+    tea_decrypt(&address, &value, action_replay_seeds);
+
+    // master codes only matter to the real device
+    if (((address >> 24) & 0xFE) == 0xC4) {
+        return 0;
+    }
+
+    // type in bits 25-31 and 24, the region nibble in bits 20-23 and an 18 bit offset
+    uint8_t type = ((address >> 25) & 0x7F) | ((address >> 17) & 0x80);
+    uint32_t target = ((address & 0x00F00000) << 4) | (address & 0x0003FFFF);
+    uint8_t width = 1 << ((type >> 1) & 3);
+
+    if (address == 0 || (type & 0x06) == 0x06) {
+        return unsupported(compiler, "Action Replay", address, value);
+    }
+
+    switch (type & ~0x06) {
+        case 0x00: return add_op(compiler, CHEAT_WRITE, width, target, value);
+        case 0x80: return add_op(compiler, CHEAT_ADD, width, target, value);
+        case 0x08: return add_op(compiler, CHEAT_IF_EQUAL, width, target, value);
+        case 0x10: return add_op(compiler, CHEAT_IF_NOT_EQUAL, width, target, value);
+        case 0x18: return add_op(compiler, CHEAT_IF_LOWER_SIGNED, width, target, value);
+        case 0x20: return add_op(compiler, CHEAT_IF_HIGHER_SIGNED, width, target, value);
+        case 0x28: return add_op(compiler, CHEAT_IF_LOWER, width, target, value);
+        case 0x30: return add_op(compiler, CHEAT_IF_HIGHER, width, target, value);
+        case 0x38: return add_op(compiler, CHEAT_IF_AND, width, target, value);
+    }
+
+    return unsupported(compiler, "Action Replay", address, value);
+}
+
+// iiiicccc ssss: cccc writes, the value goes up by iiii and the address by ssss each time
+static int compile_slide(Compiler *compiler, uint32_t counts, uint16_t step) {
+    uint32_t address = compiler->slide_address;
+    uint16_t value = compiler->slide_value;
+    uint16_t increment = counts >> 16;
+    uint32_t count = counts & 0xFFFF;
+
+    compiler->slide = 0;
+
+    if (count > CHEAT_MAX_SLIDE) {
+        fprintf(stderr, "Cheat line %d: slide of %u writes, at most %d\n", compiler->line, count, CHEAT_MAX_SLIDE);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++, address += step, value += increment) {
+        if (add_op(compiler, CHEAT_WRITE, 2, address, value) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int compile_codebreaker(Compiler *compiler, uint32_t address, uint32_t value) {
+    uint32_t target = address & 0x0FFFFFFF;
+
+    if (compiler->slide) {
+        return compile_slide(compiler, address, value);
+    }
+
+    switch (address >> 28) {
+        case 0x0: return 0;                                 // master code and its hook line
+        case 0x1: return 0;
+        case 0x2: return add_op(compiler, CHEAT_OR, 2, target, value);
+        case 0x3: return add_op(compiler, CHEAT_WRITE, 1, target, value);
+        case 0x4:
+            compiler->slide = 1;
+            compiler->slide_address = target;
+            compiler->slide_value = value;
+            return 0;
+        case 0x6: return add_op(compiler, CHEAT_AND, 2, target, value);
+        case 0x7: return add_op(compiler, CHEAT_IF_EQUAL, 2, target, value);
+        case 0x8: return add_op(compiler, CHEAT_WRITE, 2, target, value);
+        case 0xA: return add_op(compiler, CHEAT_IF_NOT_EQUAL, 2, target, value);
+        case 0xB: return add_op(compiler, CHEAT_IF_HIGHER, 2, target, value);
+        case 0xC: return add_op(compiler, CHEAT_IF_LOWER, 2, target, value);
+        case 0xD: return add_op(compiler, CHEAT_IF_KEYS, 2, 0x04000000 | IO_KEYINPUT, value);
+        case 0xE: return add_op(compiler, CHEAT_ADD, 2, target, value);
+    }
+
+    return unsupported(compiler, "CodeBreaker", address, value);
+}
+
+static int compile_raw(Compiler *compiler, uint32_t address, uint32_t value, uint8_t width) {
+    if ((address >> 24) >= 0x08 && (address >> 24) <= 0x0D) {
+        return add_rom_patch(compiler, address, value, width);
+    }
+
+    return add_op(compiler, CHEAT_WRITE, width, address, value);
+}
+
+// exactly digits hex digits, returns the end or NULL
+static const char *parse_hex(const char *text, int digits, uint32_t *value) {
+    *value = 0;
+
+    for (int i = 0; i < digits; i++, text++) {
+        if (!isxdigit((unsigned char)*text)) {
+            return NULL;
+        }
+
+        *value = (*value << 4) | (isdigit((unsigned char)*text) ? *text - '0' : (tolower((unsigned char)*text) - 'a' + 10));
+    }
+
+    return isxdigit((unsigned char)*text) ? NULL : text;
+}
+
+static int hex_digits(const char *text) {
+    int digits = 0;
+
+    while (isxdigit((unsigned char)text[digits])) {
+        digits++;
+    }
+
+    return digits;
+}
+
+// [gameshark], [action replay], [codebreaker], [raw] or [auto], returns -1 if it isn't one
+static int parse_section(const char *line) {
+    static const char *names[] = {"[auto]", "[gameshark]", "[action replay]", "[codebreaker]", "[raw]"};
+
+    for (int i = 0; i < 5; i++) {
+        if (strncasecmp(line, names[i], strlen(names[i])) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// one line without the newline, empty lines and comments are fine
+static int compile_line(Compiler *compiler, const char *line) {
+    uint32_t address, value;
+
+    while (isspace((unsigned char)*line)) {
+        line++;
+    }
+
+    if (*line == '\0' || *line == '#') {
+        return 0;
+    }
+
+    if (*line == '[') {
+        int format = parse_section(line);
+
+        if (format < 0) {
+            fprintf(stderr, "Cheat line %d: unknown section %s\n", compiler->line, line);
+            return -1;
+        }
+
+        compiler->format = format;
+        return 0;
+    }
+
+    const char *rest = parse_hex(line, 8, &address);
+
+    if (rest == NULL || (*rest != ' ' && *rest != '\t' && *rest != ':')) {
+        fprintf(stderr, "Cheat line %d: expected 8 hex digits and a value in %s\n", compiler->line, line);
+        return -1;
+    }
+
+    uint8_t raw = *rest == ':';
+
+    while (*rest == ' ' || *rest == '\t' || *rest == ':') {
+        rest++;
+    }
+
+    int digits = hex_digits(rest);
+    uint8_t format = compiler->format;
+
+    if (format == CHEAT_AUTO) {
+        format = raw ? CHEAT_RAW : digits == 4 ? CHEAT_CODEBREAKER : CHEAT_GAMESHARK;
+    }
+
+    uint8_t expected = format == CHEAT_CODEBREAKER ? 4 : 8;
+
+    if (format == CHEAT_RAW ? (digits != 2 && digits != 4 && digits != 8) : digits != expected) {
+        fprintf(stderr, "Cheat line %d: wrong number of value digits in %s\n", compiler->line, line);
+        return -1;
+    }
+
+    parse_hex(rest, digits, &value);
+
+    switch (format) {
+        case CHEAT_GAMESHARK: return compile_gameshark(compiler, address, value);
+        case CHEAT_ACTION_REPLAY: return compile_action_replay(compiler, address, value);
+        case CHEAT_CODEBREAKER: return compile_codebreaker(compiler, address, value);
+        default: return compile_raw(compiler, address, value, digits / 2);
+    }
+}
+
+Cheats *cheats_create(void) {
+    Cheats *cheats = calloc(1, sizeof(Cheats));
+
+    if (cheats == NULL) {
+        fprintf(stderr, "Could not allocate the cheats\n");
+    }
+
+    return cheats;
+}
+
+/*
+    Compiles codes, one per line, in the given format until a [format] line changes
+    it. A condition covers the ops of the line after it. Either every line is added
+    or, on an error, none. Rom patches still have to be applied with cheats_patch_rom.
+*/
+int cheats_add(Cheats *cheats, const char *codes, uint8_t format) {
+    Compiler compiler = {0};
+    uint32_t count = cheats->count;
+    uint32_t patch_count = cheats->patch_count;
+    int status = 0;
+
+    compiler.cheats = cheats;
+    compiler.format = format;
+
+    for (const char *line = codes; line != NULL && *line != '\0' && status == 0; ) {
+        const char *end = strchr(line, '\n');
+        size_t length = end != NULL ? (size_t)(end - line) : strlen(line);
+        char text[128];
+        uint32_t before = cheats->count;
+        uint32_t patches_before = cheats->patch_count;
+
+        compiler.line++;
+
+        if (length >= sizeof(text)) {
+            fprintf(stderr, "Cheat line %d is too long\n", compiler.line);
+            status = -1;
+            break;
+        }
+
+        memcpy(text, line, length);
+        text[length] = '\0';
+        text[strcspn(text, "\r")] = '\0';
+
+        uint32_t pending = compiler.pending_count;
+        status = compile_line(&compiler, text);
+
+        // rom patches are written once, at load time, a condition can't guard them
+        if (status == 0 && cheats->patch_count != patches_before && pending != 0) {
+            fprintf(stderr, "Cheat line %d: rom patch after a condition\n", compiler.line);
+            status = -1;
+            break;
+        }
+
+        // a line that compiled to something other than a new condition closes the open ones
+        if (status == 0 && (cheats->count != before || cheats->patch_count != patches_before) &&
+            compiler.pending_count == pending) {
+            for (uint32_t i = 0; i < compiler.pending_count; i++) {
+                uint32_t index = compiler.pending[i];
+                cheats->ops[index].skip = cheats->count - index - 1;
+            }
+
+            compiler.pending_count = 0;
+        }
+
+        line = end != NULL ? end + 1 : NULL;
+    }
+
+    if (status == 0 && compiler.slide) {
+        fprintf(stderr, "Cheat line %d: slide code without its second line\n", compiler.line);
+        status = -1;
+    }
+
+    if (status == 0 && compiler.pending_count != 0) {
+        fprintf(stderr, "Cheat line %d: condition without a line after it\n", compiler.line);
+        status = -1;
+    }
+
+    if (status != 0) {
+        cheats->count = count;
+        cheats->patch_count = patch_count;
+    }
+
+    return status;
+}
+
+// a text file for cheats_add, the format is picked per line unless a [format] line says
+int cheats_load(Cheats *cheats, const char *path) {
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = size >= 0 ? malloc(size + 1) : NULL;
+
+    if (text == NULL || fread(text, 1, size, file) != (size_t)size) {
+        fprintf(stderr, "Could not read %s\n", path);
+        free(text);
+        fclose(file);
+        return -1;
+    }
+
+    text[size] = '\0';
+    fclose(file);
+
+    int status = cheats_add(cheats, text, CHEAT_AUTO);
+    free(text);
+
+    return status;
+}
+
+/*
+    Writes the rom patches that aren't applied yet, returns how many. Code compiled
+    from the rom doesn't know about them, the caller has to drop it if this isn't 0.
+*/
+uint32_t cheats_patch_rom(Cheats *cheats, Memory *memory) {
+    uint32_t applied = 0;
+
+    for (uint32_t i = 0; i < cheats->patch_count; i++) {
+        RomPatch *patch = &cheats->patches[i];
+
+        if (!patch->applied) {
+            memcpy(&patch->original, &memory->rom[patch->offset], patch->width);
+            memory_rom_writable(memory, patch->offset, patch->width);
+            memcpy(&memory->rom[patch->offset], &patch->value, patch->width);
+            patch->applied = 1;
+            applied++;
+        }
+    }
+
+    return applied;
+}
+
+// removes every code, rom patches are undone newest first so overlapping ones come out right
+void cheats_clear(Cheats *cheats, Memory *memory) {
+    for (uint32_t i = cheats->patch_count; i-- > 0; ) {
+        RomPatch *patch = &cheats->patches[i];
+
+        if (patch->applied) {
+            memory_rom_writable(memory, patch->offset, patch->width);
+            memcpy(&memory->rom[patch->offset], &patch->original, patch->width);
+        }
+    }
+
+    cheats->count = 0;
+    cheats->patch_count = 0;
+}
+
+static uint32_t load(Memory *memory, uint32_t address, uint8_t width) {
+    switch (width) {
+        case 1: return fetch_memory(memory, address);
+        case 2: return fetch_memory_halfword(memory, address);
+        default: return fetch_memory_word(memory, address);
+    }
+}
+
+static void store(Memory *memory, uint32_t address, uint32_t value, uint8_t width) {
+    switch (width) {
+        case 1: store_memory(memory, address, value); break;
+        case 2: store_memory_halfword(memory, address, value); break;
+        default: store_memory_word(memory, address, value); break;
+    }
+}
+
+static int32_t sign_extend(uint32_t value, uint8_t width) {
+    uint32_t shift = 32 - width * 8;
+    return (int32_t)(value << shift) >> shift;
+}
+
+static int condition(CheatOp *op, Memory *memory) {
+    uint32_t value = load(memory, op->address, op->width);
+
+    switch (op->kind) {
+        case CHEAT_IF_EQUAL: return value == op->value;
+        case CHEAT_IF_NOT_EQUAL: return value != op->value;
+        case CHEAT_IF_LOWER: return value < op->value;
+        case CHEAT_IF_HIGHER: return value > op->value;
+        case CHEAT_IF_LOWER_SIGNED: return sign_extend(value, op->width) < sign_extend(op->value, op->width);
+        case CHEAT_IF_HIGHER_SIGNED: return sign_extend(value, op->width) > sign_extend(op->value, op->width);
+        case CHEAT_IF_AND: return (value & op->value) != 0;
+        case CHEAT_IF_KEYS: return (~value & op->value & 0x3FF) == op->value;
+    }
+
+    return 0;
+}
+
+// called at the start of every VBlank
+void cheats_apply(Cheats *cheats, Memory *memory) {
+    for (uint32_t i = 0; i < cheats->count; i++) {
+        CheatOp *op = &cheats->ops[i];
+        uint32_t value = op->value;
+
+        switch (op->kind) {
+            case CHEAT_WRITE:
+                break;
+            case CHEAT_ADD:
+                value += load(memory, op->address, op->width);
+                break;
+            case CHEAT_OR:
+                value |= load(memory, op->address, op->width);
+                break;
+            case CHEAT_AND:
+                value &= load(memory, op->address, op->width);
+                break;
+            default:
+                if (!condition(op, memory)) {
+                    i += op->skip;
+                }
+                continue;
+        }
+
+        store(memory, op->address, value, op->width);
+    }
+}
+
+void cheats_destroy(Cheats *cheats) {
+    if (cheats == NULL) {
+        return;
+    }
+
+    free(cheats->ops);
+    free(cheats->patches);
+    free(cheats);
+}
@@ -0,0 +1,96 @@
+#ifndef CHEATS_H
+#define CHEATS_H
+#include <stdint.h>
+#include "setup.h"
+
+/*
+    Cheat codes: GameShark / Action Replay v1 and v2, Action Replay v3, CodeBreaker
+    and raw address:value pairs.
+
+    Codes are decrypted and compiled once, when they are added, into two lists:
+
+        - ops, run at the start of every VBlank (scheduler.c): writes, adds, ORs and
+          ANDs of 8, 16 or 32 bits, and conditions that skip the ops of the next code
+          line when they fail. They go through the store functions like any cpu write.
+        - rom patches, written into the rom image right away. Reads of the rom go
+          through memory_pointer as always, so the hot path doesn't know about
+          cheats. The original bytes are kept to undo them.
+
+    Supported:
+        GameShark v1/v2 (encrypted, 8+8 digits): 0/1/2 8/16/32 bit writes, 6 rom
+            patches, D 16 bit if equal. Hook/master codes are skipped.
+        Action Replay v3 (encrypted, 8+8 digits): 8/16/32 bit writes and adds, if
+            equal, not equal, lower, higher (signed and unsigned) and AND. Master
+            codes are skipped.
+        CodeBreaker (8+4 digits, unencrypted): 3 8 bit write, 8 16 bit write, 2 OR,
+            6 AND, E add, 4 slide, 7 if equal, A if not equal, B if higher, C if lower,
+            D if keys held. Master codes are skipped.
+        Raw: aaaaaaaa:vv, aaaaaaaa:vvvv or aaaaaaaa:vvvvvvvv, a rom address makes a
+            rom patch.
+
+    Anything else (encryption changes, group writes, pointer codes) is refused with
+    a message naming the line, and so is a rom patch behind a condition (patches are
+    written once, nothing could skip them).
+*/
+
+enum CHEAT_FORMAT {
+    CHEAT_AUTO = 0,                     // by shape: 8+8 GameShark v1/v2, 8+4 CodeBreaker, a:v raw
+    CHEAT_GAMESHARK,
+    CHEAT_ACTION_REPLAY,                // v3
+    CHEAT_CODEBREAKER,
+    CHEAT_RAW
+};
+
+enum CHEAT_KIND {
+    CHEAT_WRITE = 0,
+    CHEAT_ADD,
+    CHEAT_OR,
+    CHEAT_AND,
+    CHEAT_IF_EQUAL,                     // conditions, skip the next line's ops if false
+    CHEAT_IF_NOT_EQUAL,
+    CHEAT_IF_LOWER,                     // unsigned
+    CHEAT_IF_HIGHER,
+    CHEAT_IF_LOWER_SIGNED,
+    CHEAT_IF_HIGHER_SIGNED,
+    CHEAT_IF_AND,                       // memory & value != 0
+    CHEAT_IF_KEYS                       // all keys in value are held (value active high)
+};
+
+#define CHEAT_MAX_SLIDE 256             // writes a CodeBreaker slide code may unroll to
+#define CHEAT_MAX_NESTING 16
+
+typedef struct {
+    uint32_t address;
+    uint32_t value;
+    uint8_t kind;
+    uint8_t width;                      // 1, 2 or 4 bytes
+    uint16_t skip;                      // conditions: ops to skip when false
+} CheatOp;
+
+typedef struct {
+    uint32_t offset;                    // into the rom
+    uint32_t value;
+    uint32_t original;                  // rom bytes before the patch
+    uint8_t width;
+    uint8_t applied;
+} RomPatch;
+
+typedef struct Cheats {
+    CheatOp *ops;
+    uint32_t count;
+    uint32_t capacity;
+
+    RomPatch *patches;
+    uint32_t patch_count;
+    uint32_t patch_capacity;
+} Cheats;
+
+Cheats *cheats_create(void);
+int cheats_add(Cheats *cheats, const char *codes, uint8_t format);
+int cheats_load(Cheats *cheats, const char *path);
+uint32_t cheats_patch_rom(Cheats *cheats, Memory *memory);
+void cheats_clear(Cheats *cheats, Memory *memory);
+void cheats_apply(Cheats *cheats, Memory *memory);
+void cheats_destroy(Cheats *cheats);
+
+#endif
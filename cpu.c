@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "bios.h"
+
+// PSR has the same bit layout as the real cpsr (mode in bits 0-4, flags in 28-31)
+uint32_t psr_to_word(PSR psr) {
+    uint32_t word;
+    memcpy(&word, &psr, sizeof(word));
+    return word;
+}
+
+PSR psr_from_word(uint32_t word) {
+    PSR psr;
+    memcpy(&psr, &word, sizeof(psr));
+    return psr;
+}
+
+uint8_t cpu_mode(CPU *cpu) {
+    return psr_to_word(cpu->cpsr) & 0x1F;
+}
+
+static uint8_t register_bank(uint8_t mode) {
+    switch (mode) {
+        case MODE_FIQ:
+            return BANK_FIQ;
+        case MODE_IRQ:
+            return BANK_IRQ;
+        case MODE_SUPERVISOR:
+            return BANK_SUPERVISOR;
+        case MODE_ABORT:
+            return BANK_ABORT;
+        case MODE_UNDEFINED:
+            return BANK_UNDEFINED;
+        default:
+            return BANK_USER;
+    }
+}
+
+/*
+    Swaps the banked registers of the current mode out and the ones of the new mode in.
+    Only the mode bits of the cpsr are changed.
+*/
+void cpu_switch_mode(CPU *cpu, uint8_t mode) {
+    uint8_t old_bank = register_bank(cpu_mode(cpu));
+    uint8_t new_bank = register_bank(mode);
+
+    if (old_bank != new_bank) {
+        cpu->banked_r13[old_bank] = cpu->registers[13];
+        cpu->banked_r14[old_bank] = cpu->registers[14];
+        cpu->banked_spsr[old_bank] = cpu->spsr;
+
+        cpu->registers[13] = cpu->banked_r13[new_bank];
+        cpu->registers[14] = cpu->banked_r14[new_bank];
+        cpu->spsr = cpu->banked_spsr[new_bank];
+
+        if (old_bank == BANK_FIQ || new_bank == BANK_FIQ) {
+            uint32_t *save = (old_bank == BANK_FIQ) ? cpu->banked_fiq_registers : cpu->banked_user_registers;
+            uint32_t *load = (new_bank == BANK_FIQ) ? cpu->banked_fiq_registers : cpu->banked_user_registers;
+
+            memcpy(save, &cpu->registers[8], sizeof(uint32_t) * 5);
+            memcpy(&cpu->registers[8], load, sizeof(uint32_t) * 5);
+        }
+    }
+
+    cpu->cpsr = psr_from_word((psr_to_word(cpu->cpsr) & ~0x1F) | mode);
+}
+
+/*
+    Where the user mode copy of register i lives right now, for LDM/STM with the ^ bit
+    and no pc in the list. Only r8-r14 are banked, and only away from user/system.
+*/
+uint32_t *cpu_user_register(CPU *cpu, int i) {
+    uint8_t bank = register_bank(cpu_mode(cpu));
+
+    if (bank == BANK_USER || i < 8 || i == 15) {
+        return &cpu->registers[i];
+    }
+
+    if (i == 13) {
+        return &cpu->banked_r13[BANK_USER];
+    }
+
+    if (i == 14) {
+        return &cpu->banked_r14[BANK_USER];
+    }
+
+    return bank == BANK_FIQ ? &cpu->banked_user_registers[i - 8] : &cpu->registers[i];
+}
+
+// writes a whole psr to the cpsr, switching register banks if the mode changes
+void cpu_set_cpsr(CPU *cpu, PSR psr) {
+    cpu_switch_mode(cpu, psr_to_word(psr) & 0x1F);
+    cpu->cpsr = psr;
+}
+
+/*
+    State the bios leaves behind before jumping to the cartridge, since we don't
+    run a real bios.
+*/
+void cpu_init(CPU *cpu, Memory *memory) {
+    memset(cpu, 0, sizeof(CPU));
+
+    cpu->cpsr = psr_from_word(MODE_SYSTEM);
+
+    cpu->banked_r13[BANK_SUPERVISOR] = 0x03007FE0;
+    cpu->banked_r13[BANK_IRQ] = 0x03007FA0;
+    cpu->registers[13] = 0x03007F00;
+
+    // Rom starts at this location
+    cpu->registers[15] = 0x08000000;
+
+    // KEYINPUT bits are 0 when pressed
+    *(uint16_t *)&memory->io[IO_KEYINPUT] = 0x3FF;
+
+    scheduler_init(&cpu->scheduler, memory);
+}
+
+/*
+    Takes the IRQ exception if one is pending and enabled. Must be called between
+    instructions, registers[15] has to hold the address of the next instruction.
+    Returns 1 if the exception was taken.
+*/
+int cpu_check_interrupts(CPU *cpu, Memory *memory) {
+    uint16_t pending = *(uint16_t *)&memory->io[IO_IE] & *(uint16_t *)&memory->io[IO_IF];
+
+    if (pending == 0) {
+        return 0;
+    }
+
+    // any enabled interrupt wakes the cpu up, even if IME or the I bit mask it
+    cpu->halted = 0;
+
+    if (!(memory->io[IO_IME] & 0x1) || cpu->cpsr.i) {
+        return 0;
+    }
+
+    PSR old_cpsr = cpu->cpsr;
+    uint32_t return_address = cpu->registers[15] + 4;
+
+    cpu_switch_mode(cpu, MODE_IRQ);
+    cpu->spsr = old_cpsr;
+    cpu->registers[14] = return_address;
+    cpu->cpsr.t = 0;
+    cpu->cpsr.i = 1;
+    cpu->registers[15] = BIOS_IRQ_VECTOR;
+
+    return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef CPU_H
+#define CPU_H
+#include <stdint.h>
+#include "setup.h"
+#include "scheduler.h"
+
+enum CPU_MODE {
+    MODE_USER = 0x10,
+    MODE_FIQ = 0x11,
+    MODE_IRQ = 0x12,
+    MODE_SUPERVISOR = 0x13,
+    MODE_ABORT = 0x17,
+    MODE_UNDEFINED = 0x1B,
+    MODE_SYSTEM = 0x1F
+};
+
+// which copy of r13, r14 and the spsr a mode uses (user and system share one)
+enum REGISTER_BANK {
+    BANK_USER = 0,
+    BANK_FIQ,
+    BANK_IRQ,
+    BANK_SUPERVISOR,
+    BANK_ABORT,
+    BANK_UNDEFINED,
+    BANK_COUNT
+};
+
+typedef struct CPU {
+    uint32_t registers[16];             // registers[15] = PC
+    PSR cpsr;
+    PSR spsr;                           // spsr of the current mode, unused in user/system
+
+    uint32_t banked_r13[BANK_COUNT];
+    uint32_t banked_r14[BANK_COUNT];
+    PSR banked_spsr[BANK_COUNT];
+    uint32_t banked_fiq_registers[5];   // r8-r12 of fiq mode
+    uint32_t banked_user_registers[5];  // r8-r12 of every other mode
+
+    uint8_t halted;
+    uint8_t intr_wait;                  // set while inside IntrWait/VBlankIntrWait
+
+    Scheduler scheduler;
+    struct BlockCache *block_cache;     // pre-decoded code, see interpreter.c
+    struct Trace *trace;                // records every instruction if set, see trace.h
+} CPU;
+
+uint32_t psr_to_word(PSR psr);
+PSR psr_from_word(uint32_t word);
+uint8_t cpu_mode(CPU *cpu);
+void cpu_switch_mode(CPU *cpu, uint8_t mode);
+void cpu_set_cpsr(CPU *cpu, PSR psr);
+uint32_t *cpu_user_register(CPU *cpu, int i);
+
+void cpu_init(CPU *cpu, Memory *memory);
+int cpu_check_interrupts(CPU *cpu, Memory *memory);
+
+#endif
@@ -0,0 +1,664 @@
+#include <stdint.h>
+#include <string.h>
+#include "decoder.h"
+#include "idle_loop.h"
+#include "alu.h"
+
+#define ALU_AND 0x0
+#define ALU_SUB 0x2
+#define ALU_RSB 0x3
+#define ALU_ADD 0x4
+#define ALU_ADC 0x5
+#define ALU_SBC 0x6
+#define ALU_TST 0x8
+#define ALU_CMP 0xA
+#define ALU_CMN 0xB
+#define ALU_ORR 0xC
+#define ALU_MOV 0xD
+#define ALU_BIC 0xE
+#define ALU_MVN 0xF
+
+static void decode_data_processing_arm(uint32_t instruction, DecodedInstruction *decoded) {
+    decoded->op = OP_DATA_PROCESSING;
+    decoded->opcode = (instruction >> 21) & 0xF;
+    decoded->rn = (instruction >> 16) & 0xF;
+    decoded->rd = (instruction >> 12) & 0xF;
+    decoded->cycles = 1;
+
+    if ((instruction >> 20) & 0x1) {
+        decoded->flags |= DECODED_SET_FLAGS;
+    }
+
+    if ((instruction >> 25) & 0x1) {
+        decoded->flags |= DECODED_IMMEDIATE;
+        const RotatedImmediate *immediate = &rotated_immediates[instruction & 0xFFF];
+
+        decoded->imm = immediate->value;
+        // only used to pick the kernel, a rotate of 0 keeps C
+        decoded->shift_amount = (immediate->carry == IMMEDIATE_CARRY_UNCHANGED) ? 0 : ((instruction >> 8) & 0xF) * 2;
+    } else {
+        decoded->rm = instruction & 0xF;
+        decoded->shift_type = (instruction >> 5) & 0x3;
+
+        if ((instruction >> 4) & 0x1) {
+            decoded->flags |= DECODED_SHIFT_BY_REGISTER;
+            decoded->rs = (instruction >> 8) & 0xF;
+            decoded->cycles++;
+        } else {
+            decoded->shift_amount = (instruction >> 7) & 0x1F;
+        }
+    }
+
+    if (decoded->rd == 15) {
+        decoded->cycles += 2;
+    }
+}
+
+static void decode_psr_transfer_arm(uint32_t instruction, DecodedInstruction *decoded) {
+    decoded->cycles = 1;
+
+    if ((instruction >> 22) & 0x1) {
+        decoded->flags |= DECODED_SPSR;
+    }
+
+    if (!((instruction >> 21) & 0x1)) {
+        // MRS{cond} Rd,<psr>
+        decoded->op = OP_MRS;
+        decoded->rd = (instruction >> 12) & 0xF;
+        return;
+    }
+
+    // MSR{cond} <psr>{_fields},Rm|#expression
+    decoded->op = OP_MSR;
+    decoded->opcode = (instruction >> 16) & 0xF;
+
+    if ((instruction >> 25) & 0x1) {
+        decoded->flags |= DECODED_IMMEDIATE;
+        decoded->imm = rotated_immediates[instruction & 0xFFF].value;
+    } else {
+        decoded->rm = instruction & 0xF;
+    }
+}
+
+static void decode_single_data_transfer_arm(uint32_t instruction, DecodedInstruction *decoded) {
+    decoded->op = OP_SINGLE_DATA_TRANSFER;
+    decoded->rn = (instruction >> 16) & 0xF;
+    decoded->rd = (instruction >> 12) & 0xF;
+
+    // I bit set means (shifted) register offset
+    if ((instruction >> 25) & 0x1) {
+        decoded->rm = instruction & 0xF;
+        decoded->shift_type = (instruction >> 5) & 0x3;
+        decoded->shift_amount = (instruction >> 7) & 0x1F;
+    } else {
+        decoded->flags |= DECODED_IMMEDIATE;
+        decoded->imm = instruction & 0xFFF;
+    }
+
+    decoded->flags |= ((instruction >> 24) & 0x1) ? DECODED_PRE_INDEX : 0;
+    decoded->flags |= ((instruction >> 23) & 0x1) ? DECODED_UP : 0;
+    decoded->flags |= ((instruction >> 22) & 0x1) ? DECODED_BYTE : 0;
+    decoded->flags |= ((instruction >> 21) & 0x1) ? DECODED_WRITE_BACK : 0;
+    decoded->flags |= ((instruction >> 20) & 0x1) ? DECODED_LOAD : 0;
+
+    decoded->cycles = (decoded->flags & DECODED_LOAD) ? 3 : 2;
+}
+
+static void decode_halfword_data_transfer_arm(uint32_t instruction, DecodedInstruction *decoded) {
+    decoded->op = OP_HALFWORD_DATA_TRANSFER;
+    decoded->rn = (instruction >> 16) & 0xF;
+    decoded->rd = (instruction >> 12) & 0xF;
+    decoded->opcode = (instruction >> 5) & 0x3;
+
+    if ((instruction >> 22) & 0x1) {
+        decoded->flags |= DECODED_IMMEDIATE;
+        decoded->imm = ((instruction >> 4) & 0xF0) | (instruction & 0xF);
+    } else {
+        decoded->rm = instruction & 0xF;
+    }
+
+    decoded->flags |= ((instruction >> 24) & 0x1) ? DECODED_PRE_INDEX : 0;
+    decoded->flags |= ((instruction >> 23) & 0x1) ? DECODED_UP : 0;
+    decoded->flags |= ((instruction >> 21) & 0x1) ? DECODED_WRITE_BACK : 0;
+    decoded->flags |= ((instruction >> 20) & 0x1) ? DECODED_LOAD : 0;
+
+    decoded->cycles = (decoded->flags & DECODED_LOAD) ? 3 : 2;
+}
+
+static void decode_block_data_transfer(uint16_t register_list, uint8_t rn, uint16_t flags, DecodedInstruction *decoded) {
+    decoded->op = OP_BLOCK_DATA_TRANSFER;
+    decoded->rn = rn;
+    decoded->imm = register_list;
+    decoded->flags |= flags;
+    decoded->cycles = __builtin_popcount(register_list) + ((flags & DECODED_LOAD) ? 2 : 1);
+}
+
+/*
+    Returns 1 if the instruction can change the pc (or anything else that has to be
+    looked at before the next instruction runs), which ends a block.
+*/
+static int decode_arm(uint32_t instruction, uint32_t address, DecodedInstruction *decoded) {
+    memset(decoded, 0, sizeof(DecodedInstruction));
+    decoded->condition = (instruction >> 28) & 0xF;
+
+    // 1111 is not used
+    if (decoded->condition == 0xF) {
+        decoded->op = OP_UNDEFINED;
+        decoded->condition = COND_AL;
+        return 1;
+    }
+
+    if ((instruction & 0x0FFFFFF0) == 0x012FFF10) {
+        // BX{cond} Rn
+        decoded->op = OP_BRANCH_EXCHANGE;
+        decoded->rm = instruction & 0xF;
+        decoded->cycles = 3;
+        return 1;
+    }
+
+    uint8_t first_three = (instruction >> 25) & 0x7;
+
+    switch (first_three) {
+        case 0: {
+            if (((instruction >> 4) & 0x9) == 0x9) {
+                if (((instruction >> 5) & 0x3) != 0) {
+                    decode_halfword_data_transfer_arm(instruction, decoded);
+                    return (decoded->flags & DECODED_LOAD) && decoded->rd == 15;
+                }
+
+                if ((instruction >> 24) & 0x1) {
+                    // SWP{cond}{B} Rd,Rm,[Rn]
+                    decoded->op = OP_SWAP;
+                    decoded->rn = (instruction >> 16) & 0xF;
+                    decoded->rd = (instruction >> 12) & 0xF;
+                    decoded->rm = instruction & 0xF;
+                    decoded->flags |= ((instruction >> 22) & 0x1) ? DECODED_BYTE : 0;
+                    decoded->cycles = 4;
+                    return decoded->rd == 15;
+                }
+
+                decoded->rm = instruction & 0xF;
+                decoded->rs = (instruction >> 8) & 0xF;
+                decoded->flags |= ((instruction >> 20) & 0x1) ? DECODED_SET_FLAGS : 0;
+                decoded->flags |= ((instruction >> 21) & 0x1) ? DECODED_ACCUMULATE : 0;
+
+                if ((instruction >> 23) & 0x1) {
+                    // (U|S)(MULL|MLAL){cond}{S} RdLo,RdHi,Rm,Rs
+                    decoded->op = OP_MULTIPLY_LONG;
+                    decoded->rd = (instruction >> 12) & 0xF;    // RdLo
+                    decoded->rn = (instruction >> 16) & 0xF;    // RdHi
+                    decoded->flags |= ((instruction >> 22) & 0x1) ? DECODED_SIGNED : 0;
+                    decoded->cycles = 5;
+                    return 0;
+                }
+
+                // MUL{cond}{S} Rd,Rm,Rs / MLA{cond}{S} Rd,Rm,Rs,Rn
+                decoded->op = OP_MULTIPLY;
+                decoded->rd = (instruction >> 16) & 0xF;
+                decoded->rn = (instruction >> 12) & 0xF;
+                decoded->cycles = 4;
+                return 0;
+            }
+
+            uint8_t opcode = (instruction >> 21) & 0xF;
+
+            if (opcode >= ALU_TST && opcode <= ALU_CMN && !((instruction >> 20) & 0x1)) {
+                decode_psr_transfer_arm(instruction, decoded);
+                return decoded->op == OP_MSR;
+            }
+
+            decode_data_processing_arm(instruction, decoded);
+            return decoded->rd == 15 && !(opcode >= ALU_TST && opcode <= ALU_CMN);
+        }
+        case 1: {
+            uint8_t opcode = (instruction >> 21) & 0xF;
+
+            if (opcode >= ALU_TST && opcode <= ALU_CMN && !((instruction >> 20) & 0x1)) {
+                if (!((instruction >> 21) & 0x1)) {
+                    decoded->op = OP_UNDEFINED;
+                    return 1;
+                }
+
+                decode_psr_transfer_arm(instruction, decoded);
+                return 1;
+            }
+
+            decode_data_processing_arm(instruction, decoded);
+            return decoded->rd == 15 && !(opcode >= ALU_TST && opcode <= ALU_CMN);
+        }
+        case 3:
+            if ((instruction >> 4) & 0x1) {
+                decoded->op = OP_UNDEFINED;
+                return 1;
+            }
+        // fall through
+        case 2:
+            decode_single_data_transfer_arm(instruction, decoded);
+            return (decoded->flags & DECODED_LOAD) && decoded->rd == 15;
+        case 4: {
+            uint16_t flags = 0;
+
+            flags |= ((instruction >> 24) & 0x1) ? DECODED_PRE_INDEX : 0;
+            flags |= ((instruction >> 23) & 0x1) ? DECODED_UP : 0;
+            flags |= ((instruction >> 22) & 0x1) ? DECODED_SET_FLAGS : 0;
+            flags |= ((instruction >> 21) & 0x1) ? DECODED_WRITE_BACK : 0;
+            flags |= ((instruction >> 20) & 0x1) ? DECODED_LOAD : 0;
+
+            decode_block_data_transfer(instruction & 0xFFFF, (instruction >> 16) & 0xF, flags, decoded);
+            return (flags & DECODED_LOAD) && ((instruction >> 15) & 0x1);
+        }
+        case 5: {
+            // B{L}{cond} <expression>, offset is relative to pc + 8
+            int32_t offset = (int32_t)(instruction << 8) >> 6;
+
+            decoded->op = OP_BRANCH;
+            decoded->imm = address + 8 + offset;
+            decoded->flags |= ((instruction >> 24) & 0x1) ? DECODED_LINK : 0;
+            decoded->cycles = 3;
+            return 1;
+        }
+        case 7:
+            if ((instruction >> 24) & 0x1) {
+                decoded->op = OP_SOFTWARE_INTERRUPT;
+                decoded->imm = get_swi_number_arm(instruction);
+                decoded->cycles = 3;
+                return 1;
+            }
+        // fall through
+        default:
+            // coprocessor instructions are not implemented in the GBA
+            decoded->op = OP_UNDEFINED;
+            return 1;
+    }
+}
+
+static void thumb_alu(DecodedInstruction *decoded, uint8_t opcode, uint8_t rd, uint8_t rn, uint8_t set_flags) {
+    decoded->op = OP_DATA_PROCESSING;
+    decoded->opcode = opcode;
+    decoded->rd = rd;
+    decoded->rn = rn;
+    decoded->cycles = 1;
+
+    if (set_flags) {
+        decoded->flags |= DECODED_SET_FLAGS;
+    }
+}
+
+static void thumb_alu_imm(DecodedInstruction *decoded, uint8_t opcode, uint8_t rd, uint8_t rn, uint32_t imm, uint8_t set_flags) {
+    thumb_alu(decoded, opcode, rd, rn, set_flags);
+    decoded->flags |= DECODED_IMMEDIATE;
+    decoded->imm = imm;
+}
+
+static void thumb_alu_reg(DecodedInstruction *decoded, uint8_t opcode, uint8_t rd, uint8_t rn, uint8_t rm, uint8_t set_flags) {
+    thumb_alu(decoded, opcode, rd, rn, set_flags);
+    decoded->rm = rm;
+}
+
+static void thumb_transfer(DecodedInstruction *decoded, uint8_t op, uint8_t rd, uint8_t rn, uint16_t flags) {
+    decoded->op = op;
+    decoded->rd = rd;
+    decoded->rn = rn;
+    decoded->flags |= flags | DECODED_PRE_INDEX | DECODED_UP;
+    decoded->cycles = (flags & DECODED_LOAD) ? 3 : 2;
+}
+
+/*
+    THUMB instructions are translated into their ARM equivalent where one exists,
+    see the THUMB instruction set chapter of the ARM7TDMI datasheet.
+*/
+static int decode_thumb(uint16_t instruction, uint32_t address, DecodedInstruction *decoded) {
+    memset(decoded, 0, sizeof(DecodedInstruction));
+    decoded->condition = COND_AL;
+
+    uint8_t rd = instruction & 0x7;
+    uint8_t rs = (instruction >> 3) & 0x7;
+
+    switch (instruction >> 13) {
+        case 0: {
+            uint8_t opcode = (instruction >> 11) & 0x3;
+
+            if (opcode == 3) {
+                // ADD/SUB Rd, Rs, Rn/#Offset3
+                uint8_t register_or_offset = (instruction >> 6) & 0x7;
+                uint8_t alu_opcode = ((instruction >> 9) & 0x1) ? ALU_SUB : ALU_ADD;
+
+                if ((instruction >> 10) & 0x1) {
+                    thumb_alu_imm(decoded, alu_opcode, rd, rs, register_or_offset, 1);
+                } else {
+                    thumb_alu_reg(decoded, alu_opcode, rd, rs, register_or_offset, 1);
+                }
+                return 0;
+            }
+
+            // LSL/LSR/ASR Rd, Rs, #Offset5 == MOVS Rd, Rs, <shift> #Offset5
+            thumb_alu_reg(decoded, ALU_MOV, rd, 0, rs, 1);
+            decoded->shift_type = opcode;
+            decoded->shift_amount = (instruction >> 6) & 0x1F;
+            return 0;
+        }
+        case 1: {
+            // MOV/CMP/ADD/SUB Rd, #Offset8
+            static const uint8_t opcodes[4] = { ALU_MOV, ALU_CMP, ALU_ADD, ALU_SUB };
+            rd = (instruction >> 8) & 0x7;
+
+            thumb_alu_imm(decoded, opcodes[(instruction >> 11) & 0x3], rd, rd, instruction & 0xFF, 1);
+            return 0;
+        }
+        case 2: {
+            if ((instruction >> 10) == 0x10) {
+                // ALU operations, OPCODE Rd, Rs
+                uint8_t opcode = (instruction >> 6) & 0xF;
+
+                switch (opcode) {
+                    case 0x2: // LSL
+                    case 0x3: // LSR
+                    case 0x4: // ASR
+                    case 0x7: // ROR
+                        thumb_alu_reg(decoded, ALU_MOV, rd, 0, rd, 1);
+                        decoded->flags |= DECODED_SHIFT_BY_REGISTER;
+                        decoded->shift_type = (opcode == 0x7) ? 3 : opcode - 2;
+                        decoded->rs = rs;
+                        decoded->cycles = 2;
+                        return 0;
+                    case 0x9: // NEG == RSBS Rd, Rs, #0
+                        thumb_alu_imm(decoded, ALU_RSB, rd, rs, 0, 1);
+                        return 0;
+                    case 0xD: // MUL == MULS Rd, Rs, Rd
+                        decoded->op = OP_MULTIPLY;
+                        decoded->rd = rd;
+                        decoded->rm = rs;
+                        decoded->rs = rd;
+                        decoded->flags |= DECODED_SET_FLAGS;
+                        decoded->cycles = 4;
+                        return 0;
+                    default:
+                        // AND, EOR, ADC, SBC, TST, CMP, CMN, ORR, BIC and MVN map to the ARM opcode
+                        thumb_alu_reg(decoded, opcode, rd, rd, rs, 1);
+                        return 0;
+                }
+            }
+
+            if ((instruction >> 10) == 0x11) {
+                // Hi register operations/branch exchange
+                uint8_t opcode = (instruction >> 8) & 0x3;
+                rd |= ((instruction >> 7) & 0x1) << 3;
+                rs |= ((instruction >> 6) & 0x1) << 3;
+
+                switch (opcode) {
+                    case 0:
+                        thumb_alu_reg(decoded, ALU_ADD, rd, rd, rs, 0);
+                        break;
+                    case 1:
+                        thumb_alu_reg(decoded, ALU_CMP, rd, rd, rs, 1);
+                        return 0;
+                    case 2:
+                        thumb_alu_reg(decoded, ALU_MOV, rd, 0, rs, 0);
+                        break;
+                    default:
+                        decoded->op = OP_BRANCH_EXCHANGE;
+                        decoded->rm = rs;
+                        decoded->cycles = 3;
+                        return 1;
+                }
+
+                if (rd == 15) {
+                    decoded->cycles += 2;
+                }
+                return rd == 15;
+            }
+
+            if ((instruction >> 11) == 0x9) {
+                // LDR Rd, [PC, #Imm], pc is word aligned. registers[15] is address + 4
+                // when this runs so fold the alignment into the offset
+                uint32_t pc_value = (address + 4) & ~3;
+                uint32_t target = pc_value + ((instruction & 0xFF) << 2);
+
+                thumb_transfer(decoded, OP_SINGLE_DATA_TRANSFER, (instruction >> 8) & 0x7, 15, DECODED_IMMEDIATE | DECODED_LOAD);
+                decoded->imm = target - (address + 4);
+                return 0;
+            }
+
+            uint8_t ro = (instruction >> 6) & 0x7;
+
+            if ((instruction >> 9) & 0x1) {
+                // STRH/LDRH/LDSB/LDSH Rd, [Rb, Ro]
+                static const uint8_t sh_types[4] = { 1, 2, 1, 3 };
+                uint8_t sh_flag = (instruction >> 10) & 0x3;
+
+                thumb_transfer(decoded, OP_HALFWORD_DATA_TRANSFER, rd, rs, sh_flag ? DECODED_LOAD : 0);
+                decoded->opcode = sh_types[sh_flag];
+                decoded->rm = ro;
+                return 0;
+            }
+
+            // STR(B)/LDR(B) Rd, [Rb, Ro]
+            uint16_t flags = ((instruction >> 11) & 0x1) ? DECODED_LOAD : 0;
+            flags |= ((instruction >> 10) & 0x1) ? DECODED_BYTE : 0;
+
+            thumb_transfer(decoded, OP_SINGLE_DATA_TRANSFER, rd, rs, flags);
+            decoded->rm = ro;
+            return 0;
+        }
+        case 3: {
+            // STR(B)/LDR(B) Rd, [Rb, #Imm]
+            uint8_t transfer_byte = (instruction >> 12) & 0x1;
+            uint32_t offset5 = (instruction >> 6) & 0x1F;
+            uint16_t flags = DECODED_IMMEDIATE;
+
+            flags |= transfer_byte ? DECODED_BYTE : 0;
+            flags |= ((instruction >> 11) & 0x1) ? DECODED_LOAD : 0;
+
+            thumb_transfer(decoded, OP_SINGLE_DATA_TRANSFER, rd, rs, flags);
+            decoded->imm = transfer_byte ? offset5 : offset5 << 2;
+            return 0;
+        }
+        case 4: {
+            uint16_t flags = DECODED_IMMEDIATE | (((instruction >> 11) & 0x1) ? DECODED_LOAD : 0);
+
+            if ((instruction >> 12) & 0x1) {
+                // STR/LDR Rd, [SP, #Imm]
+                thumb_transfer(decoded, OP_SINGLE_DATA_TRANSFER, (instruction >> 8) & 0x7, 13, flags);
+                decoded->imm = (instruction & 0xFF) << 2;
+                return 0;
+            }
+
+            // STRH/LDRH Rd, [Rb, #Imm]
+            thumb_transfer(decoded, OP_HALFWORD_DATA_TRANSFER, rd, rs, flags);
+            decoded->opcode = 1;
+            decoded->imm = ((instruction >> 6) & 0x1F) << 1;
+            return 0;
+        }
+        case 5: {
+            if (!((instruction >> 12) & 0x1)) {
+                // ADD Rd, PC/SP, #Imm
+                uint32_t offset = (instruction & 0xFF) << 2;
+                rd = (instruction >> 8) & 0x7;
+
+                if ((instruction >> 11) & 0x1) {
+                    thumb_alu_imm(decoded, ALU_ADD, rd, 13, offset, 0);
+                } else {
+                    // pc is known, this is a constant
+                    thumb_alu_imm(decoded, ALU_MOV, rd, 0, ((address + 4) & ~3) + offset, 0);
+                }
+                return 0;
+            }
+
+            if ((instruction >> 10) & 0x1) {
+                // PUSH {Rlist, LR} == STMDB SP!, POP {Rlist, PC} == LDMIA SP!
+                uint8_t load = (instruction >> 11) & 0x1;
+                uint16_t register_list = instruction & 0xFF;
+
+                if ((instruction >> 8) & 0x1) {
+                    register_list |= load ? (1 << 15) : (1 << 14);
+                }
+
+                if (load) {
+                    decode_block_data_transfer(register_list, 13, DECODED_LOAD | DECODED_UP | DECODED_WRITE_BACK, decoded);
+                    decoded->op = OP_POP;
+                } else {
+                    decode_block_data_transfer(register_list, 13, DECODED_PRE_INDEX | DECODED_WRITE_BACK, decoded);
+                    decoded->op = OP_PUSH;
+                }
+
+                return load && ((register_list >> 15) & 0x1);
+            }
+
+            // ADD SP, #(-)Imm
+            uint32_t offset = (instruction & 0x7F) << 2;
+            thumb_alu_imm(decoded, ((instruction >> 7) & 0x1) ? ALU_SUB : ALU_ADD, 13, 13, offset, 0);
+            return 0;
+        }
+        case 6: {
+            if (!((instruction >> 12) & 0x1)) {
+                // STMIA/LDMIA Rb!, {Rlist}
+                uint16_t flags = DECODED_UP | DECODED_WRITE_BACK;
+                flags |= ((instruction >> 11) & 0x1) ? DECODED_LOAD : 0;
+
+                decode_block_data_transfer(instruction & 0xFF, (instruction >> 8) & 0x7, flags, decoded);
+                return 0;
+            }
+
+            uint8_t cond = (instruction >> 8) & 0xF;
+
+            if (cond == 0xF) {
+                // SWI Value8
+                decoded->op = OP_SOFTWARE_INTERRUPT;
+                decoded->imm = get_swi_number_thumb(instruction);
+                decoded->cycles = 3;
+                return 1;
+            }
+
+            if (cond == 0xE) {
+                decoded->op = OP_UNDEFINED;
+                return 1;
+            }
+
+            // B{cond} label, offset is relative to pc + 4
+            decoded->op = OP_BRANCH;
+            decoded->condition = cond;
+            decoded->imm = address + 4 + (int8_t)(instruction & 0xFF) * 2;
+            decoded->cycles = 3;
+            return 1;
+        }
+        default: {
+            int32_t offset11 = (int16_t)((instruction & 0x7FF) << 5) >> 5;
+
+            if (!((instruction >> 12) & 0x1)) {
+                // B label
+                decoded->op = OP_BRANCH;
+                decoded->imm = address + 4 + offset11 * 2;
+                decoded->cycles = 3;
+                return 1;
+            }
+
+            if (!((instruction >> 11) & 0x1)) {
+                // BL label, high part of the offset: LR = PC + (offset << 12)
+                decoded->op = OP_THUMB_LONG_BRANCH_HIGH;
+                decoded->imm = (uint32_t)offset11 << 12;
+                decoded->cycles = 1;
+                return 0;
+            }
+
+            // BL label, low part: PC = LR + (offset << 1), LR = next instruction | 1
+            decoded->op = OP_THUMB_LONG_BRANCH_LOW;
+            decoded->imm = (instruction & 0x7FF) << 1;
+            decoded->cycles = 3;
+            return 1;
+        }
+    }
+}
+
+// data processing gets its kernel picked here so the interpreter can call it directly
+static void finish_data_processing(DecodedInstruction *decoded) {
+    select_alu_kernel(decoded);
+
+    // TST, TEQ, CMP, CMN never write rd
+    if (decoded->rd == 15 && !(decoded->opcode >= ALU_TST && decoded->opcode <= ALU_CMN)) {
+        decoded->op = OP_DATA_PROCESSING_PC;
+    }
+}
+
+int predecode_arm(uint32_t instruction, uint32_t address, DecodedInstruction *decoded) {
+    int ends_block = decode_arm(instruction, address, decoded);
+
+    if (decoded->op == OP_DATA_PROCESSING) {
+        finish_data_processing(decoded);
+    }
+
+    return ends_block;
+}
+
+int predecode_thumb(uint16_t instruction, uint32_t address, DecodedInstruction *decoded) {
+    int ends_block = decode_thumb(instruction, address, decoded);
+
+    if (decoded->op == OP_DATA_PROCESSING) {
+        finish_data_processing(decoded);
+    }
+
+    return ends_block;
+}
+
+/*
+    Macro-op fusion of common pairs: THUMB BL, LDR from the literal pool + BX, POP + BX
+    and a compare followed by a conditional branch. first (at address) becomes a single
+    op that does both. second stays in the block and is skipped by the fused handler,
+    that way addresses and instruction counts don't change. The second instruction of
+    every pair ends the block, so a block holds at most one fused pair.
+    Returns 1 if the pair was fused.
+*/
+int fuse_instructions(DecodedInstruction *first, const DecodedInstruction *second, uint32_t address) {
+    if (first->condition != COND_AL) {
+        return 0;
+    }
+
+    switch (first->op) {
+        case OP_THUMB_LONG_BRANCH_HIGH:
+            if (second->op != OP_THUMB_LONG_BRANCH_LOW) {
+                return 0;
+            }
+
+            first->op = OP_FUSED_BRANCH_LINK;
+            first->imm = address + 4 + first->imm + second->imm;
+            return 1;
+        case OP_SINGLE_DATA_TRANSFER: {
+            uint16_t required = DECODED_LOAD | DECODED_IMMEDIATE | DECODED_PRE_INDEX;
+
+            if ((first->flags & (required | DECODED_BYTE | DECODED_WRITE_BACK)) != required || first->rn != 15 || first->rd == 15) {
+                return 0;
+            }
+
+            if (second->op != OP_BRANCH_EXCHANGE || second->condition != COND_AL || second->rm != first->rd) {
+                return 0;
+            }
+
+            first->op = OP_FUSED_LOAD_BRANCH_EXCHANGE;
+            return 1;
+        }
+        case OP_POP:
+            if ((first->imm >> 15) & 0x1) {
+                return 0;
+            }
+
+            if (second->op != OP_BRANCH_EXCHANGE || !((first->imm >> second->rm) & 0x1)) {
+                return 0;
+            }
+
+            first->op = OP_FUSED_POP_BRANCH_EXCHANGE;
+            first->rm = second->rm;
+            return 1;
+        case OP_DATA_PROCESSING:
+            if (first->opcode < ALU_TST || first->opcode > ALU_CMN) {
+                return 0;
+            }
+
+            if (second->op != OP_BRANCH || second->condition == COND_AL || (second->flags & DECODED_LINK)) {
+                return 0;
+            }
+
+            first->op = OP_FUSED_COMPARE_BRANCH;
+            return 1;
+        default:
+            return 0;
+    }
+}
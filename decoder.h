@@ -0,0 +1,83 @@
+#ifndef DECODER_H
+#define DECODER_H
+#include <stdint.h>
+
+/*
+    Pre-decoded instructions. Both ARM and THUMB instructions are decoded into the
+    same form (most THUMB instructions are just a shorter encoding of an ARM one), so
+    the interpreter only needs one handler per operation.
+*/
+
+#define COND_AL 0xE
+
+enum DECODED_OP {
+    OP_DATA_PROCESSING = 0,
+    OP_DATA_PROCESSING_PC,          // data processing that writes the pc
+    OP_MRS,
+    OP_MSR,
+    OP_MULTIPLY,
+    OP_MULTIPLY_LONG,
+    OP_SWAP,
+    OP_BRANCH_EXCHANGE,
+    OP_SINGLE_DATA_TRANSFER,
+    OP_HALFWORD_DATA_TRANSFER,
+    OP_BLOCK_DATA_TRANSFER,
+    OP_BRANCH,
+    OP_SOFTWARE_INTERRUPT,
+    OP_THUMB_LONG_BRANCH_HIGH,      // first half of THUMB BL, sets up LR
+    OP_THUMB_LONG_BRANCH_LOW,       // second half of THUMB BL, does the branch
+    OP_PUSH,                        // THUMB PUSH {Rlist, LR}, imm is the register list
+    OP_POP,                         // THUMB POP {Rlist, PC}
+
+    // fused pairs, see fuse_instructions
+    OP_FUSED_BRANCH_LINK,           // both halves of THUMB BL, imm is the target
+    OP_FUSED_LOAD_BRANCH_EXCHANGE,  // LDR Rd, [PC, #offset] + BX Rd
+    OP_FUSED_POP_BRANCH_EXCHANGE,   // POP {Rlist} + BX Rm
+    OP_FUSED_COMPARE_BRANCH,        // CMP/CMN/TST/TEQ + Bcc
+    OP_UNDEFINED,
+    OP_COUNT
+};
+
+// DecodedInstruction.flags
+#define DECODED_SET_FLAGS (1 << 0)          // S bit, for block transfers the ^ bit
+#define DECODED_IMMEDIATE (1 << 1)          // operand 2/offset is imm instead of a register
+#define DECODED_SHIFT_BY_REGISTER (1 << 2)  // operand 2 register is shifted by rs
+#define DECODED_PRE_INDEX (1 << 3)
+#define DECODED_UP (1 << 4)
+#define DECODED_BYTE (1 << 5)
+#define DECODED_WRITE_BACK (1 << 6)
+#define DECODED_LOAD (1 << 7)
+#define DECODED_LINK (1 << 8)
+#define DECODED_ACCUMULATE (1 << 9)
+#define DECODED_SIGNED (1 << 10)
+#define DECODED_SPSR (1 << 11)              // MRS/MSR use the spsr
+#define DECODED_IDLE_LOOP (1 << 12)         // branch closes an idle loop (see idle_loop.c)
+
+struct CPU;
+struct DecodedInstruction;
+
+// specialised data processing kernel, see alu.c
+typedef void (*AluKernel)(struct CPU *cpu, const struct DecodedInstruction *instruction);
+
+typedef struct DecodedInstruction {
+    const void *handler;    // where the threaded interpreter jumps to, set by the interpreter
+    AluKernel alu;          // data processing only
+    uint32_t imm;           // immediate operand/offset, branch target, register list or swi number
+    uint16_t flags;
+    uint8_t op;
+    uint8_t condition;
+    uint8_t rd;
+    uint8_t rn;
+    uint8_t rm;
+    uint8_t rs;
+    uint8_t opcode;         // alu opcode, halfword transfer type (sh) or MSR field mask
+    uint8_t shift_type;
+    uint8_t shift_amount;   // for immediate operand 2 this is the rotate amount, LSR/ASR #0 become 32
+    uint8_t cycles;         // rough cycle count
+} DecodedInstruction;
+
+int predecode_arm(uint32_t instruction, uint32_t address, DecodedInstruction *decoded);
+int predecode_thumb(uint16_t instruction, uint32_t address, DecodedInstruction *decoded);
+int fuse_instructions(DecodedInstruction *first, const DecodedInstruction *second, uint32_t address);
+
+#endif
@@ -1,28 +1,21 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "setup.h"
 #include "instruction_parser.h"
+#include "libgba.h"
+#include "shm_export.h"
+#include "capture.h"
+#include "movie.h"
 
 enum INSTRUCTION_MODE {
     ARM = 0,
     THUMB = 1
 };
 
-int load_rom(Memory *memory) {
-
-    FILE *fp = fopen("PokemonEmeraldRom.gba", "rb");
-
-    if (fp == NULL) {
-        return 0;
-	}
-
-    fread(memory->rom, 1, ROM_SIZE, fp);
-
-	fclose(fp);
-
-	return 1;
-}
+#define ROM_PATH "PokemonEmeraldRom.gba"
+#define SAVE_PATH "PokemonEmeraldRom.sav"
 
 // todo, add better validation to this.
 uint32_t get_digit(char *s) {
@@ -46,17 +39,226 @@ uint32_t get_digit(char *s) {
     return val * sign;
 }
 
+// options for --run
+typedef struct {
+    uint32_t frames;
+    const char *rom_path;
+    uint8_t ppu_inline;         // render on the cpu thread instead of the ppu thread
+    uint32_t render_interval;   // render 1 frame in this many, 0 for none
+    uint8_t no_audio;           // don't emulate sound at all
+    const char *audio_path;     // .wav or raw PCM output, NULL to discard the samples
+    const char *shm_name;       // export every frame to this shared memory segment
+    uint8_t shm_state;          // also export wram1, wram2 and io
+    const char *capture_video;  // .y4m or raw RGBA frames, written on a background thread
+    const char *capture_audio;  // .wav or raw PCM, same
+    const char *save_path;      // .sav file backing the save memory
+    uint8_t no_save;            // start with erased save memory and don't touch the .sav
+    const char *trace_path;     // binary instruction trace, read it with trace_decode
+    const char *movie_path;     // KEYINPUT values to play back, see movie.h
+    const char *cheats_path;    // cheat codes applied every frame, see cheats.h
+    uint8_t huge_pages;         // back the emulated memory with huge pages
+    uint8_t print_hash;         // print the state hash at the end
+    uint8_t print_frame_hashes; // print the state hash after every frame
+} RunOptions;
+
+/*
+    Captures the frames the ppu has finished since published and exports the state,
+    with the newest of those frames if there is one. Returns the last frame taken.
+    Only rendered frames, skipped ones would repeat the last, and without waiting for
+    the frame just run, that would put the cpu and ppu threads in lockstep. The export
+    is written once for every frame that ran, after the last one only if a frame came.
+*/
+static uint64_t publish_frames(GBA *gba, Export *export, Capture *capture, uint64_t published, uint8_t frame_ran) {
+    const uint32_t *framebuffer;
+    const uint32_t *newest = NULL;
+
+    while ((framebuffer = gba_framebuffer_next(gba, &published)) != NULL) {
+        if (capture != NULL) {
+            capture_frame(capture, framebuffer);
+        }
+
+        newest = framebuffer;
+    }
+
+    if (export != NULL && (frame_ran || newest != NULL)) {
+        export_frame(export, gba, newest, published);
+    }
+
+    return published;
+}
+
+// runs the rom with the interpreter for the given amount of frames
+int run_rom(RunOptions *options) {
+    Movie *movie = NULL;
+
+    if (options->movie_path != NULL && (movie = movie_load(options->movie_path)) == NULL) {
+        exit(1);
+    }
+
+    if (movie != NULL && options->frames == 0) {
+        options->frames = movie_length(movie);
+    }
+
+    GBAOptions gba_options = gba_default_options();
+    gba_options.ppu_thread = !options->ppu_inline;
+    gba_options.render_interval = options->render_interval;
+    gba_options.audio = !options->no_audio;
+    gba_options.audio_path = options->audio_path;
+    gba_options.save_path = options->no_save ? NULL : options->save_path;
+    gba_options.trace_path = options->trace_path;
+    gba_options.huge_pages = options->huge_pages;
+
+    GBA *gba = gba_create(&gba_options);
+
+    if (gba == NULL || gba_load_rom_file(gba, options->rom_path) != 0) {
+        fprintf(stderr, "Error! could not open rom\n");
+        exit(1);
+    }
+
+    if (options->cheats_path != NULL && gba_cheats_load(gba, options->cheats_path) != 0) {
+        exit(1);
+    }
+
+    Capture *capture = NULL;
+
+    if (options->capture_video != NULL || options->capture_audio != NULL) {
+        capture = capture_create(options->capture_video, options->capture_audio, options->render_interval);
+
+        if (capture == NULL) {
+            exit(1);
+        }
+
+        gba_set_audio_callback(gba, capture_audio, capture);
+    }
+
+    Export *export = NULL;
+
+    if (options->shm_name != NULL && (export = export_create(options->shm_name, options->shm_state)) == NULL) {
+        exit(1);
+    }
+
+    uint64_t frames_published = 0;
+
+    for (uint32_t i = 0; i < options->frames; i++) {
+        uint16_t keys;
+
+        // movies hold the register value, active low
+        if (movie != NULL && movie_next(movie, gba_frame(gba), &keys)) {
+            gba_set_keys(gba, ~keys & 0x3FF);
+        }
+
+        gba_run_frames(gba, 1);
+
+        if (options->print_frame_hashes) {
+            printf("%llu %.16llx\n", (unsigned long long)gba_frame(gba), (unsigned long long)gba_state_hash(gba));
+        }
+
+        if (export != NULL || capture != NULL) {
+            frames_published = publish_frames(gba, export, capture, frames_published, 1);
+        }
+    }
+
+    // wait for the ppu to finish the last frame
+    gba_framebuffer(gba);
+
+    if (export != NULL || capture != NULL) {
+        publish_frames(gba, export, capture, frames_published, 0);
+    }
+    gba_print_stats(gba, stderr);
+
+    // state, then the last rendered frame
+    if (options->print_hash) {
+        printf("%.16llx %.16llx\n", (unsigned long long)gba_state_hash(gba),
+               (unsigned long long)gba_framebuffer_hash(gba));
+    }
+
+    export_destroy(export);
+    gba_destroy(gba);
+    capture_destroy(capture);
+    movie_destroy(movie);
+
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     uint32_t amount_to_deocde = 10;
 
+    // --run <frames> [--ppu-inline] [--frameskip <n>] [--audio <file.wav or file.raw>] [--no-audio]
+    //       [--shm <name> [--shm-state]] [--capture-video <file.y4m or file.rgba>]
+    //       [--capture-audio <file.wav or file.raw>] [--save <file.sav>] [--no-save] [--trace <file>]
+    //       [--movie <file>] [--hash] [--hash-frames] [--cheats <file>] [--rom <file.gba>]
+    // --run 0 with a movie runs to its last input, the state hash goes to stdout
+    if (argc > 2 && strcmp(argv[1], "--run") == 0) {
+        RunOptions options = {0};
+        options.frames = get_digit(argv[2]);
+        options.render_interval = 1;
+        options.rom_path = ROM_PATH;
+
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--ppu-inline") == 0) {
+                options.ppu_inline = 1;
+            } else if (strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc) {
+                // --frameskip 0 renders nothing, timing and io are the same either way
+                options.render_interval = get_digit(argv[++i]);
+            } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+                options.shm_name = argv[++i];
+            } else if (strcmp(argv[i], "--shm-state") == 0) {
+                options.shm_state = 1;
+            } else if (strcmp(argv[i], "--no-audio") == 0) {
+                options.no_audio = 1;
+            } else if (strcmp(argv[i], "--audio") == 0 && i + 1 < argc) {
+                options.audio_path = argv[++i];
+            } else if (strcmp(argv[i], "--rom") == 0 && i + 1 < argc) {
+                options.rom_path = argv[++i];
+            } else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc) {
+                options.movie_path = argv[++i];
+                options.print_hash = 1;
+            } else if (strcmp(argv[i], "--cheats") == 0 && i + 1 < argc) {
+                options.cheats_path = argv[++i];
+            } else if (strcmp(argv[i], "--hash") == 0) {
+                options.print_hash = 1;
+            } else if (strcmp(argv[i], "--hash-frames") == 0) {
+                options.print_frame_hashes = 1;
+            } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+                options.trace_path = argv[++i];
+            } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+                options.save_path = argv[++i];
+            } else if (strcmp(argv[i], "--no-save") == 0) {
+                options.no_save = 1;
+            } else if (strcmp(argv[i], "--capture-video") == 0 && i + 1 < argc) {
+                options.capture_video = argv[++i];
+            } else if (strcmp(argv[i], "--capture-audio") == 0 && i + 1 < argc) {
+                options.capture_audio = argv[++i];
+            } else if (strcmp(argv[i], "--huge-pages") == 0) {
+                options.huge_pages = 1;
+            } else {
+                fprintf(stderr, "Unknown option %s\n", argv[i]);
+                return 1;
+            }
+        }
+
+        // a movie starts from erased save memory unless a save is asked for, so it replays the same
+        if (options.save_path == NULL) {
+            options.save_path = SAVE_PATH;
+            options.no_save |= options.movie_path != NULL;
+        }
+
+        if (options.capture_audio != NULL && options.no_audio) {
+            fprintf(stderr, "--capture-audio needs sound, ignoring --no-audio\n");
+            options.no_audio = 0;
+        }
+
+        return run_rom(&options);
+    }
+
     if (argc > 1) {
         amount_to_deocde = get_digit(argv[1]);
     }
 
-    Memory *memory = (Memory *) malloc(sizeof(Memory));
+    Memory *memory = memory_create(0);
     int registers[16] = {0};     // register[15] = PC
 
-    if (load_rom(memory) == 0) {
+    if (memory == NULL || memory_map_rom(memory, ROM_PATH) != 0) {
         fprintf(stderr, "Error! could not open rom\n");
         exit(1);
     }
@@ -85,17 +287,16 @@ int main(int argc, char *argv[]) {
             printf("0x%.8x: %.4x ", address, instruction);
             // Todo: check if pc needs to be adjusted, it could be bytes ahead
             decode_instruction_thumb(instruction, *pc, registers[13], registers[14]);
+
             *pc += 2;
             address += 2;
         }
 
-
-
         // decode_instruction_arm(instruction);
         amount_to_deocde--;
 	}
 
-	free(memory);
+	memory_destroy(memory);
 
 	exit(0);
 }
@@ -0,0 +1,397 @@
+#include <stdint.h>
+#include "setup.h"
+#include "idle_loop.h"
+
+/*
+    Idle loop detection.
+
+    A loop is idle if running it again can't do anything the previous iteration
+    didn't already do. That is the case when:
+        - the body doesn't write memory (no stores, push, stm, swi, bl...)
+        - no register that is read before being written inside the body (a live-in)
+          is modified by the body. Something like "ldrh r0,[r1]; cmp r0,#0; beq loop"
+          is fine since r0 is reloaded every iteration, "sub r0,#1; bne loop" is not.
+
+    When that holds, only an event (interrupt, VCOUNT/DISPSTAT changing) can get the
+    cpu out of the loop, so the cycle counter can jump straight to the next event.
+
+    Register usage is tracked as a bitmask, bit 0-15 are r0-r15 and FLAGS is the cpsr
+    condition flags.
+*/
+
+#define FLAGS (1 << 16)
+#define REG(r) (1 << (r))
+
+int is_idle_swi(uint8_t swi_number) {
+    return swi_number == SWI_HALT || swi_number == SWI_INTR_WAIT || swi_number == SWI_VBLANK_INTR_WAIT;
+}
+
+// in ARM state the bios only looks at bits 16-23 of the comment field
+uint8_t get_swi_number_arm(uint32_t instruction) {
+    return (instruction >> 16) & 0xFF;
+}
+
+uint8_t get_swi_number_thumb(uint16_t instruction) {
+    return instruction & 0xFF;
+}
+
+/*
+    Fills reads/writes for a thumb instruction that is allowed in an idle loop body.
+    Returns 0 if the instruction can write memory or change control flow in a way we
+    don't follow.
+*/
+static int thumb_register_usage(uint16_t instruction, uint32_t *reads, uint32_t *writes) {
+    uint8_t rd = instruction & 0x7;
+    uint8_t rs = (instruction >> 3) & 0x7;
+
+    *reads = 0;
+    *writes = 0;
+
+    if ((instruction >> 11) == 0x3) {
+        // add/subtract
+        uint8_t rn = (instruction >> 6) & 0x7;
+        uint8_t is_immediate = (instruction >> 10) & 0x1;
+
+        *reads = REG(rs) | (is_immediate ? 0 : REG(rn));
+        *writes = REG(rd) | FLAGS;
+        return 1;
+    }
+
+    if ((instruction >> 13) == 0) {
+        // move shifted register
+        *reads = REG(rs);
+        *writes = REG(rd) | FLAGS;
+        return 1;
+    }
+
+    if ((instruction >> 13) == 1) {
+        // move/compare/add/subtract immediate
+        uint8_t opcode = (instruction >> 11) & 0x3;
+        rd = (instruction >> 8) & 0x7;
+
+        *reads = (opcode == 0) ? 0 : REG(rd);
+        *writes = (opcode == 1) ? FLAGS : REG(rd) | FLAGS;
+        return 1;
+    }
+
+    if ((instruction >> 10) == 0x10) {
+        // ALU operations
+        uint8_t opcode = (instruction >> 6) & 0xF;
+
+        switch (opcode) {
+            case 0x8: // TST
+            case 0xA: // CMP
+            case 0xB: // CMN
+                *reads = REG(rd) | REG(rs);
+                *writes = FLAGS;
+                return 1;
+            case 0x9: // NEG
+            case 0xF: // MVN
+                *reads = REG(rs);
+                *writes = REG(rd) | FLAGS;
+                return 1;
+            case 0x5: // ADC
+            case 0x6: // SBC
+            case 0x2: // LSL, LSR, ASR and ROR keep the carry when shifting by 0
+            case 0x3:
+            case 0x4:
+            case 0x7:
+                *reads = REG(rd) | REG(rs) | FLAGS;
+                *writes = REG(rd) | FLAGS;
+                return 1;
+            default:
+                *reads = REG(rd) | REG(rs);
+                *writes = REG(rd) | FLAGS;
+                return 1;
+        }
+    }
+
+    if ((instruction >> 10) == 0x11) {
+        // hi register operations/branch exchange
+        uint8_t opcode = (instruction >> 8) & 0x3;
+        rd |= ((instruction >> 7) & 0x1) << 3;
+        rs |= ((instruction >> 6) & 0x1) << 3;
+
+        if (opcode == 0x3 || rd == 15) {
+            // BX or a write to pc
+            return 0;
+        }
+
+        if (opcode == 0x0) {
+            *reads = REG(rd) | REG(rs);
+            *writes = REG(rd);
+        } else if (opcode == 0x1) {
+            *reads = REG(rd) | REG(rs);
+            *writes = FLAGS;
+        } else {
+            *reads = REG(rs);
+            *writes = REG(rd);
+        }
+
+        // pc reads are constant for a given address
+        *reads &= ~REG(15);
+        return 1;
+    }
+
+    if ((instruction >> 11) == 0x9) {
+        // PC-relative load
+        *writes = REG((instruction >> 8) & 0x7);
+        return 1;
+    }
+
+    if ((instruction >> 12) == 0x5) {
+        // load/store with register offset, load/store sign-extended byte/halfword
+        uint8_t ro = (instruction >> 6) & 0x7;
+        uint8_t sign_extended = (instruction >> 9) & 0x1;
+        uint8_t load = (instruction >> 11) & 0x1;
+
+        // sign extended: STRH is the only store (H=0, S=0)
+        if (sign_extended ? ((instruction >> 10) & 0x3) == 0 : !load) {
+            return 0;
+        }
+
+        *reads = REG(rs) | REG(ro);
+        *writes = REG(rd);
+        return 1;
+    }
+
+    if ((instruction >> 13) == 0x3 || (instruction >> 12) == 0x8) {
+        // load/store with immediate offset, load/store halfword
+        if (!((instruction >> 11) & 0x1)) {
+            return 0;
+        }
+
+        *reads = REG(rs);
+        *writes = REG(rd);
+        return 1;
+    }
+
+    if ((instruction >> 12) == 0x9) {
+        // SP-relative load/store
+        if (!((instruction >> 11) & 0x1)) {
+            return 0;
+        }
+
+        *reads = REG(13);
+        *writes = REG((instruction >> 8) & 0x7);
+        return 1;
+    }
+
+    if ((instruction >> 12) == 0xA) {
+        // load address
+        uint8_t source = (instruction >> 11) & 0x1;
+
+        *reads = source ? REG(13) : 0;
+        *writes = REG((instruction >> 8) & 0x7);
+        return 1;
+    }
+
+    if ((instruction >> 8) == 0xB0) {
+        // add offset to stack pointer
+        *reads = REG(13);
+        *writes = REG(13);
+        return 1;
+    }
+
+    if ((instruction >> 12) == 0xD) {
+        uint8_t cond = (instruction >> 8) & 0xF;
+
+        // 0xE is undefined and 0xF is a software interrupt
+        if (cond >= 0xE) {
+            return 0;
+        }
+
+        *reads = FLAGS;
+        return 1;
+    }
+
+    if ((instruction >> 11) == 0x1C) {
+        // unconditional branch
+        return 1;
+    }
+
+    // push/pop, multiple load/store, long branch with link
+    return 0;
+}
+
+static int arm_register_usage(uint32_t instruction, uint32_t *reads, uint32_t *writes) {
+    uint8_t condition = (instruction >> 28) & 0xF;
+    uint8_t rn = (instruction >> 16) & 0xF;
+    uint8_t rd = (instruction >> 12) & 0xF;
+    uint8_t rm = instruction & 0xF;
+
+    *reads = (condition == 0xE) ? 0 : FLAGS;
+    *writes = 0;
+
+    if (((instruction >> 25) & 0x7) == 0x5) {
+        // B, BL writes the link register
+        if ((instruction >> 24) & 0x1) {
+            return 0;
+        }
+        return 1;
+    }
+
+    if (((instruction >> 26) & 0x3) == 0x1) {
+        // single data transfer, only pre-indexed loads without write back
+        uint8_t pre_index = (instruction >> 24) & 0x1;
+        uint8_t write_back = (instruction >> 21) & 0x1;
+        uint8_t load = (instruction >> 20) & 0x1;
+        uint8_t register_offset = (instruction >> 25) & 0x1;
+
+        if (!load || !pre_index || write_back || rd == 15) {
+            return 0;
+        }
+
+        *reads |= REG(rn) | (register_offset ? REG(rm) : 0);
+        *writes |= REG(rd);
+        *reads &= ~REG(15);
+        return 1;
+    }
+
+    if (((instruction >> 26) & 0x3) != 0) {
+        return 0;
+    }
+
+    if (((instruction >> 4) & 0x9) == 0x9) {
+        // multiply, swap or halfword transfer. only halfword loads are allowed
+        uint8_t pre_index = (instruction >> 24) & 0x1;
+        uint8_t write_back = (instruction >> 21) & 0x1;
+        uint8_t load = (instruction >> 20) & 0x1;
+        uint8_t is_immediate = (instruction >> 22) & 0x1;
+
+        if (((instruction >> 5) & 0x3) == 0 || !load || !pre_index || write_back || rd == 15) {
+            return 0;
+        }
+
+        *reads |= REG(rn) | (is_immediate ? 0 : REG(rm));
+        *writes |= REG(rd);
+        *reads &= ~REG(15);
+        return 1;
+    }
+
+    // data processing
+    uint8_t is_imm = (instruction >> 25) & 0x1;
+    uint8_t opcode = (instruction >> 21) & 0xF;
+    uint8_t update_flags = (instruction >> 20) & 0x1;
+    uint8_t is_test = opcode >= 0x8 && opcode <= 0xB;
+
+    if (is_test && !update_flags) {
+        // PSR transfer
+        return 0;
+    }
+
+    if (!is_test && rd == 15) {
+        return 0;
+    }
+
+    if (opcode != 0xD && opcode != 0xF) {
+        *reads |= REG(rn);
+    }
+
+    if (!is_imm) {
+        *reads |= REG(rm);
+
+        if ((instruction >> 4) & 0x1) {
+            *reads |= REG((instruction >> 8) & 0xF);
+        }
+    }
+
+    // ADC, SBC, RSC read the carry
+    if (opcode >= 0x5 && opcode <= 0x7) {
+        *reads |= FLAGS;
+    }
+
+    *writes |= is_test ? 0 : REG(rd);
+    *writes |= update_flags ? FLAGS : 0;
+    *reads &= ~REG(15);
+    return 1;
+}
+
+/*
+    Checks the usage of one body instruction against what the loop did so far.
+    Returns 0 once the loop is known not to be idle.
+*/
+static int track_usage(uint32_t reads, uint32_t writes, uint32_t *live_in, uint32_t *written) {
+    *live_in |= reads & ~*written;
+    *written |= writes;
+
+    return (*live_in & *written) == 0;
+}
+
+/*
+    pc is the address of the branch instruction. Only backward branches whose body
+    fits in IDLE_LOOP_MAX_INSTRUCTIONS are checked.
+*/
+int is_idle_loop_thumb(Memory *memory, uint32_t pc, uint16_t instruction) {
+    int32_t offset;
+
+    if ((instruction >> 12) == 0xD && ((instruction >> 8) & 0xF) < 0xE) {
+        offset = (int8_t)(instruction & 0xFF) * 2;
+    } else if ((instruction >> 11) == 0x1C) {
+        offset = ((int16_t)((instruction & 0x7FF) << 5) >> 5) * 2;
+    } else {
+        return 0;
+    }
+
+    // pc is 4 bytes ahead because of prefetch
+    uint32_t target = pc + 4 + offset;
+
+    if (target > pc || (pc - target) / 2 > IDLE_LOOP_MAX_INSTRUCTIONS) {
+        return 0;
+    }
+
+    uint32_t live_in = 0;
+    uint32_t written = 0;
+    uint32_t reads, writes;
+
+    for (uint32_t address = target; address < pc; address += 2) {
+        uint16_t body_instruction = fetch_instruction_thumb(memory, address);
+
+        if (!thumb_register_usage(body_instruction, &reads, &writes)) {
+            return 0;
+        }
+
+        if (!track_usage(reads, writes, &live_in, &written)) {
+            return 0;
+        }
+    }
+
+    // the closing branch itself may read flags set in the body
+    thumb_register_usage(instruction, &reads, &writes);
+    return track_usage(reads, writes, &live_in, &written);
+}
+
+int is_idle_loop_arm(Memory *memory, uint32_t pc, uint32_t instruction) {
+    if (((instruction >> 24) & 0xF) != 0xA) {
+        // not a B (BL can't be an idle loop)
+        return 0;
+    }
+
+    int32_t offset = ((int32_t)(instruction << 8) >> 8) * 4;
+
+    // pc is 8 bytes ahead because of prefetch
+    uint32_t target = pc + 8 + offset;
+
+    if (target > pc || (pc - target) / 4 > IDLE_LOOP_MAX_INSTRUCTIONS) {
+        return 0;
+    }
+
+    uint32_t live_in = 0;
+    uint32_t written = 0;
+    uint32_t reads, writes;
+
+    for (uint32_t address = target; address < pc; address += 4) {
+        uint32_t body_instruction = fetch_instruction_arm(memory, address);
+
+        if (!arm_register_usage(body_instruction, &reads, &writes)) {
+            return 0;
+        }
+
+        if (!track_usage(reads, writes, &live_in, &written)) {
+            return 0;
+        }
+    }
+
+    arm_register_usage(instruction, &reads, &writes);
+    return track_usage(reads, writes, &live_in, &written);
+}
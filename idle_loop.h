@@ -0,0 +1,21 @@
+#ifndef IDLE_LOOP_H
+#define IDLE_LOOP_H
+#include <stdint.h>
+#include "setup.h"
+
+// bios functions (see swi_bios_functions) that put the cpu to sleep until an interrupt
+#define SWI_HALT 0x02
+#define SWI_INTR_WAIT 0x04
+#define SWI_VBLANK_INTR_WAIT 0x05
+
+// longest loop body (in instructions, not counting the branch) that is checked
+#define IDLE_LOOP_MAX_INSTRUCTIONS 8
+
+int is_idle_swi(uint8_t swi_number);
+uint8_t get_swi_number_arm(uint32_t instruction);
+uint8_t get_swi_number_thumb(uint16_t instruction);
+
+int is_idle_loop_thumb(Memory *memory, uint32_t pc, uint16_t instruction);
+int is_idle_loop_arm(Memory *memory, uint32_t pc, uint32_t instruction);
+
+#endif
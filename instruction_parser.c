@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include "alu.h"
 
 /*
 
@@ -232,26 +233,8 @@ TODO:
 */
 
 int get_imm(uint32_t instruction) {
-    // operand 2 is an immediate operand rotate
-    uint8_t rotate = (instruction >> 8) & 0xF; // 4 bit value
-    // according to the ARM7TDMI datasheet, imm should be zero extended to a 32 bit value that goes from unsigned to signed
-    int imm = instruction & 0xFF;
-
-    // according to datasheet, shift_amount = val at rotate * 2
-    uint8_t shift_amount = rotate * 2;
-
-   unsigned int mask = 1;
-
-   mask = (mask << shift_amount) - 1;
-
-   int masked_val = imm & mask;
-
-   imm = imm >> shift_amount;
-
-    // imm is 32 bit (zero extended)
-    imm = (masked_val << (32 - shift_amount)) | imm;
-
-    return imm;
+    // operand 2 is an 8 bit immediate rotated right by rotate * 2, see alu.c for the table
+    return rotated_immediates[instruction & 0xFFF].value;
 }
 
 
@@ -853,6 +836,10 @@ void decode_instruction_arm(uint32_t instruction) {
 }
 
 
+// first half of the last THUMB BL, the second half needs it to print the target
+static uint32_t long_branch_pc = -1;
+static int32_t long_branch_offset_high;
+
 void decode_instruction_thumb(uint16_t instruction, uint32_t pc, uint32_t stack_pointer, uint32_t link_register) {
     uint8_t next_bits = (instruction >> 13) & 0x7; // first 3 bits starting at msb
 
@@ -1305,14 +1292,30 @@ void decode_instruction_thumb(uint16_t instruction, uint32_t pc, uint32_t stack_
         */
         next_bits = (instruction >> 12) & 0x1;
 
-        if (next_bits == 1) g{
+        if (next_bits == 1) {
             // printf("Long branch with link\n");
-            // Todo: Implment long branch disassembler
             uint8_t offset_low = (instruction >> 11) & 0x1; // 1 = offset low, 0 = offset high
-            int16_t offset10 = instruction & 0x7FF;
+            uint32_t offset11 = instruction & 0x7FF;
+
+            if (!offset_low) {
+                // only the upper 11 bits of the offset, the target gets printed with the second half
+                long_branch_pc = pc;
+                long_branch_offset_high = (int32_t)(offset11 << 21) >> 9;
+
+                printf("BL (high) #%d", long_branch_offset_high);
+                printf("\n");
+                return;
+            }
+
+            if (pc != long_branch_pc + 2) {
+                // no first half right before this one, LR holds the upper part
+                printf("BL LR+#%d", offset11 << 1);
+                printf("\n");
+                return;
+            }
 
             printf("BL ");
-            printf("#%.8x", offset10);
+            printf("#%.8x", long_branch_pc + 4 + long_branch_offset_high + (offset11 << 1));
 
             printf("\n");
             return;
@@ -0,0 +1,957 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "setup.h"
+#include "cpu.h"
+#include "bios.h"
+#include "decoder.h"
+#include "idle_loop.h"
+#include "trace.h"
+#include "interpreter.h"
+
+/*
+    Threaded code interpreter.
+
+    Code is decoded once into blocks of DecodedInstruction. Each handler ends by jumping
+    directly to the handler of the next instruction in the block (NEXT), so there is one
+    indirect branch per handler instead of a single shared one, which the branch predictor
+    handles a lot better. Instructions with a condition other than AL go through
+    op_conditional first. While tracing every instruction goes through op_trace first.
+
+    While a block runs registers[15] holds the address of the current instruction plus
+    the prefetch offset (8 in ARM state, 4 in THUMB state). When execute_block returns
+    it holds the address of the next instruction to run.
+*/
+
+#ifdef THREADED_DISPATCH
+// handler_table[OP_COUNT] is op_conditional, handler_table[OP_COUNT + 1] is op_trace
+static const void *const *handler_table;
+
+#define DISPATCH() goto *instruction->handler
+#else
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() do { \
+    instruction++; \
+    address += step; \
+    if (instruction == end) { \
+        r[15] = address; \
+        return; \
+    } \
+    r[15] = address + prefetch; \
+    DISPATCH(); \
+} while (0)
+
+// a store that hit cached code ends the block, see run_blocks
+#define NEXT_AFTER_STORE() do { \
+    if (memory->code_written) { \
+        r[15] = address + step; \
+        return; \
+    } \
+    NEXT(); \
+} while (0)
+
+static inline uint32_t barrel_shift(uint32_t value, uint8_t shift_type, uint32_t amount, int by_register, uint8_t *carry) {
+    if (by_register && amount == 0) {
+        return value;
+    }
+
+    switch (shift_type) {
+        case 0: // LSL
+            if (amount == 0) {
+                return value;
+            }
+            if (amount < 32) {
+                *carry = (value >> (32 - amount)) & 0x1;
+                return value << amount;
+            }
+            *carry = (amount == 32) ? value & 0x1 : 0;
+            return 0;
+        case 1: // LSR, LSR #0 encodes LSR #32
+            if (amount == 0 || amount == 32) {
+                *carry = value >> 31;
+                return 0;
+            }
+            if (amount > 32) {
+                *carry = 0;
+                return 0;
+            }
+            *carry = (value >> (amount - 1)) & 0x1;
+            return value >> amount;
+        case 2: // ASR, ASR #0 encodes ASR #32
+            if (amount == 0 || amount >= 32) {
+                *carry = value >> 31;
+                return (value >> 31) ? 0xFFFFFFFF : 0;
+            }
+            *carry = (value >> (amount - 1)) & 0x1;
+            return (uint32_t)((int32_t)value >> amount);
+        default: // ROR, ROR #0 encodes RRX
+            if (amount == 0) {
+                uint32_t result = (*carry << 31) | (value >> 1);
+                *carry = value & 0x1;
+                return result;
+            }
+
+            amount &= 31;
+
+            if (amount == 0) {
+                *carry = value >> 31;
+                return value;
+            }
+
+            *carry = (value >> (amount - 1)) & 0x1;
+            return (value >> amount) | (value << (32 - amount));
+    }
+}
+
+// misaligned word loads rotate the aligned word
+static inline uint32_t load_word(Memory *memory, uint32_t address) {
+    uint32_t value = fetch_memory_word(memory, address);
+    uint8_t rotate = (address & 3) * 8;
+
+    return rotate ? (value >> rotate) | (value << (32 - rotate)) : value;
+}
+
+static void execute_block(CPU *cpu, Memory *memory, Block *block) {
+#ifdef THREADED_DISPATCH
+    static const void *const labels[OP_COUNT + 2] = {
+        [OP_DATA_PROCESSING] = &&op_data_processing,
+        [OP_DATA_PROCESSING_PC] = &&op_data_processing_pc,
+        [OP_MRS] = &&op_mrs,
+        [OP_MSR] = &&op_msr,
+        [OP_MULTIPLY] = &&op_multiply,
+        [OP_MULTIPLY_LONG] = &&op_multiply_long,
+        [OP_SWAP] = &&op_swap,
+        [OP_BRANCH_EXCHANGE] = &&op_branch_exchange,
+        [OP_SINGLE_DATA_TRANSFER] = &&op_single_data_transfer,
+        [OP_HALFWORD_DATA_TRANSFER] = &&op_halfword_data_transfer,
+        [OP_BLOCK_DATA_TRANSFER] = &&op_block_data_transfer,
+        [OP_BRANCH] = &&op_branch,
+        [OP_SOFTWARE_INTERRUPT] = &&op_software_interrupt,
+        [OP_THUMB_LONG_BRANCH_HIGH] = &&op_thumb_long_branch_high,
+        [OP_THUMB_LONG_BRANCH_LOW] = &&op_thumb_long_branch_low,
+        [OP_PUSH] = &&op_push,
+        [OP_POP] = &&op_pop,
+        [OP_FUSED_BRANCH_LINK] = &&op_fused_branch_link,
+        [OP_FUSED_LOAD_BRANCH_EXCHANGE] = &&op_fused_load_branch_exchange,
+        [OP_FUSED_POP_BRANCH_EXCHANGE] = &&op_fused_pop_branch_exchange,
+        [OP_FUSED_COMPARE_BRANCH] = &&op_fused_compare_branch,
+        [OP_UNDEFINED] = &&op_undefined,
+        [OP_COUNT] = &&op_conditional,
+        [OP_COUNT + 1] = &&op_trace
+    };
+
+    // called once by interpreter_init so blocks can be linked to the handlers
+    if (block == NULL) {
+        handler_table = labels;
+        return;
+    }
+#endif
+
+    uint32_t *r = cpu->registers;
+    const DecodedInstruction *instruction = block->instructions;
+    const DecodedInstruction *end = instruction + block->count;
+    uint32_t address = block->start;
+    const uint32_t step = block->thumb ? 2 : 4;
+    const uint32_t prefetch = step * 2;
+
+    r[15] = address + prefetch;
+    DISPATCH();
+
+#ifdef THREADED_DISPATCH
+op_trace:
+    trace_instruction(cpu->trace, cpu, memory, address);
+
+    if (instruction->condition != COND_AL) {
+        goto op_conditional;
+    }
+    goto *labels[instruction->op];
+
+op_conditional:
+    if (!condition_codes[instruction->condition](&cpu->cpsr)) {
+        NEXT();
+    }
+    goto *labels[instruction->op];
+#else
+dispatch:
+    if (cpu->trace != NULL) {
+        trace_instruction(cpu->trace, cpu, memory, address);
+    }
+
+    if (instruction->condition != COND_AL && !condition_codes[instruction->condition](&cpu->cpsr)) {
+        NEXT();
+    }
+
+    switch (instruction->op) {
+        case OP_DATA_PROCESSING: goto op_data_processing;
+        case OP_DATA_PROCESSING_PC: goto op_data_processing_pc;
+        case OP_MRS: goto op_mrs;
+        case OP_MSR: goto op_msr;
+        case OP_MULTIPLY: goto op_multiply;
+        case OP_MULTIPLY_LONG: goto op_multiply_long;
+        case OP_SWAP: goto op_swap;
+        case OP_BRANCH_EXCHANGE: goto op_branch_exchange;
+        case OP_SINGLE_DATA_TRANSFER: goto op_single_data_transfer;
+        case OP_HALFWORD_DATA_TRANSFER: goto op_halfword_data_transfer;
+        case OP_BLOCK_DATA_TRANSFER: goto op_block_data_transfer;
+        case OP_BRANCH: goto op_branch;
+        case OP_SOFTWARE_INTERRUPT: goto op_software_interrupt;
+        case OP_THUMB_LONG_BRANCH_HIGH: goto op_thumb_long_branch_high;
+        case OP_THUMB_LONG_BRANCH_LOW: goto op_thumb_long_branch_low;
+        case OP_PUSH: goto op_push;
+        case OP_POP: goto op_pop;
+        case OP_FUSED_BRANCH_LINK: goto op_fused_branch_link;
+        case OP_FUSED_LOAD_BRANCH_EXCHANGE: goto op_fused_load_branch_exchange;
+        case OP_FUSED_POP_BRANCH_EXCHANGE: goto op_fused_pop_branch_exchange;
+        case OP_FUSED_COMPARE_BRANCH: goto op_fused_compare_branch;
+        default: goto op_undefined;
+    }
+#endif
+
+op_data_processing:
+    instruction->alu(cpu, instruction);
+    NEXT();
+
+op_data_processing_pc:
+    instruction->alu(cpu, instruction);
+
+    // with S this is an exception return (e.g. SUBS PC, LR, #4)
+    if (instruction->flags & DECODED_SET_FLAGS) {
+        cpu_set_cpsr(cpu, cpu->spsr);
+    }
+
+    r[15] &= cpu->cpsr.t ? ~1 : ~3;
+    return;
+
+op_mrs:
+    r[instruction->rd] = psr_to_word((instruction->flags & DECODED_SPSR) ? cpu->spsr : cpu->cpsr);
+    NEXT();
+
+op_msr: {
+        uint32_t value = (instruction->flags & DECODED_IMMEDIATE) ? instruction->imm : r[instruction->rm];
+        uint32_t mask = 0;
+
+        // field mask: f (flags), s (status), x (extension), c (control)
+        mask |= (instruction->opcode & 0x8) ? 0xFF000000 : 0;
+        mask |= (instruction->opcode & 0x4) ? 0x00FF0000 : 0;
+        mask |= (instruction->opcode & 0x2) ? 0x0000FF00 : 0;
+        mask |= (instruction->opcode & 0x1) ? 0x000000FF : 0;
+
+        if (instruction->flags & DECODED_SPSR) {
+            cpu->spsr = psr_from_word((psr_to_word(cpu->spsr) & ~mask) | (value & mask));
+            NEXT();
+        }
+
+        // user mode can only change the flags, and the T bit can't be changed by MSR
+        if (cpu_mode(cpu) == MODE_USER) {
+            mask &= 0xFF000000;
+        }
+
+        mask &= ~0x20;
+
+        cpu_set_cpsr(cpu, psr_from_word((psr_to_word(cpu->cpsr) & ~mask) | (value & mask)));
+        NEXT();
+    }
+
+op_multiply: {
+        uint32_t result = r[instruction->rm] * r[instruction->rs];
+
+        if (instruction->flags & DECODED_ACCUMULATE) {
+            result += r[instruction->rn];
+        }
+
+        r[instruction->rd] = result;
+
+        if (instruction->flags & DECODED_SET_FLAGS) {
+            cpu->cpsr.n = result >> 31;
+            cpu->cpsr.z = (result == 0);
+        }
+
+        NEXT();
+    }
+
+op_multiply_long: {
+        uint64_t result;
+
+        if (instruction->flags & DECODED_SIGNED) {
+            result = (int64_t)(int32_t)r[instruction->rm] * (int64_t)(int32_t)r[instruction->rs];
+        } else {
+            result = (uint64_t)r[instruction->rm] * r[instruction->rs];
+        }
+
+        if (instruction->flags & DECODED_ACCUMULATE) {
+            result += ((uint64_t)r[instruction->rn] << 32) | r[instruction->rd];
+        }
+
+        r[instruction->rd] = result;
+        r[instruction->rn] = result >> 32;
+
+        if (instruction->flags & DECODED_SET_FLAGS) {
+            cpu->cpsr.n = result >> 63;
+            cpu->cpsr.z = (result == 0);
+        }
+
+        NEXT();
+    }
+
+op_swap: {
+        uint32_t swap_address = r[instruction->rn];
+        uint32_t value;
+
+        if (instruction->flags & DECODED_BYTE) {
+            value = fetch_memory(memory, swap_address);
+            store_memory(memory, swap_address, r[instruction->rm]);
+        } else {
+            value = load_word(memory, swap_address);
+            store_memory_word(memory, swap_address, r[instruction->rm]);
+        }
+
+        r[instruction->rd] = value;
+        NEXT_AFTER_STORE();
+    }
+
+op_branch_exchange: {
+        uint32_t target = r[instruction->rm];
+
+        // bit 0 of the target selects the state
+        cpu->cpsr.t = target & 0x1;
+        r[15] = target & (cpu->cpsr.t ? ~1 : ~3);
+        return;
+    }
+
+op_single_data_transfer: {
+        uint16_t flags = instruction->flags;
+        uint32_t offset = instruction->imm;
+
+        if (!(flags & DECODED_IMMEDIATE)) {
+            uint8_t carry = cpu->cpsr.c;
+            offset = barrel_shift(r[instruction->rm], instruction->shift_type, instruction->shift_amount, 0, &carry);
+        }
+
+        uint32_t base = r[instruction->rn];
+        uint32_t offset_address = (flags & DECODED_UP) ? base + offset : base - offset;
+        uint32_t transfer_address = (flags & DECODED_PRE_INDEX) ? offset_address : base;
+        uint8_t write_back = !(flags & DECODED_PRE_INDEX) || (flags & DECODED_WRITE_BACK);
+
+        if (flags & DECODED_LOAD) {
+            uint32_t value = (flags & DECODED_BYTE) ? fetch_memory(memory, transfer_address) : load_word(memory, transfer_address);
+
+            if (write_back) {
+                r[instruction->rn] = offset_address;
+            }
+
+            if (instruction->rd == 15) {
+                r[15] = value & ~3;
+                return;
+            }
+
+            r[instruction->rd] = value;
+            NEXT();
+        }
+
+        // storing the pc stores the address of the instruction + 12
+        uint32_t value = r[instruction->rd] + (instruction->rd == 15 ? 4 : 0);
+
+        if (flags & DECODED_BYTE) {
+            store_memory(memory, transfer_address, value);
+        } else {
+            store_memory_word(memory, transfer_address, value);
+        }
+
+        if (write_back) {
+            r[instruction->rn] = offset_address;
+        }
+
+        NEXT_AFTER_STORE();
+    }
+
+op_halfword_data_transfer: {
+        uint16_t flags = instruction->flags;
+        uint32_t offset = (flags & DECODED_IMMEDIATE) ? instruction->imm : r[instruction->rm];
+        uint32_t base = r[instruction->rn];
+        uint32_t offset_address = (flags & DECODED_UP) ? base + offset : base - offset;
+        uint32_t transfer_address = (flags & DECODED_PRE_INDEX) ? offset_address : base;
+        uint8_t write_back = !(flags & DECODED_PRE_INDEX) || (flags & DECODED_WRITE_BACK);
+
+        if (flags & DECODED_LOAD) {
+            uint32_t value;
+
+            switch (instruction->opcode) {
+                case 1: // H, misaligned reads are rotated
+                    value = fetch_memory_halfword(memory, transfer_address);
+                    if (transfer_address & 1) {
+                        value = (value >> 8) | (value << 24);
+                    }
+                    break;
+                case 2: // SB
+                    value = (int8_t)fetch_memory(memory, transfer_address);
+                    break;
+                default: // SH, misaligned reads load a signed byte
+                    if (transfer_address & 1) {
+                        value = (int8_t)fetch_memory(memory, transfer_address);
+                    } else {
+                        value = (int16_t)fetch_memory_halfword(memory, transfer_address);
+                    }
+                    break;
+            }
+
+            if (write_back) {
+                r[instruction->rn] = offset_address;
+            }
+
+            if (instruction->rd == 15) {
+                r[15] = value & ~3;
+                return;
+            }
+
+            r[instruction->rd] = value;
+            NEXT();
+        }
+
+        store_memory_halfword(memory, transfer_address, r[instruction->rd] + (instruction->rd == 15 ? 4 : 0));
+
+        if (write_back) {
+            r[instruction->rn] = offset_address;
+        }
+
+        NEXT_AFTER_STORE();
+    }
+
+op_block_data_transfer: {
+        uint16_t flags = instruction->flags;
+        uint16_t register_list = instruction->imm;
+        uint32_t count = __builtin_popcount(register_list);
+        uint32_t base = r[instruction->rn];
+
+        // an empty list transfers the pc and moves the base by 0x40
+        if (register_list == 0) {
+            register_list = 1 << 15;
+            count = 16;
+        }
+
+        uint32_t transfer_address;
+        uint32_t new_base;
+
+        // lowest register always goes to the lowest address
+        if (flags & DECODED_UP) {
+            transfer_address = base + ((flags & DECODED_PRE_INDEX) ? 4 : 0);
+            new_base = base + count * 4;
+        } else {
+            transfer_address = base - count * 4 + ((flags & DECODED_PRE_INDEX) ? 0 : 4);
+            new_base = base - count * 4;
+        }
+
+        // the ^ bit without the pc in the list transfers the user bank registers
+        uint8_t user_bank = (flags & DECODED_SET_FLAGS) && !((register_list >> 15) & 0x1);
+
+        if (flags & DECODED_LOAD) {
+            // a loaded base register wins over the write back
+            if (flags & DECODED_WRITE_BACK) {
+                r[instruction->rn] = new_base;
+            }
+
+            for (int i = 0; i < 16; i++) {
+                if ((register_list >> i) & 0x1) {
+                    *(user_bank ? cpu_user_register(cpu, i) : &r[i]) = fetch_memory_word(memory, transfer_address);
+                    transfer_address += 4;
+                }
+            }
+
+            if ((register_list >> 15) & 0x1) {
+                if (flags & DECODED_SET_FLAGS) {
+                    cpu_set_cpsr(cpu, cpu->spsr);
+                }
+
+                r[15] &= cpu->cpsr.t ? ~1 : ~3;
+                return;
+            }
+
+            NEXT();
+        }
+
+        for (int i = 0; i < 16; i++) {
+            if ((register_list >> i) & 0x1) {
+                uint32_t value = user_bank ? *cpu_user_register(cpu, i) : r[i];
+                store_memory_word(memory, transfer_address, value + (i == 15 ? step : 0));
+                transfer_address += 4;
+            }
+        }
+
+        if (flags & DECODED_WRITE_BACK) {
+            r[instruction->rn] = new_base;
+        }
+
+        NEXT_AFTER_STORE();
+    }
+
+op_branch:
+    if (instruction->flags & DECODED_LINK) {
+        r[14] = address + step;
+    }
+
+    r[15] = instruction->imm;
+    return;
+
+op_software_interrupt:
+    r[15] = address + step;
+    bios_call(cpu, memory, instruction->imm);
+    return;
+
+op_thumb_long_branch_high:
+    r[14] = r[15] + instruction->imm;
+    NEXT();
+
+op_thumb_long_branch_low: {
+        uint32_t next_instruction = address + 2;
+
+        r[15] = (r[14] + instruction->imm) & ~1;
+        r[14] = next_instruction | 1;
+        return;
+    }
+
+op_push: {
+        // STMDB sp!, lowest register at the lowest address
+        uint32_t register_list = instruction->imm;
+        uint32_t sp = r[13] - __builtin_popcount(register_list) * 4;
+
+        r[13] = sp;
+
+        while (register_list) {
+            store_memory_word(memory, sp, r[__builtin_ctz(register_list)]);
+            register_list &= register_list - 1;
+            sp += 4;
+        }
+
+        NEXT_AFTER_STORE();
+    }
+
+op_pop: {
+        // LDMIA sp!, sp is never in the list
+        uint32_t register_list = instruction->imm;
+        uint32_t sp = r[13];
+
+        while (register_list) {
+            r[__builtin_ctz(register_list)] = fetch_memory_word(memory, sp);
+            register_list &= register_list - 1;
+            sp += 4;
+        }
+
+        r[13] = sp;
+
+        // POP {PC} doesn't switch state on the ARM7TDMI
+        if ((instruction->imm >> 15) & 0x1) {
+            r[15] &= ~1;
+            return;
+        }
+
+        NEXT();
+    }
+
+    // fused pairs, these run both instructions and end the block
+
+op_fused_branch_link:
+    r[14] = (address + 4) | 1;
+    r[15] = instruction->imm;
+    return;
+
+op_fused_load_branch_exchange: {
+        uint32_t base = r[15];
+        uint32_t target = load_word(memory, (instruction->flags & DECODED_UP) ? base + instruction->imm : base - instruction->imm);
+
+        r[instruction->rd] = target;
+        cpu->cpsr.t = target & 0x1;
+        r[15] = target & (cpu->cpsr.t ? ~1 : ~3);
+        return;
+    }
+
+op_fused_pop_branch_exchange: {
+        uint32_t register_list = instruction->imm;
+        uint32_t sp = r[13];
+
+        while (register_list) {
+            r[__builtin_ctz(register_list)] = fetch_memory_word(memory, sp);
+            register_list &= register_list - 1;
+            sp += 4;
+        }
+
+        r[13] = sp;
+
+        uint32_t target = r[instruction->rm];
+
+        cpu->cpsr.t = target & 0x1;
+        r[15] = target & (cpu->cpsr.t ? ~1 : ~3);
+        return;
+    }
+
+op_fused_compare_branch:
+    instruction->alu(cpu, instruction);
+
+    // on to the branch
+    instruction++;
+    address += step;
+
+    if (!condition_codes[instruction->condition](&cpu->cpsr)) {
+        r[15] = address + step;
+        return;
+    }
+
+    r[15] = instruction->imm;
+    return;
+
+op_undefined:
+    fprintf(stderr, "Undefined instruction at %.8x\n", address);
+    r[15] = address + step;
+    return;
+}
+
+/*
+    bios and rom can't be written. wram code is cached too, its pages get marked so a
+    store to them is noticed (see check_code_write in setup.c). Only the unmirrored
+    wram addresses are cached so a block has exactly one address. Anything else is
+    decoded again every time it runs.
+*/
+static int is_cacheable(uint32_t address) {
+    uint8_t region = address >> 24;
+
+    if (region == 0x02) {
+        return address < 0x02000000 + WRAM1_SIZE;
+    }
+
+    if (region == 0x03) {
+        return address < 0x03000000 + WRAM2_SIZE;
+    }
+
+    return region == 0x00 || (region >= 0x08 && region <= 0x0D);
+}
+
+// while tracing nothing is fused, so every instruction gets its own record
+static void compile_block(Memory *memory, uint32_t start, uint8_t thumb, uint8_t tracing, Block *block) {
+    uint32_t address = start;
+
+    block->start = start;
+    block->thumb = thumb;
+    block->cycles = 0;
+    block->count = 0;
+    block->cached = 0;
+    block->next = NULL;
+    block->fall_through = NULL;
+    block->taken = NULL;
+    block->indirect = NULL;
+    block->link_generation = 0;
+
+    while (block->count < MAX_BLOCK_INSTRUCTIONS) {
+        DecodedInstruction *decoded = &block->instructions[block->count++];
+        int ends_block;
+
+        if (thumb) {
+            uint16_t instruction = fetch_instruction_thumb(memory, address);
+            ends_block = predecode_thumb(instruction, address, decoded);
+
+            if (decoded->op == OP_BRANCH && is_idle_loop_thumb(memory, address, instruction)) {
+                decoded->flags |= DECODED_IDLE_LOOP;
+            }
+        } else {
+            uint32_t instruction = fetch_instruction_arm(memory, address);
+            ends_block = predecode_arm(instruction, address, decoded);
+
+            if (decoded->op == OP_BRANCH && is_idle_loop_arm(memory, address, instruction)) {
+                decoded->flags |= DECODED_IDLE_LOOP;
+            }
+        }
+
+        if (block->count >= 2 && !tracing) {
+            DecodedInstruction *previous = &block->instructions[block->count - 2];
+
+            if (fuse_instructions(previous, decoded, address - (thumb ? 2 : 4))) {
+#ifdef THREADED_DISPATCH
+                previous->handler = handler_table[previous->op];
+#endif
+            }
+        }
+
+#ifdef THREADED_DISPATCH
+        if (tracing) {
+            decoded->handler = handler_table[OP_COUNT + 1];
+        } else {
+            decoded->handler = handler_table[(decoded->condition == COND_AL) ? decoded->op : OP_COUNT];
+        }
+#endif
+
+        block->cycles += decoded->cycles;
+        address += thumb ? 2 : 4;
+
+        if (ends_block) {
+            break;
+        }
+    }
+
+    block->end = address;
+}
+
+static Block *get_block(CPU *cpu, Memory *memory, uint32_t pc, uint8_t thumb) {
+    BlockCache *cache = cpu->block_cache;
+
+    if (!is_cacheable(pc)) {
+        compile_block(memory, pc, thumb, cpu->trace != NULL, cache->scratch);
+        return cache->scratch;
+    }
+
+    uint32_t index = (pc >> 1) & (BLOCK_TABLE_SIZE - 1);
+
+    for (Block *block = cache->buckets[index]; block != NULL; block = block->next) {
+        if (block->start == pc && block->thumb == thumb) {
+            return block;
+        }
+    }
+
+    compile_block(memory, pc, thumb, cpu->trace != NULL, cache->scratch);
+
+    size_t size = sizeof(Block) + cache->scratch->count * sizeof(DecodedInstruction);
+    Block *block = malloc(size);
+    memcpy(block, cache->scratch, size);
+
+    block->cached = 1;
+    block->link_generation = cache->generation;
+    block->next = cache->buckets[index];
+    cache->buckets[index] = block;
+
+    mark_code_pages(memory, block->start, block->end);
+
+    return block;
+}
+
+void interpreter_init(CPU *cpu) {
+#ifdef THREADED_DISPATCH
+    execute_block(NULL, NULL, NULL);
+#endif
+
+    cpu->block_cache = calloc(1, sizeof(BlockCache));
+    cpu->block_cache->scratch = malloc(sizeof(Block) + MAX_BLOCK_INSTRUCTIONS * sizeof(DecodedInstruction));
+}
+
+/*
+    Finds the block that runs after block, following its links if they are still valid
+    and filling them in otherwise. Which link is used depends on how the block ended:
+    falling off the end, taking its static branch or anything else (indirect).
+*/
+static Block *next_block(CPU *cpu, Memory *memory, Block *block) {
+    BlockCache *cache = cpu->block_cache;
+    uint32_t pc = cpu->registers[15];
+    uint8_t thumb = cpu->cpsr.t;
+
+    if (!block->cached) {
+        return get_block(cpu, memory, pc, thumb);
+    }
+
+    if (block->link_generation != cache->generation) {
+        block->fall_through = NULL;
+        block->taken = NULL;
+        block->indirect = NULL;
+        block->link_generation = cache->generation;
+    }
+
+    const DecodedInstruction *last = &block->instructions[block->count - 1];
+    Block **link;
+
+    if (pc == block->end) {
+        link = &block->fall_through;
+    } else if ((last->op == OP_BRANCH && pc == last->imm) ||
+               (block->count >= 2 && last[-1].op == OP_FUSED_BRANCH_LINK && pc == last[-1].imm)) {
+        link = &block->taken;
+    } else {
+        link = &block->indirect;
+    }
+
+    Block *next = *link;
+
+    if (next != NULL && next->start == pc && next->thumb == thumb) {
+        return next;
+    }
+
+    next = get_block(cpu, memory, pc, thumb);
+
+    if (next->cached) {
+        *link = next;
+    }
+
+    return next;
+}
+
+static void free_blocks(Block *block) {
+    while (block != NULL) {
+        Block *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+/*
+    Drops every cached block that overlaps [start, end), e.g. because the code was
+    written to. The blocks can't be freed straight away since one of them might be the
+    one that's running, they are freed at the start of the next step.
+*/
+void invalidate_blocks(CPU *cpu, uint32_t start, uint32_t end) {
+    BlockCache *cache = cpu->block_cache;
+
+    for (int i = 0; i < BLOCK_TABLE_SIZE; i++) {
+        Block **link = &cache->buckets[i];
+
+        while (*link != NULL) {
+            Block *block = *link;
+
+            if (block->start < end && block->end > start) {
+                *link = block->next;
+                block->next = cache->retired;
+                cache->retired = block;
+                cache->generation++;
+            } else {
+                link = &block->next;
+            }
+        }
+    }
+}
+
+void flush_block_cache(CPU *cpu) {
+    BlockCache *cache = cpu->block_cache;
+
+    for (int i = 0; i < BLOCK_TABLE_SIZE; i++) {
+        free_blocks(cache->buckets[i]);
+        cache->buckets[i] = NULL;
+    }
+
+    free_blocks(cache->retired);
+    cache->retired = NULL;
+    cache->generation++;
+}
+
+/*
+    Starts (or with NULL stops) recording every instruction. Blocks are compiled
+    differently while tracing, so the cache starts over. Only call it between frames.
+*/
+void interpreter_set_trace(CPU *cpu, struct Trace *trace) {
+    cpu->trace = trace;
+    flush_block_cache(cpu);
+}
+
+void interpreter_destroy(CPU *cpu) {
+    flush_block_cache(cpu);
+    free(cpu->block_cache->scratch);
+    free(cpu->block_cache);
+    cpu->block_cache = NULL;
+}
+
+/*
+    Cycles of the instructions that ran when the block stopped with next as the address
+    of the next instruction. A store to cached code stops it early (NEXT_AFTER_STORE),
+    the rest is run again from a fresh block and charged there.
+*/
+static uint32_t cycles_run(Block *block, uint32_t next) {
+    uint32_t step = block->thumb ? 2 : 4;
+
+    if (next <= block->start || next >= block->end) {
+        return block->cycles;
+    }
+
+    uint32_t cycles = 0;
+
+    for (uint32_t i = 0; i < (next - block->start) / step; i++) {
+        cycles += block->instructions[i].cycles;
+    }
+
+    return cycles;
+}
+
+/*
+    Runs blocks back to back, following the links between them, until the next event
+    is due or something happens that the dispatcher has to look at (halt, interrupt).
+*/
+static void run_blocks(CPU *cpu, Memory *memory) {
+    Scheduler *scheduler = &cpu->scheduler;
+    Block *block = get_block(cpu, memory, cpu->registers[15], cpu->cpsr.t);
+
+    for (;;) {
+        execute_block(cpu, memory, block);
+
+        if (memory->code_written) {
+            scheduler->cycles += cycles_run(block, cpu->registers[15]);
+            memory->code_written = 0;
+            invalidate_blocks(cpu, memory->code_written_start, memory->code_written_end);
+        } else {
+            scheduler->cycles += block->cycles;
+        }
+
+        /*
+            An idle loop branched back, nothing can happen until the next event so don't
+            bother running it. Skipped after the block is charged, and by whole iterations
+            when the block is the loop, so the cycle count is the same as running it.
+        */
+        const DecodedInstruction *last = &block->instructions[block->count - 1];
+
+        if ((last->flags & DECODED_IDLE_LOOP) && cpu->registers[15] == last->imm) {
+            if (last->imm == block->start) {
+                scheduler_skip_loop(scheduler, block->cycles);
+            } else {
+                scheduler_skip_to_next_event(scheduler);
+            }
+        }
+
+        if (scheduler->cycles >= scheduler->next_event || cpu->halted || memory->halt_requested) {
+            return;
+        }
+
+        // IE/IF/IME writes or an MSR can let a pending interrupt in
+        if (cpu_check_interrupts(cpu, memory)) {
+            return;
+        }
+
+        block = next_block(cpu, memory, block);
+    }
+}
+
+/*
+    Runs blocks (or skips ahead if halted) and fires due events.
+    Returns 1 if a frame finished.
+*/
+static int step(CPU *cpu, Memory *memory) {
+    BlockCache *cache = cpu->block_cache;
+
+    // nothing is running at this point
+    if (cache->retired != NULL) {
+        free_blocks(cache->retired);
+        cache->retired = NULL;
+    }
+
+    if (memory->halt_requested) {
+        memory->halt_requested = 0;
+        cpu->halted = 1;
+    }
+
+    cpu_check_interrupts(cpu, memory);
+
+    if (cpu->halted) {
+        scheduler_skip_to_next_event(&cpu->scheduler);
+    } else {
+        run_blocks(cpu, memory);
+    }
+
+    return scheduler_run_events(&cpu->scheduler, memory);
+}
+
+// returns the amount of cycles actually run (can overshoot up to the next event)
+uint64_t run_interpreter(CPU *cpu, Memory *memory, uint64_t cycles) {
+    uint64_t start = cpu->scheduler.cycles;
+
+    while (cpu->scheduler.cycles - start < cycles) {
+        step(cpu, memory);
+    }
+
+    return cpu->scheduler.cycles - start;
+}
+
+// runs until the start of the next VBlank
+void run_frame(CPU *cpu, Memory *memory) {
+    while (!step(cpu, memory)) {
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+#include <stdint.h>
+#include "setup.h"
+#include "cpu.h"
+#include "decoder.h"
+
+/*
+    GCC and clang support taking the address of a label (&&label) and jumping to it
+    (goto *pointer). With that every pre-decoded instruction carries the address of its
+    handler and each handler jumps straight to the next one (threaded code). Other
+    compilers get a switch.
+*/
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH 1
+#endif
+
+#define MAX_BLOCK_INSTRUCTIONS 64
+#define BLOCK_TABLE_SIZE 4096
+
+/*
+    A run of pre-decoded instructions that starts at start and ends with the first
+    instruction that can change the pc.
+
+    Cached blocks remember which blocks ran after them so the next one can be found
+    without a hash lookup. The links are only trusted while link_generation matches
+    the cache generation, invalidating any block bumps it.
+*/
+typedef struct Block {
+    uint32_t start;
+    uint32_t end;                   // address after the last instruction
+    uint32_t cycles;
+    uint16_t count;
+    uint8_t thumb;
+    uint8_t cached;                 // in the hash table, scratch blocks can't be linked
+    struct Block *next;             // next block in the same hash bucket
+
+    struct Block *fall_through;     // block starting at end
+    struct Block *taken;            // target of the static branch at the end
+    struct Block *indirect;         // last target of BX, POP {PC}, MOV PC etc.
+    uint32_t link_generation;
+
+    DecodedInstruction instructions[];
+} Block;
+
+typedef struct BlockCache {
+    Block *buckets[BLOCK_TABLE_SIZE];
+    Block *scratch;                 // for code that isn't cached, see is_cacheable
+    Block *retired;                 // invalidated blocks, freed once none of them can be running
+    uint32_t generation;
+} BlockCache;
+
+void interpreter_init(CPU *cpu);
+void interpreter_destroy(CPU *cpu);
+void flush_block_cache(CPU *cpu);
+void invalidate_blocks(CPU *cpu, uint32_t start, uint32_t end);
+void interpreter_set_trace(CPU *cpu, struct Trace *trace);
+
+uint64_t run_interpreter(CPU *cpu, Memory *memory, uint64_t cycles);
+void run_frame(CPU *cpu, Memory *memory);
+
+#endif
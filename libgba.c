@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "libgba.h"
+#include "setup.h"
+#include "cpu.h"
+#include "interpreter.h"
+#include "ppu.h"
+#include "apu.h"
+#include "backup.h"
+#include "trace.h"
+#include "state.h"
+#include "search.h"
+#include "cheats.h"
+
+#define STATE_MAGIC "GBASTATE"
+#define STATE_VERSION 1
+#define STATE_HEADER_SIZE 16                // magic, version, save memory size
+
+// the apu's emulated state, everything from cycles up to the sample buffers
+#define APU_STATE_START offsetof(APU, cycles)
+#define APU_STATE_SIZE (offsetof(APU, psg_left) - offsetof(APU, cycles))
+
+_Static_assert((int)GBA_CHEAT_RAW == (int)CHEAT_RAW, "cheat formats have to match cheats.h");
+_Static_assert((int)GBA_SEARCH_DELTA == (int)SEARCH_DELTA && (int)GBA_SEARCH_RANGE == (int)SEARCH_RANGE, "search ops have to match search.h");
+
+// flash command state, unlock up to the dirty sector bookkeeping
+#define BACKUP_STATE_START offsetof(Backup, unlock)
+#define BACKUP_STATE_SIZE (offsetof(Backup, dirty_sectors) - offsetof(Backup, unlock))
+
+// wram1 up to the end of oam, one block in Memory (see STATE_PAGES)
+#define MEMORY_STATE_SIZE ((size_t)STATE_PAGES << STATE_PAGE_SHIFT)
+
+struct GBA {
+    Memory *memory;
+    CPU cpu;
+    PPU *ppu;
+    APU *apu;
+    Backup *backup;
+    Trace *trace;
+    StateHash *state;
+    Cheats *cheats;
+    char *save_path;
+    uint8_t rom_loaded;
+    uint8_t started;                        // something ran, the rom can't change anymore
+};
+
+GBAOptions gba_default_options(void) {
+    GBAOptions options = {0};
+
+    options.ppu_thread = 1;
+    options.render_interval = 1;
+    options.audio = 1;
+
+    return options;
+}
+
+GBA *gba_create(const GBAOptions *options) {
+    GBAOptions defaults = gba_default_options();
+    GBA *gba = calloc(1, sizeof(GBA));
+
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    if (gba == NULL || (gba->memory = memory_create(options->huge_pages)) == NULL) {
+        fprintf(stderr, "Could not allocate the emulator\n");
+        free(gba);
+        return NULL;
+    }
+
+    Memory *memory = gba->memory;
+    CPU *cpu = &gba->cpu;
+
+    cpu_init(cpu, memory);
+    interpreter_init(cpu);
+
+    if (options->save_path != NULL && (gba->save_path = strdup(options->save_path)) == NULL) {
+        gba_destroy(gba);
+        return NULL;
+    }
+
+    if (options->trace_path != NULL) {
+        if ((gba->trace = trace_create(options->trace_path)) == NULL) {
+            gba_destroy(gba);
+            return NULL;
+        }
+
+        interpreter_set_trace(cpu, gba->trace);
+    }
+
+    if ((gba->ppu = ppu_create(memory, options->ppu_thread)) == NULL) {
+        gba_destroy(gba);
+        return NULL;
+    }
+
+    ppu_set_frameskip(gba->ppu, options->render_interval);
+    memory->ppu = gba->ppu;
+    cpu->scheduler.ppu = gba->ppu;
+
+    if (options->audio) {
+        gba->apu = apu_create(memory, &cpu->scheduler.cycles);
+
+        if (gba->apu == NULL || (options->audio_path != NULL && apu_open_sink(gba->apu, options->audio_path) != 0)) {
+            gba_destroy(gba);
+            return NULL;
+        }
+
+        memory->apu = gba->apu;
+        cpu->scheduler.apu = gba->apu;
+    }
+
+    return gba;
+}
+
+// the ppu and apu get flushed on the way out, save memory is synced to the file
+void gba_destroy(GBA *gba) {
+    if (gba == NULL) {
+        return;
+    }
+
+    Memory *memory = gba->memory;
+
+    state_hash_destroy(gba->state);
+    cheats_destroy(gba->cheats);
+
+    if (memory != NULL) {
+        memory->apu = NULL;
+        memory->ppu = NULL;
+        memory->backup = NULL;
+    }
+
+    apu_destroy(gba->apu);
+
+    if (gba->ppu != NULL) {
+        ppu_destroy(gba->ppu);
+    }
+
+    backup_destroy(gba->backup);
+    trace_destroy(gba->trace);
+
+    if (gba->cpu.block_cache != NULL) {
+        interpreter_destroy(&gba->cpu);
+    }
+
+    free(gba->save_path);
+    memory_destroy(memory);
+    free(gba);
+}
+
+static int can_load_rom(GBA *gba) {
+    if (gba->started || gba->rom_loaded) {
+        fprintf(stderr, "The rom has to be loaded once, before anything runs\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+// the rom is in place, the save memory type comes from its library id string
+static int rom_loaded(GBA *gba) {
+    Memory *memory = gba->memory;
+    uint8_t type = backup_detect(memory);
+
+    if (type != BACKUP_NONE) {
+        if ((gba->backup = backup_create(type, gba->save_path)) == NULL) {
+            return -1;
+        }
+
+        memory->backup = gba->backup;
+    }
+
+    gba->rom_loaded = 1;
+
+    // cheats added before the rom patch it now
+    if (gba->cheats != NULL) {
+        cheats_patch_rom(gba->cheats, memory);
+    }
+
+    return 0;
+}
+
+int gba_load_rom(GBA *gba, const void *data, size_t size) {
+    if (!can_load_rom(gba)) {
+        return -1;
+    }
+
+    if (size > ROM_SIZE) {
+        fprintf(stderr, "Rom is %zu bytes, more than the %d the cartridge space holds\n", size, ROM_SIZE);
+        return -1;
+    }
+
+    if (memory_copy_rom(gba->memory, data, (uint32_t)size) != 0) {
+        return -1;
+    }
+
+    return rom_loaded(gba);
+}
+
+// maps the file, instances running the same file share it, anything past ROM_SIZE is ignored
+int gba_load_rom_file(GBA *gba, const char *path) {
+    if (!can_load_rom(gba) || memory_map_rom(gba->memory, path) != 0) {
+        return -1;
+    }
+
+    return rom_loaded(gba);
+}
+
+void gba_run_frames(GBA *gba, uint32_t frames) {
+    gba->started = 1;
+
+    for (uint32_t i = 0; i < frames; i++) {
+        run_frame(&gba->cpu, gba->memory);
+
+        if (gba->backup != NULL) {
+            backup_frame(gba->backup);
+        }
+    }
+}
+
+uint64_t gba_run_cycles(GBA *gba, uint64_t cycles) {
+    uint64_t frame = gba->cpu.scheduler.frame;
+
+    gba->started = 1;
+    cycles = run_interpreter(&gba->cpu, gba->memory, cycles);
+
+    // save memory is flushed by frame, catch up on the ones that passed
+    for (; gba->backup != NULL && frame < gba->cpu.scheduler.frame; frame++) {
+        backup_frame(gba->backup);
+    }
+
+    return cycles;
+}
+
+void gba_set_keys(GBA *gba, uint16_t keys) {
+    *(uint16_t *)&gba->memory->io[IO_KEYINPUT] = ~keys & 0x3FF;
+}
+
+uint64_t gba_frame(GBA *gba) {
+    return gba->cpu.scheduler.frame;
+}
+
+uint64_t gba_cycles(GBA *gba) {
+    return gba->cpu.scheduler.cycles;
+}
+
+// frames, cycles, how many of them idle detection skipped and where the cpu is
+void gba_print_stats(GBA *gba, FILE *file) {
+    Scheduler *scheduler = &gba->cpu.scheduler;
+
+    fprintf(file, "%llu frames, %llu cycles, %llu skipped by idle detection, pc = %.8x\n",
+            (unsigned long long)scheduler->frame, (unsigned long long)scheduler->cycles,
+            (unsigned long long)scheduler->idle_cycles_skipped, gba->cpu.registers[15]);
+}
+
+const uint32_t *gba_framebuffer(GBA *gba) {
+    return ppu_frame(gba->ppu);
+}
+
+const uint32_t *gba_framebuffer_next(GBA *gba, uint64_t *number) {
+    return ppu_frame_after(gba->ppu, number);
+}
+
+uint64_t gba_frames_rendered(GBA *gba) {
+    return gba->ppu->frames_queued;
+}
+
+uint8_t *gba_memory_region(GBA *gba, int region, size_t *size) {
+    Memory *memory = gba->memory;
+    uint8_t *data = NULL;
+    size_t length = 0;
+
+    switch (region) {
+        case GBA_REGION_BIOS: data = memory->bios; length = BIOS_SIZE; break;
+        case GBA_REGION_WRAM1: data = memory->wram1; length = WRAM1_SIZE; break;
+        case GBA_REGION_WRAM2: data = memory->wram2; length = WRAM2_SIZE; break;
+        case GBA_REGION_IO: data = memory->io; length = IO_SIZE; break;
+        case GBA_REGION_PALETTE: data = memory->bg_obj_palette_ram; length = PALETTE_SIZE; break;
+        case GBA_REGION_VRAM: data = memory->vram; length = VRAM_SIZE; break;
+        case GBA_REGION_OAM: data = memory->obj_attributes; length = OAM_SIZE; break;
+        case GBA_REGION_ROM: data = memory->rom; length = ROM_SIZE; break;
+        case GBA_REGION_SAVE:
+            if (gba->backup != NULL) {
+                data = gba->backup->data;
+                length = gba->backup->size;
+            }
+            break;
+    }
+
+    if (size != NULL) {
+        *size = length;
+    }
+
+    return data;
+}
+
+/*
+    Memory was written without going through the store functions. Everything that
+    keeps a view of it starts over: the code cache, the state hash pages and the
+    ppu's copy of video memory. Save memory is flushed as a whole on the next frame.
+*/
+void gba_memory_changed(GBA *gba) {
+    Memory *memory = gba->memory;
+
+    flush_block_cache(&gba->cpu);
+    memset(memory->wram1_code_pages, 0, sizeof(memory->wram1_code_pages));
+    memset(memory->wram2_code_pages, 0, sizeof(memory->wram2_code_pages));
+    memory->code_written = 0;
+
+    mark_state_pages(memory, memory->wram1, MEMORY_STATE_SIZE);
+    ppu_resync(gba->ppu);
+
+    if (gba->backup != NULL) {
+        gba->backup->dirty_sectors = (uint32_t)((1ull << (gba->backup->size / BACKUP_SECTOR_SIZE)) - 1);
+        gba->backup->written = 1;
+    }
+}
+
+size_t gba_state_size(GBA *gba) {
+    return STATE_HEADER_SIZE + sizeof(CPU) + MEMORY_STATE_SIZE + 1 + APU_STATE_SIZE +
+           (gba->backup != NULL ? BACKUP_STATE_SIZE + gba->backup->size : 0);
+}
+
+static void put_uint32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (i * 8);
+    }
+}
+
+static uint32_t get_uint32(const uint8_t *in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+int gba_save_state(GBA *gba, void *buffer, size_t size) {
+    Memory *memory = gba->memory;
+    uint8_t *out = buffer;
+    CPU cpu = gba->cpu;
+
+    if (size < gba_state_size(gba)) {
+        fprintf(stderr, "A state needs %zu bytes, got %zu\n", gba_state_size(gba), size);
+        return -1;
+    }
+
+    // host pointers mean nothing in another instance
+    cpu.scheduler.ppu = NULL;
+    cpu.scheduler.apu = NULL;
+    cpu.scheduler.cheats = NULL;
+    cpu.block_cache = NULL;
+    cpu.trace = NULL;
+
+    memcpy(out, STATE_MAGIC, 8);
+    put_uint32(out + 8, STATE_VERSION);
+    put_uint32(out + 12, gba->backup != NULL ? gba->backup->size : 0);
+    out += STATE_HEADER_SIZE;
+
+    memcpy(out, &cpu, sizeof(CPU));
+    out += sizeof(CPU);
+    memcpy(out, memory->wram1, MEMORY_STATE_SIZE);
+    out += MEMORY_STATE_SIZE;
+    *out++ = memory->halt_requested;
+
+    // without sound the block is zeros, a state moves between instances with and without
+    if (gba->apu != NULL) {
+        apu_run(gba->apu, gba->cpu.scheduler.cycles);
+        memcpy(out, (uint8_t *)gba->apu + APU_STATE_START, APU_STATE_SIZE);
+    } else {
+        memset(out, 0, APU_STATE_SIZE);
+    }
+
+    out += APU_STATE_SIZE;
+
+    if (gba->backup != NULL) {
+        memcpy(out, (uint8_t *)gba->backup + BACKUP_STATE_START, BACKUP_STATE_SIZE);
+        out += BACKUP_STATE_SIZE;
+        memcpy(out, gba->backup->data, gba->backup->size);
+    }
+
+    return 0;
+}
+
+int gba_load_state(GBA *gba, const void *buffer, size_t size) {
+    Memory *memory = gba->memory;
+    const uint8_t *in = buffer;
+    uint32_t backup_size = gba->backup != NULL ? gba->backup->size : 0;
+
+    if (size < STATE_HEADER_SIZE || memcmp(in, STATE_MAGIC, 8) != 0 || get_uint32(in + 8) != STATE_VERSION) {
+        fprintf(stderr, "Not a version %d state\n", STATE_VERSION);
+        return -1;
+    }
+
+    if (get_uint32(in + 12) != backup_size || size < gba_state_size(gba)) {
+        fprintf(stderr, "State is for a different rom\n");
+        return -1;
+    }
+
+    in += STATE_HEADER_SIZE;
+
+    // the ppu has to be done with the old video memory before it changes
+    ppu_frame(gba->ppu);
+
+    CPU cpu;
+    memcpy(&cpu, in, sizeof(CPU));
+    in += sizeof(CPU);
+
+    cpu.scheduler.ppu = gba->cpu.scheduler.ppu;
+    cpu.scheduler.apu = gba->cpu.scheduler.apu;
+    cpu.scheduler.cheats = gba->cpu.scheduler.cheats;
+    cpu.block_cache = gba->cpu.block_cache;
+    cpu.trace = gba->cpu.trace;
+    gba->cpu = cpu;
+
+    memcpy(memory->wram1, in, MEMORY_STATE_SIZE);
+    in += MEMORY_STATE_SIZE;
+    memory->halt_requested = *in++;
+
+    if (gba->apu != NULL) {
+        // samples of the old state that weren't mixed yet are dropped
+        memcpy((uint8_t *)gba->apu + APU_STATE_START, in, APU_STATE_SIZE);
+        gba->apu->pending = 0;
+    }
+
+    in += APU_STATE_SIZE;
+
+    if (gba->backup != NULL) {
+        memcpy((uint8_t *)gba->backup + BACKUP_STATE_START, in, BACKUP_STATE_SIZE);
+        in += BACKUP_STATE_SIZE;
+        memcpy(gba->backup->data, in, backup_size);
+    }
+
+    gba->started = 1;
+    gba_memory_changed(gba);
+
+    return 0;
+}
+
+uint64_t gba_state_hash(GBA *gba) {
+    if (gba->state == NULL && (gba->state = state_hash_create()) == NULL) {
+        return 0;
+    }
+
+    return state_hash(gba->state, &gba->cpu, gba->memory);
+}
+
+uint64_t gba_framebuffer_hash(GBA *gba) {
+    return framebuffer_hash(ppu_frame(gba->ppu));
+}
+
+void gba_set_audio_callback(GBA *gba, GBAAudioCallback callback, void *context) {
+    if (gba->apu != NULL) {
+        apu_set_pcm_callback(gba->apu, callback, context);
+    }
+}
+
+GBASearch *gba_search_create(GBA *gba, int bits) {
+    if (bits != 8 && bits != 16 && bits != 32) {
+        fprintf(stderr, "Can only search 8, 16 or 32 bit values, not %d\n", bits);
+        return NULL;
+    }
+
+    return search_create(gba->memory, bits / 8);
+}
+
+void gba_search_reset(GBASearch *search) {
+    search_reset(search);
+}
+
+uint32_t gba_search_filter(GBASearch *search, int op, uint32_t a, uint32_t b) {
+    // before it narrows to search_filter's uint8_t and wraps into a known one
+    if (op < 0 || op >= SEARCH_OP_COUNT) {
+        fprintf(stderr, "Unknown search test %d\n", op);
+        return search->count;
+    }
+
+    return search_filter(search, op, a, b);
+}
+
+uint32_t gba_search_results(GBASearch *search, uint32_t *addresses, uint32_t max) {
+    return search_results(search, addresses, max);
+}
+
+void gba_search_destroy(GBASearch *search) {
+    search_destroy(search);
+}
+
+static int make_cheats(GBA *gba) {
+    if (gba->cheats == NULL && (gba->cheats = cheats_create()) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void cheats_added(GBA *gba) {
+    gba->cpu.scheduler.cheats = gba->cheats;
+
+    // blocks compiled from the old rom bytes have to go
+    if (gba->rom_loaded && cheats_patch_rom(gba->cheats, gba->memory) != 0) {
+        flush_block_cache(&gba->cpu);
+    }
+}
+
+int gba_cheats_add(GBA *gba, const char *codes, int format) {
+    if (make_cheats(gba) != 0 || cheats_add(gba->cheats, codes, format) != 0) {
+        return -1;
+    }
+
+    cheats_added(gba);
+    return 0;
+}
+
+int gba_cheats_load(GBA *gba, const char *path) {
+    if (make_cheats(gba) != 0 || cheats_load(gba->cheats, path) != 0) {
+        return -1;
+    }
+
+    cheats_added(gba);
+    return 0;
+}
+
+// every code is removed and the rom is back to what was loaded
+void gba_cheats_clear(GBA *gba) {
+    if (gba->cheats == NULL) {
+        return;
+    }
+
+    cheats_clear(gba->cheats, gba->memory);
+    flush_block_cache(&gba->cpu);
+}
@@ -0,0 +1,176 @@
+#ifndef LIBGBA_H
+#define LIBGBA_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+    The emulator as a library (libgba.a, libgba.so). Everything goes through an
+    opaque GBA instance, any number of them can exist side by side:
+
+        GBAOptions options = gba_default_options();
+        GBA *gba = gba_create(&options);
+
+        gba_load_rom_file(gba, "game.gba");
+
+        for (;;) {
+            gba_set_keys(gba, keys);
+            gba_run_frames(gba, 1);
+            draw(gba_framebuffer(gba));
+        }
+
+        gba_destroy(gba);
+
+    Functions returning int give 0 on success and -1 (with a message on stderr) on
+    failure. An instance is not thread safe, call it from one thread at a time.
+*/
+
+#if defined(__GNUC__)
+#define GBA_API __attribute__((visibility("default")))
+#else
+#define GBA_API
+#endif
+
+#define GBA_SCREEN_WIDTH 240
+#define GBA_SCREEN_HEIGHT 160
+
+// KEYINPUT bits, gba_set_keys takes them active high (set = pressed)
+#define GBA_KEY_A (1 << 0)
+#define GBA_KEY_B (1 << 1)
+#define GBA_KEY_SELECT (1 << 2)
+#define GBA_KEY_START (1 << 3)
+#define GBA_KEY_RIGHT (1 << 4)
+#define GBA_KEY_LEFT (1 << 5)
+#define GBA_KEY_UP (1 << 6)
+#define GBA_KEY_DOWN (1 << 7)
+#define GBA_KEY_R (1 << 8)
+#define GBA_KEY_L (1 << 9)
+
+enum GBA_REGION {
+    GBA_REGION_BIOS = 0,
+    GBA_REGION_WRAM1,                   // 0x02000000
+    GBA_REGION_WRAM2,                   // 0x03000000
+    GBA_REGION_IO,                      // 0x04000000
+    GBA_REGION_PALETTE,                 // 0x05000000
+    GBA_REGION_VRAM,                    // 0x06000000
+    GBA_REGION_OAM,                     // 0x07000000
+    GBA_REGION_ROM,                     // 0x08000000
+    GBA_REGION_SAVE,                    // 0x0E000000, NULL if the rom has no save memory
+    GBA_REGION_COUNT
+};
+
+typedef struct GBA GBA;
+
+typedef struct {
+    int ppu_thread;                     // render on a thread of its own instead of inside the run calls
+    uint32_t render_interval;           // render 1 frame in this many, 0 for none
+    int audio;                          // emulate sound
+    const char *audio_path;             // .wav or raw PCM output, NULL to discard the samples
+    const char *save_path;              // .sav file backing the save memory, NULL for erased memory
+    const char *trace_path;             // binary instruction trace, see trace.h
+    int huge_pages;                     // ask for huge pages behind the emulated memory (fewer TLB misses)
+} GBAOptions;
+
+typedef void (*GBAAudioCallback)(void *context, const int16_t *frames, uint32_t count);
+
+GBA_API GBAOptions gba_default_options(void);
+GBA_API GBA *gba_create(const GBAOptions *options);
+GBA_API void gba_destroy(GBA *gba);
+
+// the rom has to be loaded before anything runs, the save memory type comes from it
+GBA_API int gba_load_rom(GBA *gba, const void *data, size_t size);
+GBA_API int gba_load_rom_file(GBA *gba, const char *path);
+
+// run_frames stops at the start of a VBlank, run_cycles returns how many ran (a little over)
+GBA_API void gba_run_frames(GBA *gba, uint32_t frames);
+GBA_API uint64_t gba_run_cycles(GBA *gba, uint64_t cycles);
+
+GBA_API void gba_set_keys(GBA *gba, uint16_t keys);
+GBA_API uint64_t gba_frame(GBA *gba);
+GBA_API uint64_t gba_cycles(GBA *gba);
+GBA_API void gba_print_stats(GBA *gba, FILE *file);
+
+/*
+    Last rendered frame, GBA_SCREEN_WIDTH * GBA_SCREEN_HEIGHT 0xAABBGGRR pixels. Waits
+    for the ppu thread. Valid until the next run call. frames_rendered goes up by one
+    for every frame that wasn't skipped.
+*/
+GBA_API const uint32_t *gba_framebuffer(GBA *gba);
+GBA_API uint64_t gba_frames_rendered(GBA *gba);
+
+/*
+    For taking every rendered frame without waiting for the ppu thread, so the cpu and
+    ppu keep running side by side: the frame after number (start at 0) once the ppu is
+    done with it, NULL if it isn't yet. number is set to the frame returned, call it
+    until NULL after every run call. Valid until the next run call.
+*/
+GBA_API const uint32_t *gba_framebuffer_next(GBA *gba, uint64_t *number);
+
+/*
+    The region as it is in the instance, size is set if not NULL. Reading is always
+    fine between run calls. After writing through it call gba_memory_changed, the
+    renderer, the code cache and the state hash don't see those writes otherwise.
+    The bios and rom are read only (shared between instances), writing them faults.
+*/
+GBA_API uint8_t *gba_memory_region(GBA *gba, int region, size_t *size);
+GBA_API void gba_memory_changed(GBA *gba);
+
+/*
+    Save states hold the cpu, memory, sound and save memory. They are only meant to be
+    loaded by the same build they were saved with. Samples that weren't mixed yet and
+    the framebuffer aren't in them, the picture is right again after the next frame.
+*/
+GBA_API size_t gba_state_size(GBA *gba);
+GBA_API int gba_save_state(GBA *gba, void *buffer, size_t size);
+GBA_API int gba_load_state(GBA *gba, const void *buffer, size_t size);
+
+// see state.h
+GBA_API uint64_t gba_state_hash(GBA *gba);
+GBA_API uint64_t gba_framebuffer_hash(GBA *gba);
+
+/*
+    Value search over wram1 and wram2, see search.h. A search is for 8, 16 or 32 bit
+    values and starts with all of them, every filter narrows it down. Filter between
+    run calls, the search reads the instance's memory.
+*/
+enum GBA_SEARCH_OP {
+    GBA_SEARCH_EQUAL = 0,               // value == a
+    GBA_SEARCH_NOT_EQUAL,               // value != a
+    GBA_SEARCH_RANGE,                   // a <= value <= b, unsigned
+    GBA_SEARCH_CHANGED,                 // since the previous filter
+    GBA_SEARCH_UNCHANGED,
+    GBA_SEARCH_INCREASED,               // unsigned
+    GBA_SEARCH_DECREASED,
+    GBA_SEARCH_DELTA                    // a <= value - previous <= b, signed
+};
+
+typedef struct Search GBASearch;
+
+GBA_API GBASearch *gba_search_create(GBA *gba, int bits);
+GBA_API void gba_search_reset(GBASearch *search);
+GBA_API uint32_t gba_search_filter(GBASearch *search, int op, uint32_t a, uint32_t b);
+GBA_API uint32_t gba_search_results(GBASearch *search, uint32_t *addresses, uint32_t max);
+GBA_API void gba_search_destroy(GBASearch *search);
+
+/*
+    Cheat codes, see cheats.h. Each call compiles one or more codes, one per line, a
+    line like [codebreaker] switches the format for the lines after it. Rom patches
+    are written right away, everything else runs when VBlank starts. Returns -1 and
+    adds nothing if a line can't be used.
+*/
+enum GBA_CHEAT_FORMAT {
+    GBA_CHEAT_AUTO = 0,                 // 8+8 digits GameShark v1/v2, 8+4 CodeBreaker, address:value raw
+    GBA_CHEAT_GAMESHARK,
+    GBA_CHEAT_ACTION_REPLAY,            // v3
+    GBA_CHEAT_CODEBREAKER,
+    GBA_CHEAT_RAW
+};
+
+GBA_API int gba_cheats_add(GBA *gba, const char *codes, int format);
+GBA_API int gba_cheats_load(GBA *gba, const char *path);
+GBA_API void gba_cheats_clear(GBA *gba);
+
+// gets every block of 16 bit stereo frames at the host rate, needs audio
+GBA_API void gba_set_audio_callback(GBA *gba, GBAAudioCallback callback, void *context);
+
+#endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include "setup.h"
+#include "movie.h"
+
+Movie *movie_load(const char *path) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+
+    Movie *movie = calloc(1, sizeof(Movie));
+    uint32_t capacity = 0;
+    uint32_t line_number = 0;
+    char line[256];
+
+    while (movie != NULL && fgets(line, sizeof(line), file) != NULL) {
+        uint64_t frame;
+        unsigned int keys;
+
+        line_number++;
+
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#') {
+            continue;
+        }
+
+        if (sscanf(line, "%" SCNu64 " %x", &frame, &keys) != 2 || keys > 0x3FF ||
+            (movie->count > 0 && frame <= movie->inputs[movie->count - 1].frame)) {
+            fprintf(stderr, "%s:%u: expected \"<frame> <keyinput>\" with frames going up\n", path, line_number);
+            movie_destroy(movie);
+            movie = NULL;
+            break;
+        }
+
+        if (movie->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            MovieInput *inputs = realloc(movie->inputs, capacity * sizeof(MovieInput));
+
+            if (inputs == NULL) {
+                fprintf(stderr, "Could not allocate the movie\n");
+                movie_destroy(movie);
+                movie = NULL;
+                break;
+            }
+
+            movie->inputs = inputs;
+        }
+
+        movie->inputs[movie->count].frame = frame;
+        movie->inputs[movie->count].keys = keys;
+        movie->count++;
+    }
+
+    fclose(file);
+
+    return movie;
+}
+
+// called before running each frame, frame is the number of VBlanks so far
+// 1 and the value in keys if an input starts at or before frame and wasn't returned yet
+int movie_next(Movie *movie, uint64_t frame, uint16_t *keys) {
+    int changed = 0;
+
+    while (movie->next < movie->count && movie->inputs[movie->next].frame <= frame) {
+        *keys = movie->inputs[movie->next].keys;
+        movie->next++;
+        changed = 1;
+    }
+
+    return changed;
+}
+
+// frames up to and including the last input
+uint64_t movie_length(Movie *movie) {
+    return movie->count ? movie->inputs[movie->count - 1].frame + 1 : 0;
+}
+
+void movie_destroy(Movie *movie) {
+    if (movie == NULL) {
+        return;
+    }
+
+    free(movie->inputs);
+    free(movie);
+}
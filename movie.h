@@ -0,0 +1,39 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+#include <stdint.h>
+
+/*
+    Input movies: KEYINPUT values by frame, played back exactly.
+
+    A movie is a text file with one "<frame> <keyinput>" pair per line, the value in
+    hex and active low like the register (0x3FF is nothing pressed, 0x3F7 is START).
+    Frames go up, a value holds until the next line, lines starting with # are
+    comments:
+
+        # press start for 5 frames at 2 seconds
+        0 3ff
+        120 3f7
+        125 3ff
+
+    Frame n is the one that starts after the nth VBlank, so the value is in io for all
+    of it. Nothing in a run depends on the host clock, the same rom, movie and save
+    give the same state at every frame.
+*/
+
+typedef struct {
+    uint64_t frame;
+    uint16_t keys;
+} MovieInput;
+
+typedef struct {
+    MovieInput *inputs;
+    uint32_t count;
+    uint32_t next;                      // first input not applied yet
+} Movie;
+
+Movie *movie_load(const char *path);
+int movie_next(Movie *movie, uint64_t frame, uint16_t *keys);
+uint64_t movie_length(Movie *movie);
+void movie_destroy(Movie *movie);
+
+#endif
@@ -0,0 +1,845 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "setup.h"
+#include "ppu.h"
+#include "ppu_affine.h"
+
+/*
+    Scanline renderer.
+
+    Supports modes 0-5 (text and affine backgrounds, the three bitmap modes) and
+    regular/affine sprites with priorities.
+    Todo: windows, alpha blending/brightness and mosaic.
+
+    See ppu.h for how the ppu gets its copy of video memory. Everything below the log
+    functions only ever looks at that copy, so it doesn't matter which thread runs it.
+*/
+
+// line buffers hold final colors, anything with alpha set is opaque
+#define TRANSPARENT 0
+#define NO_SPRITE 4         // sprite priority of a pixel without a sprite
+
+static inline uint16_t io16(PPU *ppu, uint32_t offset) {
+    return *(uint16_t *)&ppu->io[offset];
+}
+
+static inline uint32_t bgr555_to_rgba(uint16_t color) {
+    uint32_t r = color & 0x1F;
+    uint32_t g = (color >> 5) & 0x1F;
+    uint32_t b = (color >> 10) & 0x1F;
+
+    // 5 to 8 bits, the top bits fill the bottom so 31 becomes 255
+    r = (r << 3) | (r >> 2);
+    g = (g << 3) | (g >> 2);
+    b = (b << 3) | (b >> 2);
+
+    return 0xFF000000 | (b << 16) | (g << 8) | r;
+}
+
+// Palette cache
+
+static inline uint32_t palette_color(PPU *ppu, uint32_t index) {
+    return ppu->palette_rgba[index];
+}
+
+// converts the entries covering palette[offset, offset + size)
+static void update_palette(PPU *ppu, uint32_t offset, uint32_t size) {
+    for (uint32_t index = offset / 2; index < (offset + size) / 2; index++) {
+        ppu->palette_rgba[index] = bgr555_to_rgba(*(uint16_t *)&ppu->palette[index * 2]);
+    }
+}
+
+// the reference points are 28 bit signed fixed point (8 fractional bits)
+static inline int32_t affine_reference(PPU *ppu, uint32_t offset) {
+    return (int32_t)(*(uint32_t *)&ppu->io[offset] << 4) >> 4;
+}
+
+/*
+    The internal reference points are reloaded from BGxX/BGxY at the start of a frame
+    and whenever those registers are written.
+*/
+static void reload_affine(PPU *ppu, int affine_bg) {
+    uint32_t base = affine_bg ? IO_BG3X : IO_BG2X;
+
+    ppu->affine_x[affine_bg] = affine_reference(ppu, base);
+    ppu->affine_y[affine_bg] = affine_reference(ppu, base + 4);
+}
+
+// Tile cache
+
+static const uint8_t empty_tile[2][8][8];
+
+static void mark_tiles_dirty(PPU *ppu, uint32_t offset, uint32_t size) {
+    uint32_t first = offset / 32;
+    uint32_t last = (offset + size - 1) / 32;
+
+    for (uint32_t unit = first; unit <= last; unit++) {
+        ppu->tile_dirty_4bpp[unit] = 1;
+        ppu->tile_dirty_8bpp[unit] = 1;
+
+        // the 256 color tile starting one unit earlier overlaps this one
+        if (unit > 0) {
+            ppu->tile_dirty_8bpp[unit - 1] = 1;
+        }
+    }
+}
+
+// returns [hflip][row][column] of color indices, 0 is transparent
+static const uint8_t (*tile_4bpp(PPU *ppu, uint32_t unit))[8][8] {
+    if (unit >= VRAM_TILES) {
+        return empty_tile;
+    }
+
+    if (ppu->tile_dirty_4bpp[unit]) {
+        const uint8_t *data = &ppu->vram[unit * 32];
+
+        for (int row = 0; row < 8; row++) {
+            for (int column = 0; column < 8; column++) {
+                // low nibble is the left pixel
+                uint8_t color_index = (data[row * 4 + column / 2] >> ((column & 1) * 4)) & 0xF;
+
+                ppu->tiles_4bpp[unit][0][row][column] = color_index;
+                ppu->tiles_4bpp[unit][1][row][7 - column] = color_index;
+            }
+        }
+
+        ppu->tile_dirty_4bpp[unit] = 0;
+    }
+
+    return ppu->tiles_4bpp[unit];
+}
+
+static const uint8_t (*tile_8bpp(PPU *ppu, uint32_t unit))[8][8] {
+    if (unit >= VRAM_TILES) {
+        return empty_tile;
+    }
+
+    if (ppu->tile_dirty_8bpp[unit]) {
+        for (int row = 0; row < 8; row++) {
+            for (int column = 0; column < 8; column++) {
+                // the last tile hangs off the end of vram, that half is transparent
+                uint32_t address = unit * 32 + row * 8 + column;
+                uint8_t color_index = (address < VRAM_SIZE) ? ppu->vram[address] : 0;
+
+                ppu->tiles_8bpp[unit][0][row][column] = color_index;
+                ppu->tiles_8bpp[unit][1][row][7 - column] = color_index;
+            }
+        }
+
+        ppu->tile_dirty_8bpp[unit] = 0;
+    }
+
+    return ppu->tiles_8bpp[unit];
+}
+
+// Log
+
+static void apply_write(PPU *ppu, uint32_t address, uint32_t value, uint8_t kind) {
+    uint32_t offset = address & 0xFFFFFF;
+    uint8_t *base;
+
+    switch (address >> 24) {
+        case 0x04:
+            base = ppu->io;
+            break;
+        case 0x05:
+            base = ppu->palette;
+            break;
+        case 0x06:
+            base = ppu->vram;
+            break;
+        default:
+            base = ppu->oam;
+            break;
+    }
+
+    if (kind == VIDEO_WRITE_32) {
+        *(uint32_t *)&base[offset] = value;
+    } else {
+        *(uint16_t *)&base[offset] = value;
+    }
+
+    if ((address >> 24) == 0x05) {
+        update_palette(ppu, offset, kind == VIDEO_WRITE_32 ? 4 : 2);
+    }
+
+    if ((address >> 24) == 0x06) {
+        mark_tiles_dirty(ppu, offset, kind == VIDEO_WRITE_32 ? 4 : 2);
+    }
+
+    // attribute 0 and 1 decide which lines a sprite is on, attribute 2 and the affine parameters don't
+    if ((address >> 24) == 0x07 && (offset & 0x7) < 4) {
+        ppu->sprite_lines_dirty = 1;
+    }
+
+    if ((address >> 24) == 0x04) {
+        if (offset >= IO_BG2X && offset < IO_BG2X + 8) {
+            reload_affine(ppu, 0);
+        } else if (offset >= IO_BG3X && offset < IO_BG3X + 8) {
+            reload_affine(ppu, 1);
+        }
+    }
+}
+
+static void clear_region(PPU *ppu, uint8_t region) {
+    switch (region) {
+        case 0x05:
+            memset(ppu->palette, 0, sizeof(ppu->palette));
+            update_palette(ppu, 0, PALETTE_SIZE);
+            break;
+        case 0x06:
+            memset(ppu->vram, 0, sizeof(ppu->vram));
+            mark_tiles_dirty(ppu, 0, VRAM_SIZE);
+            break;
+        case 0x07:
+            memset(ppu->oam, 0, sizeof(ppu->oam));
+            ppu->sprite_lines_dirty = 1;
+            break;
+    }
+}
+
+static void render_line(PPU *ppu, uint16_t line);
+
+// applies everything in the log, returns 0 once it reaches VIDEO_QUIT
+static int drain_log(PPU *ppu) {
+    uint32_t tail = atomic_load_explicit(&ppu->log_tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ppu->log_head, memory_order_acquire);
+
+    while (tail != head) {
+        VideoLogEntry *entry = &ppu->log[tail & (VIDEO_LOG_SIZE - 1)];
+
+        switch (entry->kind) {
+            case VIDEO_WRITE_16:
+            case VIDEO_WRITE_32:
+                apply_write(ppu, entry->address, entry->value, entry->kind);
+                break;
+            case VIDEO_CLEAR:
+                clear_region(ppu, entry->value);
+                break;
+            case VIDEO_LINE:
+                render_line(ppu, entry->value);
+                break;
+            case VIDEO_QUIT:
+                atomic_store_explicit(&ppu->log_tail, tail + 1, memory_order_release);
+                return 0;
+        }
+
+        tail++;
+
+        // give the space back in batches, the producer only looks at it when the log is full
+        if ((tail & 0xFF) == 0) {
+            atomic_store_explicit(&ppu->log_tail, tail, memory_order_release);
+        }
+
+        if (tail == head) {
+            head = atomic_load_explicit(&ppu->log_head, memory_order_acquire);
+        }
+    }
+
+    atomic_store_explicit(&ppu->log_tail, tail, memory_order_release);
+    return 1;
+}
+
+static void log_push(PPU *ppu, uint32_t address, uint32_t value, uint8_t kind) {
+    uint32_t head = atomic_load_explicit(&ppu->log_head, memory_order_relaxed);
+
+    while (head - atomic_load_explicit(&ppu->log_tail, memory_order_acquire) == VIDEO_LOG_SIZE) {
+        if (!ppu->threaded) {
+            // a lot of writes within one line, no line entry in there so just apply them
+            drain_log(ppu);
+        } else {
+            sched_yield();
+        }
+    }
+
+    VideoLogEntry *entry = &ppu->log[head & (VIDEO_LOG_SIZE - 1)];
+    entry->address = address;
+    entry->value = value;
+    entry->kind = kind;
+
+    atomic_store_explicit(&ppu->log_head, head + 1, memory_order_release);
+}
+
+static void *ppu_thread(void *argument) {
+    PPU *ppu = argument;
+    uint32_t idle = 0;
+
+    for (;;) {
+        uint32_t tail = atomic_load_explicit(&ppu->log_tail, memory_order_relaxed);
+
+        if (tail == atomic_load_explicit(&ppu->log_head, memory_order_acquire)) {
+            // nothing to do, spin for a bit before sleeping
+            if (++idle < 1024) {
+                sched_yield();
+            } else {
+                struct timespec pause = {0, 50000};
+                nanosleep(&pause, NULL);
+            }
+            continue;
+        }
+
+        idle = 0;
+
+        if (!drain_log(ppu)) {
+            return NULL;
+        }
+    }
+}
+
+// address is a cpu address, size is 2 or 4
+void ppu_log_write(PPU *ppu, uint32_t address, uint32_t value, uint8_t size) {
+    uint8_t region = address >> 24;
+    uint32_t offset;
+
+    if (ppu->skipping) {
+        return;
+    }
+
+    if (region == 0x06) {
+        // 0x06018000-0x0601FFFF mirrors 0x06010000-0x06017FFF
+        offset = address & 0x1FFFF;
+
+        if (offset >= VRAM_SIZE) {
+            offset -= 0x8000;
+        }
+    } else {
+        offset = address & 0x3FF;
+    }
+
+    log_push(ppu, (region << 24) | offset, value, size == 4 ? VIDEO_WRITE_32 : VIDEO_WRITE_16);
+}
+
+void ppu_log_clear(PPU *ppu, uint8_t region) {
+    if (!ppu->skipping) {
+        log_push(ppu, 0, region, VIDEO_CLEAR);
+    }
+}
+
+// takes a fresh copy of video memory, the log has to be empty
+static void copy_video_memory(PPU *ppu, Memory *memory) {
+    memcpy(ppu->io, memory->io, IO_DISPLAY_SIZE);
+    memcpy(ppu->palette, memory->bg_obj_palette_ram, PALETTE_SIZE);
+    memcpy(ppu->vram, memory->vram, VRAM_SIZE);
+    memcpy(ppu->oam, memory->obj_attributes, OAM_SIZE);
+    update_palette(ppu, 0, PALETTE_SIZE);
+    mark_tiles_dirty(ppu, 0, VRAM_SIZE);
+    ppu->sprite_lines_dirty = 1;
+}
+
+/*
+    Takes the copy of video memory from memory again, after skipped frames or when
+    memory was changed behind the ppu's back (a loaded state). Waits for the ppu
+    thread to be done with the old copy first, the writes left in the log are older
+    than the new copy anyway.
+*/
+void ppu_resync(PPU *ppu) {
+    if (!ppu->threaded) {
+        drain_log(ppu);
+    }
+
+    while (atomic_load_explicit(&ppu->log_tail, memory_order_acquire) != atomic_load_explicit(&ppu->log_head, memory_order_relaxed)) {
+        sched_yield();
+    }
+
+    copy_video_memory(ppu, ppu->memory);
+}
+
+// called at the HBlank of every visible line
+void ppu_scanline(PPU *ppu, uint16_t line) {
+    if (line == 0) {
+        uint8_t skip = ppu->render_interval == 0 || ppu->frames_seen % ppu->render_interval != 0;
+
+        if (ppu->skipping && !skip) {
+            ppu_resync(ppu);
+        }
+
+        ppu->skipping = skip;
+    }
+
+    if (line == SCREEN_HEIGHT - 1) {
+        ppu->frames_seen++;
+    }
+
+    if (ppu->skipping) {
+        return;
+    }
+
+    log_push(ppu, 0, line, VIDEO_LINE);
+
+    if (line == SCREEN_HEIGHT - 1) {
+        ppu->frames_queued++;
+    }
+
+    if (!ppu->threaded) {
+        drain_log(ppu);
+    }
+}
+
+/*
+    Last complete frame. With the ppu on its own thread this waits until it has caught
+    up with the cpu. The buffer stays valid until the cpu runs another frame.
+*/
+const uint32_t *ppu_frame(PPU *ppu) {
+    while (atomic_load_explicit(&ppu->frames_rendered, memory_order_acquire) != ppu->frames_queued) {
+        sched_yield();
+    }
+
+    return ppu->framebuffers[ppu->front];
+}
+
+/*
+    The frame after number once it is complete, NULL if the ppu isn't done with it yet.
+    Only waits while the ppu is more than a frame behind, the cpu and ppu keep running
+    side by side. number is set to the frame returned. Frames before the one before the
+    last queued one may have been rendered over, a caller further behind gets that one.
+    The buffer stays valid until the cpu runs another frame like ppu_frame.
+*/
+const uint32_t *ppu_frame_after(PPU *ppu, uint64_t *number) {
+    uint64_t rendered;
+
+    while ((rendered = atomic_load_explicit(&ppu->frames_rendered, memory_order_acquire)) + 1 < ppu->frames_queued) {
+        sched_yield();
+    }
+
+    uint64_t next = *number + 1;
+
+    if (next + 1 < ppu->frames_queued) {
+        next = ppu->frames_queued - 1;
+    }
+
+    if (next > rendered) {
+        return NULL;
+    }
+
+    // front flips once per frame, frame n went to framebuffers[n & 1]
+    *number = next;
+    return ppu->framebuffers[next & 1];
+}
+
+void ppu_set_frameskip(PPU *ppu, uint32_t render_interval) {
+    ppu->render_interval = render_interval;
+}
+
+PPU *ppu_create(Memory *memory, int threaded) {
+    PPU *ppu = aligned_alloc(64, sizeof(PPU));
+
+    if (ppu == NULL) {
+        fprintf(stderr, "Could not allocate the ppu\n");
+        return NULL;
+    }
+
+    memset(ppu, 0, sizeof(PPU));
+    affine_select();
+
+    // the log only carries changes, start from what's in memory now
+    copy_video_memory(ppu, memory);
+    ppu->memory = memory;
+    ppu->render_interval = 1;
+
+    atomic_init(&ppu->log_head, 0);
+    atomic_init(&ppu->log_tail, 0);
+    atomic_init(&ppu->frames_rendered, 0);
+
+    ppu->threaded = threaded;
+
+    if (threaded && pthread_create(&ppu->thread, NULL, ppu_thread, ppu) != 0) {
+        fprintf(stderr, "Could not start the ppu thread, rendering inline\n");
+        ppu->threaded = 0;
+    }
+
+    return ppu;
+}
+
+void ppu_destroy(PPU *ppu) {
+    if (ppu->threaded) {
+        log_push(ppu, 0, 0, VIDEO_QUIT);
+        pthread_join(ppu->thread, NULL);
+    }
+
+    free(ppu);
+}
+
+// Backgrounds
+
+static void render_text_background(PPU *ppu, int bg, uint16_t line, uint32_t *out) {
+    uint16_t control = io16(ppu, IO_BG0CNT + bg * 2);
+    uint32_t char_base = ((control >> 2) & 0x3) * 0x4000;
+    uint32_t screen_base = ((control >> 8) & 0x1F) * 0x800;
+    uint8_t color_256 = (control >> 7) & 0x1;
+    uint32_t width = (control & 0x4000) ? 512 : 256;
+    uint32_t height = (control & 0x8000) ? 512 : 256;
+    uint32_t hofs = io16(ppu, IO_BG0HOFS + bg * 4) & 0x1FF;
+    uint32_t vofs = io16(ppu, IO_BG0HOFS + bg * 4 + 2) & 0x1FF;
+    uint32_t y = (line + vofs) & (height - 1);
+    uint32_t x = 0;
+
+    // one tile at a time, the first and last ones can be partly off screen
+    while (x < SCREEN_WIDTH) {
+        uint32_t px = (x + hofs) & (width - 1);
+
+        // the map is made of 32x32 tile screen blocks, left to right then top to bottom
+        uint32_t block = (px >> 8) + (y >> 8) * (width >> 8);
+        uint32_t entry_address = screen_base + block * 0x800 + ((y & 0xFF) >> 3) * 64 + ((px & 0xFF) >> 3) * 2;
+        uint16_t entry = *(uint16_t *)&ppu->vram[entry_address & 0xFFFF];
+
+        uint32_t tile = entry & 0x3FF;
+        uint32_t ty = (entry & 0x800) ? 7 - (y & 7) : y & 7;
+        uint32_t tile_address = char_base + tile * (color_256 ? 64 : 32);
+        const uint32_t *colors = &ppu->palette_rgba[color_256 ? 0 : (entry >> 12) * 16];
+        const uint8_t *row;
+
+        // backgrounds can't use the sprite half of vram
+        if (tile_address >= 0x10000) {
+            row = empty_tile[0][0];
+        } else if (color_256) {
+            row = tile_8bpp(ppu, tile_address / 32)[(entry >> 10) & 0x1][ty];
+        } else {
+            row = tile_4bpp(ppu, tile_address / 32)[(entry >> 10) & 0x1][ty];
+        }
+
+        for (uint32_t column = px & 7; column < 8 && x < SCREEN_WIDTH; column++, x++) {
+            uint8_t color_index = row[column];
+            out[x] = color_index ? colors[color_index] : TRANSPARENT;
+        }
+    }
+}
+
+static void render_affine_background(PPU *ppu, int bg, uint32_t *out) {
+    uint16_t control = io16(ppu, IO_BG0CNT + bg * 2);
+    uint32_t registers = (bg == 2) ? IO_BG2PA : IO_BG3PA;
+    AffineBackground affine = {
+        .x = ppu->affine_x[bg - 2],
+        .y = ppu->affine_y[bg - 2],
+        .pa = io16(ppu, registers),
+        .pc = io16(ppu, registers + 4),
+        .size = 128 << (control >> 14),
+        .char_base = ((control >> 2) & 0x3) * 0x4000,
+        .screen_base = ((control >> 8) & 0x1F) * 0x800,
+        .wraparound = (control >> 13) & 0x1
+    };
+
+    affine_background_line(ppu, &affine, out);
+}
+
+// Todo: bitmap modes ignore the BG2 rotation/scaling parameters
+static void render_bitmap_background(PPU *ppu, uint8_t mode, uint16_t line, uint32_t *out) {
+    uint32_t frame = (io16(ppu, IO_DISPCNT) & 0x10) ? 0xA000 : 0;
+
+    for (uint32_t x = 0; x < SCREEN_WIDTH; x++) {
+        switch (mode) {
+            case 3:
+                out[x] = bgr555_to_rgba(*(uint16_t *)&ppu->vram[(line * SCREEN_WIDTH + x) * 2]);
+                break;
+            case 4: {
+                uint8_t color_index = ppu->vram[frame + line * SCREEN_WIDTH + x];
+                out[x] = color_index ? palette_color(ppu, color_index) : TRANSPARENT;
+                break;
+            }
+            default:
+                // 160x128
+                if (x < 160 && line < 128) {
+                    out[x] = bgr555_to_rgba(*(uint16_t *)&ppu->vram[frame + (line * 160 + x) * 2]);
+                } else {
+                    out[x] = TRANSPARENT;
+                }
+                break;
+        }
+    }
+}
+
+// Sprites
+
+// [shape][size] = {width, height}
+static const uint8_t sprite_sizes[3][4][2] = {
+    {{8, 8}, {16, 16}, {32, 32}, {64, 64}},     // square
+    {{16, 8}, {32, 8}, {32, 16}, {64, 32}},     // horizontal
+    {{8, 16}, {8, 32}, {16, 32}, {32, 64}}      // vertical
+};
+
+/*
+    Rebuilds the list of sprites on each line from attribute 0 and 1 (position, size,
+    shape and the affine/double size/hidden bits). Affine sprites take their whole
+    bounding box. Only runs on the first line rendered after one of those changed.
+*/
+static void build_sprite_lines(PPU *ppu) {
+    uint16_t *oam = (uint16_t *)ppu->oam;
+
+    memset(ppu->sprite_line_count, 0, sizeof(ppu->sprite_line_count));
+
+    for (int i = 0; i < 128; i++) {
+        uint16_t attr0 = oam[i * 4];
+        uint16_t attr1 = oam[i * 4 + 1];
+        uint8_t affine = (attr0 >> 8) & 0x1;
+        uint8_t shape = attr0 >> 14;
+        uint8_t mode = (attr0 >> 10) & 0x3;
+
+        // bit 9 hides a regular sprite, mode 2 is the obj window (Todo)
+        if ((!affine && (attr0 & 0x200)) || shape == 3 || mode >= 2) {
+            continue;
+        }
+
+        uint8_t double_size = affine && (attr0 & 0x200);
+        int32_t box_width = sprite_sizes[shape][attr1 >> 14][0] << double_size;
+        int32_t box_height = sprite_sizes[shape][attr1 >> 14][1] << double_size;
+        int32_t y = attr0 & 0xFF;
+        int32_t x = attr1 & 0x1FF;
+
+        if (y >= SCREEN_HEIGHT) {
+            y -= 256;
+        }
+
+        if (x >= SCREEN_WIDTH) {
+            x -= 512;
+        }
+
+        // completely off the left edge
+        if (x + box_width <= 0) {
+            continue;
+        }
+
+        int32_t first = y < 0 ? 0 : y;
+        int32_t last = y + box_height < SCREEN_HEIGHT ? y + box_height : SCREEN_HEIGHT;
+
+        for (int32_t line = first; line < last; line++) {
+            ppu->sprite_lines[line][ppu->sprite_line_count[line]++] = i;
+        }
+    }
+
+    ppu->sprite_lines_dirty = 0;
+}
+
+/*
+    Draws every sprite on the line into out/priority. Between sprites the lowest
+    priority value wins and then the lowest OAM index.
+*/
+static void render_sprites(PPU *ppu, uint16_t line, uint32_t *out, uint8_t *priority) {
+    uint16_t dispcnt = io16(ppu, IO_DISPCNT);
+    uint8_t mapping_1d = (dispcnt >> 6) & 0x1;
+    uint8_t bitmap_mode = (dispcnt & 0x7) >= 3;
+    uint16_t *oam = (uint16_t *)ppu->oam;
+
+    for (uint32_t x = 0; x < SCREEN_WIDTH; x++) {
+        out[x] = TRANSPARENT;
+        priority[x] = NO_SPRITE;
+    }
+
+    if (ppu->sprite_lines_dirty) {
+        build_sprite_lines(ppu);
+    }
+
+    // the lists are in OAM order
+    for (int n = 0; n < ppu->sprite_line_count[line]; n++) {
+        int i = ppu->sprite_lines[line][n];
+        uint16_t attr0 = oam[i * 4];
+        uint16_t attr1 = oam[i * 4 + 1];
+        uint16_t attr2 = oam[i * 4 + 2];
+        uint8_t affine = (attr0 >> 8) & 0x1;
+        uint8_t shape = attr0 >> 14;
+
+        int32_t width = sprite_sizes[shape][attr1 >> 14][0];
+        int32_t height = sprite_sizes[shape][attr1 >> 14][1];
+
+        // double size affine sprites get twice the area to draw in
+        int32_t box_width = (affine && (attr0 & 0x200)) ? width * 2 : width;
+        int32_t box_height = (affine && (attr0 & 0x200)) ? height * 2 : height;
+
+        int32_t y = attr0 & 0xFF;
+        int32_t x = attr1 & 0x1FF;
+
+        if (y >= SCREEN_HEIGHT) {
+            y -= 256;
+        }
+
+        if (x >= SCREEN_WIDTH) {
+            x -= 512;
+        }
+
+        int32_t dy = line - y;
+        uint32_t tile = attr2 & 0x3FF;
+        uint8_t sprite_priority = (attr2 >> 10) & 0x3;
+        uint8_t color_256 = (attr0 >> 13) & 0x1;
+
+        // the bitmap modes use the lower half of sprite vram
+        if (bitmap_mode && tile < 512) {
+            continue;
+        }
+
+        int16_t pa = 0x100, pb = 0, pc = 0, pd = 0x100;
+
+        if (affine) {
+            uint32_t group = ((attr1 >> 9) & 0x1F) * 16;
+            pa = oam[group + 3];
+            pb = oam[group + 7];
+            pc = oam[group + 11];
+            pd = oam[group + 15];
+        }
+
+        // only the part of the box that is on screen
+        int32_t first = x < 0 ? -x : 0;
+        int32_t last = x + box_width > SCREEN_WIDTH ? SCREEN_WIDTH - x : box_width;
+
+        // color index of every column from first to last, 0 is transparent
+        uint8_t texels[128 + 8];
+
+        if (affine) {
+            // rotate around the center of the box
+            int32_t cx = first - box_width / 2;
+            int32_t cy = dy - box_height / 2;
+            AffineSprite sprite = {
+                .x = pa * cx + pb * cy + (width / 2 << 8),
+                .y = pc * cx + pd * cy + (height / 2 << 8),
+                .pa = pa,
+                .pc = pc,
+                .width = width,
+                .height = height,
+                .tile = tile,
+                .color_256 = color_256,
+                .row_shift = mapping_1d ? __builtin_ctz(width >> 3) + color_256 : 5
+            };
+
+            affine_sprite_span(ppu, &sprite, last - first, texels);
+        } else {
+            uint8_t hflip = (attr1 >> 12) & 0x1;
+            uint32_t ty = (attr1 & 0x2000) ? height - 1 - dy : dy;
+            uint32_t tile_y = ty >> 3;
+
+            for (int32_t sx = first; sx < last; sx++) {
+                // the flipped tile variant takes care of the pixel inside the tile
+                uint32_t tx = hflip ? width - 1 - sx : sx;
+                uint32_t tile_x = tx >> 3;
+                uint32_t column = hflip ? 7 - (tx & 7) : tx & 7;
+
+                // tile numbers count 32 byte units, 256 color tiles take two
+                if (color_256) {
+                    uint32_t unit = tile + (mapping_1d ? tile_y * (width >> 3) * 2 : tile_y * 32) + tile_x * 2;
+                    texels[sx - first] = tile_8bpp(ppu, 0x800 + (unit & 0x3FF))[hflip][ty & 7][column];
+                } else {
+                    uint32_t unit = tile + (mapping_1d ? tile_y * (width >> 3) : tile_y * 32) + tile_x;
+                    texels[sx - first] = tile_4bpp(ppu, 0x800 + (unit & 0x3FF))[hflip][ty & 7][column];
+                }
+            }
+        }
+
+        // sprite colors are the second half of the palette
+        const uint32_t *colors = &ppu->palette_rgba[256 + (color_256 ? 0 : (attr2 >> 12) * 16)];
+
+        for (int32_t sx = first; sx < last; sx++) {
+            int32_t screen_x = x + sx;
+            uint8_t color_index = texels[sx - first];
+
+            if (color_index && sprite_priority < priority[screen_x]) {
+                out[screen_x] = colors[color_index];
+                priority[screen_x] = sprite_priority;
+            }
+        }
+    }
+}
+
+// Composition
+
+static void render_line(PPU *ppu, uint16_t line) {
+    uint32_t *out = &ppu->framebuffers[ppu->front ^ 1][line * SCREEN_WIDTH];
+    uint16_t dispcnt = io16(ppu, IO_DISPCNT);
+    uint8_t mode = dispcnt & 0x7;
+
+    if (line == 0) {
+        reload_affine(ppu, 0);
+        reload_affine(ppu, 1);
+    }
+
+    // which backgrounds exist in each mode
+    static const uint8_t mode_backgrounds[8] = {0xF, 0x7, 0xC, 0x4, 0x4, 0x4, 0, 0};
+
+    uint32_t layers[4][SCREEN_WIDTH];
+    uint32_t sprites[SCREEN_WIDTH];
+    uint8_t sprite_priority[SCREEN_WIDTH];
+    uint8_t order[4];
+    uint8_t bg_priority[4];
+    uint8_t count = 0;
+
+    // forced blank shows white
+    if (dispcnt & 0x80) {
+        for (uint32_t x = 0; x < SCREEN_WIDTH; x++) {
+            out[x] = 0xFFFFFFFF;
+        }
+    } else {
+        uint8_t enabled = (dispcnt >> 8) & mode_backgrounds[mode];
+
+        for (uint8_t bg = 0; bg < 4; bg++) {
+            bg_priority[bg] = io16(ppu, IO_BG0CNT + bg * 2) & 0x3;
+        }
+
+        // backgrounds sorted by priority, lower number first when equal
+        for (uint8_t priority = 0; priority < 4; priority++) {
+            for (uint8_t bg = 0; bg < 4; bg++) {
+                if (((enabled >> bg) & 0x1) && bg_priority[bg] == priority) {
+                    order[count++] = bg;
+                }
+            }
+        }
+
+        for (uint8_t i = 0; i < count; i++) {
+            uint8_t bg = order[i];
+
+            if (mode >= 3) {
+                render_bitmap_background(ppu, mode, line, layers[bg]);
+            } else if (bg >= 2 && mode >= 1) {
+                render_affine_background(ppu, bg, layers[bg]);
+            } else {
+                render_text_background(ppu, bg, line, layers[bg]);
+            }
+        }
+
+        if (dispcnt & 0x1000) {
+            render_sprites(ppu, line, sprites, sprite_priority);
+        } else {
+            memset(sprite_priority, NO_SPRITE, sizeof(sprite_priority));
+        }
+
+        uint32_t backdrop = palette_color(ppu, 0);
+
+        for (uint32_t x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t color = backdrop;
+            uint8_t found = 0;
+
+            // a sprite goes on top of backgrounds with the same or a higher priority number
+            for (uint8_t i = 0; i < count; i++) {
+                uint8_t bg = order[i];
+
+                if (sprite_priority[x] <= bg_priority[bg]) {
+                    color = sprites[x];
+                    found = 1;
+                    break;
+                }
+
+                if (layers[bg][x] != TRANSPARENT) {
+                    color = layers[bg][x];
+                    found = 1;
+                    break;
+                }
+            }
+
+            if (!found && sprite_priority[x] != NO_SPRITE) {
+                color = sprites[x];
+            }
+
+            out[x] = color;
+        }
+    }
+
+    // the reference points move by (PB, PD) every line
+    for (int i = 0; i < 2; i++) {
+        uint32_t registers = i ? IO_BG3PA : IO_BG2PA;
+        ppu->affine_x[i] += (int16_t)io16(ppu, registers + 2);
+        ppu->affine_y[i] += (int16_t)io16(ppu, registers + 6);
+    }
+
+    if (line == SCREEN_HEIGHT - 1) {
+        ppu->front ^= 1;
+        atomic_fetch_add_explicit(&ppu->frames_rendered, 1, memory_order_release);
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef PPU_H
+#define PPU_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "setup.h"
+
+#define SCREEN_WIDTH 240
+#define SCREEN_HEIGHT 160
+
+// display registers the ppu cares about (0x04000000-0x0400005F)
+#define IO_DISPLAY_SIZE 0x60
+#define IO_BG0CNT 0x008
+#define IO_BG0HOFS 0x010
+#define IO_BG2PA 0x020
+#define IO_BG2X 0x028
+#define IO_BG2Y 0x02C
+#define IO_BG3PA 0x030
+#define IO_BG3X 0x038
+#define IO_BG3Y 0x03C
+
+/*
+    Everything the ppu needs to know comes through the video log: every store to the
+    display registers, palette, vram or oam is appended to it by the cpu thread, and
+    at the HBlank of every visible line a line entry follows. The ppu applies the writes
+    to its own copy of video memory and renders the line when it gets to the line entry,
+    so it always sees memory exactly as it was at that HBlank no matter how far behind
+    it runs. Rendering inline uses the same log, it is just drained right away.
+*/
+#define VIDEO_LOG_SIZE (1 << 16)    // entries, power of 2
+
+#define VRAM_TILES (VRAM_SIZE / 32)
+
+enum VIDEO_LOG_KIND {
+    VIDEO_WRITE_16 = 0,
+    VIDEO_WRITE_32,
+    VIDEO_CLEAR,                    // RegisterRamReset of a whole region
+    VIDEO_LINE,                     // render a line, value is the line
+    VIDEO_QUIT
+};
+
+typedef struct {
+    uint32_t address;               // 0x04/0x05/0x06/0x07 region in the top byte, unmirrored offset below
+    uint32_t value;
+    uint8_t kind;
+} VideoLogEntry;
+
+typedef struct PPU {
+    // copy of video memory as of the line being rendered
+    uint8_t io[IO_DISPLAY_SIZE];
+    uint8_t palette[PALETTE_SIZE];
+    uint8_t vram[VRAM_SIZE];
+    uint8_t oam[OAM_SIZE];
+
+    // the palette converted to 0xAABBGGRR, kept up to date on every palette write
+    uint32_t palette_rgba[PALETTE_SIZE / 2];
+
+    /*
+        Tile cache: tiles expanded to one byte per pixel, plain and horizontally flipped,
+        indexed by 32 byte unit of vram. A 256 color tile at unit n also covers n + 1.
+        Tiles are expanded again the first time they are used after a vram write.
+    */
+    uint8_t tiles_4bpp[VRAM_TILES][2][8][8];        // [unit][hflip][row][column]
+    uint8_t tiles_8bpp[VRAM_TILES][2][8][8];
+    uint8_t tile_dirty_4bpp[VRAM_TILES];
+    uint8_t tile_dirty_8bpp[VRAM_TILES];
+
+    // OAM indices of the sprites on each line in OAM order, rebuilt after attribute 0/1 writes
+    uint8_t sprite_lines[SCREEN_HEIGHT][128];
+    uint8_t sprite_line_count[SCREEN_HEIGHT];
+    uint8_t sprite_lines_dirty;
+
+    // affine backgrounds step their reference point every line (BG2 and BG3)
+    int32_t affine_x[2];
+    int32_t affine_y[2];
+
+    // 0xAABBGGRR, frame is the last complete one, back is being rendered
+    uint32_t framebuffers[2][SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint8_t front;
+
+    uint8_t threaded;
+    pthread_t thread;
+
+    /*
+        Frame skipping, only touched by the cpu thread. A skipped frame pushes no line
+        entries and its writes are dropped, the copy of video memory is taken again
+        from memory before the next frame that is rendered.
+    */
+    Memory *memory;
+    uint32_t render_interval;       // render 1 frame in this many, 0 renders nothing
+    uint64_t frames_seen;
+    uint8_t skipping;
+
+    // single producer (cpu thread), single consumer (ppu thread)
+    VideoLogEntry log[VIDEO_LOG_SIZE];
+    _Alignas(64) _Atomic uint32_t log_head;     // written by the producer
+    _Alignas(64) _Atomic uint32_t log_tail;     // written by the consumer
+    _Alignas(64) _Atomic uint64_t frames_rendered;
+    uint64_t frames_queued;
+} PPU;
+
+PPU *ppu_create(Memory *memory, int threaded);
+void ppu_destroy(PPU *ppu);
+void ppu_log_write(PPU *ppu, uint32_t address, uint32_t value, uint8_t size);
+void ppu_log_clear(PPU *ppu, uint8_t region);
+void ppu_scanline(PPU *ppu, uint16_t line);
+void ppu_set_frameskip(PPU *ppu, uint32_t render_interval);
+void ppu_resync(PPU *ppu);
+const uint32_t *ppu_frame(PPU *ppu);
+const uint32_t *ppu_frame_after(PPU *ppu, uint64_t *number);
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdint.h>
+#include "setup.h"
+#include "ppu.h"
+#include "ppu_affine.h"
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#define AFFINE_X86
+#include <immintrin.h>
+#endif
+
+AffineBackgroundLine affine_background_line = affine_background_line_scalar;
+AffineSpriteSpan affine_sprite_span = affine_sprite_span_scalar;
+
+// Reference
+
+void affine_background_line_scalar(const PPU *ppu, const AffineBackground *bg, uint32_t *out) {
+    int32_t x = bg->x;
+    int32_t y = bg->y;
+
+    for (uint32_t i = 0; i < SCREEN_WIDTH; i++, x += bg->pa, y += bg->pc) {
+        int32_t tx = x >> 8;
+        int32_t ty = y >> 8;
+
+        if (bg->wraparound) {
+            tx &= bg->size - 1;
+            ty &= bg->size - 1;
+        } else if (tx < 0 || ty < 0 || tx >= bg->size || ty >= bg->size) {
+            out[i] = 0;
+            continue;
+        }
+
+        // one byte per map entry, tiles are always 256 colors
+        uint32_t tile = ppu->vram[(bg->screen_base + (ty >> 3) * (bg->size >> 3) + (tx >> 3)) & 0xFFFF];
+        uint32_t address = bg->char_base + tile * 64 + (ty & 7) * 8 + (tx & 7);
+
+        // backgrounds can't use the sprite half of vram
+        uint32_t color_index = (address < 0x10000) ? ppu->vram[address] : 0;
+
+        out[i] = color_index ? ppu->palette_rgba[color_index] : 0;
+    }
+}
+
+void affine_sprite_span_scalar(const PPU *ppu, const AffineSprite *sprite, uint32_t count, uint8_t *out) {
+    int32_t x = sprite->x;
+    int32_t y = sprite->y;
+
+    for (uint32_t i = 0; i < count; i++, x += sprite->pa, y += sprite->pc) {
+        int32_t tx = x >> 8;
+        int32_t ty = y >> 8;
+
+        if (tx < 0 || ty < 0 || tx >= sprite->width || ty >= sprite->height) {
+            out[i] = 0;
+            continue;
+        }
+
+        // tile numbers count 32 byte units, 256 color tiles take two
+        uint32_t unit = sprite->tile + ((ty >> 3) << sprite->row_shift) + ((tx >> 3) << sprite->color_256);
+        uint32_t address = 0x10000 + (unit & 0x3FF) * 32 + ((ty & 7) << (2 + sprite->color_256)) + ((tx & 7) >> (1 - sprite->color_256));
+
+        // the last 256 color tile hangs off the end of vram
+        if (address >= VRAM_SIZE) {
+            out[i] = 0;
+        } else if (sprite->color_256) {
+            out[i] = ppu->vram[address];
+        } else {
+            out[i] = (ppu->vram[address] >> ((tx & 1) * 4)) & 0xF;
+        }
+    }
+}
+
+#ifdef AFFINE_X86
+
+// SSE2: no gathers, so the vectors only do the coordinates and the loads are done per lane
+
+__attribute__((target("sse2")))
+static void affine_background_line_sse2(const PPU *ppu, const AffineBackground *bg, uint32_t *out) {
+    __m128i x = _mm_setr_epi32(bg->x, bg->x + bg->pa, bg->x + bg->pa * 2, bg->x + bg->pa * 3);
+    __m128i y = _mm_setr_epi32(bg->y, bg->y + bg->pc, bg->y + bg->pc * 2, bg->y + bg->pc * 3);
+    __m128i step_x = _mm_set1_epi32(bg->pa * 4);
+    __m128i step_y = _mm_set1_epi32(bg->pc * 4);
+    __m128i size_mask = _mm_set1_epi32(bg->size - 1);
+    __m128i outside_mask = _mm_set1_epi32(~(bg->size - 1));
+    __m128i seven = _mm_set1_epi32(7);
+    __m128i map_shift = _mm_cvtsi32_si128(__builtin_ctz(bg->size) - 3);
+    __m128i screen_base = _mm_set1_epi32(bg->screen_base);
+    __m128i map_mask = _mm_set1_epi32(0xFFFF);
+    uint32_t map[4], texel[4], inside[4];
+
+    for (uint32_t i = 0; i < SCREEN_WIDTH; i += 4) {
+        __m128i tx = _mm_srai_epi32(x, 8);
+        __m128i ty = _mm_srai_epi32(y, 8);
+
+        // size is a power of 2, so a coordinate is inside if no bits above size - 1 are set
+        __m128i in = _mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(tx, ty), outside_mask), _mm_setzero_si128());
+
+        if (bg->wraparound) {
+            in = _mm_set1_epi32(-1);
+        }
+
+        tx = _mm_and_si128(tx, size_mask);
+        ty = _mm_and_si128(ty, size_mask);
+
+        __m128i map_address = _mm_add_epi32(screen_base, _mm_add_epi32(_mm_sll_epi32(_mm_srli_epi32(ty, 3), map_shift), _mm_srli_epi32(tx, 3)));
+        __m128i row = _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(ty, seven), 3), _mm_and_si128(tx, seven));
+
+        _mm_storeu_si128((__m128i *)map, _mm_and_si128(map_address, map_mask));
+        _mm_storeu_si128((__m128i *)texel, _mm_add_epi32(_mm_set1_epi32(bg->char_base), row));
+        _mm_storeu_si128((__m128i *)inside, in);
+
+        for (int lane = 0; lane < 4; lane++) {
+            uint32_t address = texel[lane] + ppu->vram[map[lane]] * 64;
+            uint32_t color_index = (inside[lane] && address < 0x10000) ? ppu->vram[address] : 0;
+
+            out[i + lane] = color_index ? ppu->palette_rgba[color_index] : 0;
+        }
+
+        x = _mm_add_epi32(x, step_x);
+        y = _mm_add_epi32(y, step_y);
+    }
+}
+
+__attribute__((target("sse2")))
+static void affine_sprite_span_sse2(const PPU *ppu, const AffineSprite *sprite, uint32_t count, uint8_t *out) {
+    __m128i x = _mm_setr_epi32(sprite->x, sprite->x + sprite->pa, sprite->x + sprite->pa * 2, sprite->x + sprite->pa * 3);
+    __m128i y = _mm_setr_epi32(sprite->y, sprite->y + sprite->pc, sprite->y + sprite->pc * 2, sprite->y + sprite->pc * 3);
+    __m128i step_x = _mm_set1_epi32(sprite->pa * 4);
+    __m128i step_y = _mm_set1_epi32(sprite->pc * 4);
+    __m128i outside_x = _mm_set1_epi32(~(sprite->width - 1));
+    __m128i outside_y = _mm_set1_epi32(~(sprite->height - 1));
+    __m128i seven = _mm_set1_epi32(7);
+    __m128i row_shift = _mm_cvtsi32_si128(sprite->row_shift);
+    __m128i tile_shift = _mm_cvtsi32_si128(sprite->color_256);
+    __m128i pixel_row_shift = _mm_cvtsi32_si128(2 + sprite->color_256);
+    __m128i pixel_shift = _mm_cvtsi32_si128(1 - sprite->color_256);
+    uint32_t texel[4], inside[4], column[4];
+
+    for (uint32_t i = 0; i < count; i += 4) {
+        __m128i tx = _mm_srai_epi32(x, 8);
+        __m128i ty = _mm_srai_epi32(y, 8);
+        __m128i in = _mm_cmpeq_epi32(_mm_or_si128(_mm_and_si128(tx, outside_x), _mm_and_si128(ty, outside_y)), _mm_setzero_si128());
+
+        tx = _mm_andnot_si128(outside_x, tx);
+        ty = _mm_andnot_si128(outside_y, ty);
+
+        __m128i unit = _mm_add_epi32(_mm_set1_epi32(sprite->tile), _mm_add_epi32(_mm_sll_epi32(_mm_srli_epi32(ty, 3), row_shift), _mm_sll_epi32(_mm_srli_epi32(tx, 3), tile_shift)));
+        __m128i address = _mm_add_epi32(_mm_set1_epi32(0x10000), _mm_slli_epi32(_mm_and_si128(unit, _mm_set1_epi32(0x3FF)), 5));
+
+        address = _mm_add_epi32(address, _mm_sll_epi32(_mm_and_si128(ty, seven), pixel_row_shift));
+        address = _mm_add_epi32(address, _mm_srl_epi32(_mm_and_si128(tx, seven), pixel_shift));
+        in = _mm_and_si128(in, _mm_cmplt_epi32(address, _mm_set1_epi32(VRAM_SIZE)));
+
+        _mm_storeu_si128((__m128i *)texel, address);
+        _mm_storeu_si128((__m128i *)inside, in);
+        _mm_storeu_si128((__m128i *)column, tx);
+
+        for (int lane = 0; lane < 4; lane++) {
+            uint8_t color_index = inside[lane] ? ppu->vram[texel[lane]] : 0;
+
+            if (!sprite->color_256) {
+                color_index = (color_index >> ((column[lane] & 1) * 4)) & 0xF;
+            }
+
+            out[i + lane] = color_index;
+        }
+
+        x = _mm_add_epi32(x, step_x);
+        y = _mm_add_epi32(y, step_y);
+    }
+}
+
+/*
+    AVX2: 8 pixels at a time all the way to the color. The byte gathers load 4 bytes
+    each, every address is below the end of vram and oam follows it in the PPU struct,
+    so the extra 3 bytes never leave the struct.
+*/
+
+__attribute__((target("avx2")))
+static void affine_background_line_avx2(const PPU *ppu, const AffineBackground *bg, uint32_t *out) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i x = _mm256_add_epi32(_mm256_set1_epi32(bg->x), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(bg->pa)));
+    __m256i y = _mm256_add_epi32(_mm256_set1_epi32(bg->y), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(bg->pc)));
+    __m256i step_x = _mm256_set1_epi32(bg->pa * 8);
+    __m256i step_y = _mm256_set1_epi32(bg->pc * 8);
+    __m256i size_mask = _mm256_set1_epi32(bg->size - 1);
+    __m256i outside_mask = _mm256_set1_epi32(~(bg->size - 1));
+    __m256i seven = _mm256_set1_epi32(7);
+    __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    __m128i map_shift = _mm_cvtsi32_si128(__builtin_ctz(bg->size) - 3);
+    __m256i zero = _mm256_setzero_si256();
+    const int *vram = (const int *)ppu->vram;
+    const int *palette = (const int *)ppu->palette_rgba;
+
+    for (uint32_t i = 0; i < SCREEN_WIDTH; i += 8) {
+        __m256i tx = _mm256_srai_epi32(x, 8);
+        __m256i ty = _mm256_srai_epi32(y, 8);
+        __m256i inside = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(tx, ty), outside_mask), zero);
+
+        if (bg->wraparound) {
+            inside = _mm256_set1_epi32(-1);
+        }
+
+        tx = _mm256_and_si256(tx, size_mask);
+        ty = _mm256_and_si256(ty, size_mask);
+
+        __m256i map_address = _mm256_add_epi32(_mm256_set1_epi32(bg->screen_base), _mm256_add_epi32(_mm256_sll_epi32(_mm256_srli_epi32(ty, 3), map_shift), _mm256_srli_epi32(tx, 3)));
+        map_address = _mm256_and_si256(map_address, _mm256_set1_epi32(0xFFFF));
+
+        __m256i tile = _mm256_and_si256(_mm256_i32gather_epi32(vram, map_address, 1), byte_mask);
+        __m256i address = _mm256_add_epi32(_mm256_set1_epi32(bg->char_base), _mm256_slli_epi32(tile, 6));
+
+        address = _mm256_add_epi32(address, _mm256_slli_epi32(_mm256_and_si256(ty, seven), 3));
+        address = _mm256_add_epi32(address, _mm256_and_si256(tx, seven));
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(_mm256_set1_epi32(0x10000), address));
+
+        __m256i color_index = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, vram, address, inside, 1), byte_mask);
+        __m256i opaque = _mm256_andnot_si256(_mm256_cmpeq_epi32(color_index, zero), inside);
+        __m256i color = _mm256_mask_i32gather_epi32(zero, palette, color_index, opaque, 4);
+
+        _mm256_storeu_si256((__m256i *)&out[i], color);
+
+        x = _mm256_add_epi32(x, step_x);
+        y = _mm256_add_epi32(y, step_y);
+    }
+}
+
+__attribute__((target("avx2")))
+static void affine_sprite_span_avx2(const PPU *ppu, const AffineSprite *sprite, uint32_t count, uint8_t *out) {
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i x = _mm256_add_epi32(_mm256_set1_epi32(sprite->x), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(sprite->pa)));
+    __m256i y = _mm256_add_epi32(_mm256_set1_epi32(sprite->y), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(sprite->pc)));
+    __m256i step_x = _mm256_set1_epi32(sprite->pa * 8);
+    __m256i step_y = _mm256_set1_epi32(sprite->pc * 8);
+    __m256i outside_x = _mm256_set1_epi32(~(sprite->width - 1));
+    __m256i outside_y = _mm256_set1_epi32(~(sprite->height - 1));
+    __m256i seven = _mm256_set1_epi32(7);
+    __m128i row_shift = _mm_cvtsi32_si128(sprite->row_shift);
+    __m128i tile_shift = _mm_cvtsi32_si128(sprite->color_256);
+    __m128i pixel_row_shift = _mm_cvtsi32_si128(2 + sprite->color_256);
+    __m128i pixel_shift = _mm_cvtsi32_si128(1 - sprite->color_256);
+
+    // 16 color tiles take the high nibble for odd columns
+    __m256i nibble = _mm256_set1_epi32(sprite->color_256 ? 0 : 1);
+    __m256i index_mask = _mm256_set1_epi32(sprite->color_256 ? 0xFF : 0xF);
+    __m256i zero = _mm256_setzero_si256();
+    const int *vram = (const int *)ppu->vram;
+
+    for (uint32_t i = 0; i < count; i += 8) {
+        __m256i tx = _mm256_srai_epi32(x, 8);
+        __m256i ty = _mm256_srai_epi32(y, 8);
+        __m256i inside = _mm256_cmpeq_epi32(_mm256_or_si256(_mm256_and_si256(tx, outside_x), _mm256_and_si256(ty, outside_y)), zero);
+
+        tx = _mm256_andnot_si256(outside_x, tx);
+        ty = _mm256_andnot_si256(outside_y, ty);
+
+        __m256i unit = _mm256_add_epi32(_mm256_set1_epi32(sprite->tile), _mm256_add_epi32(_mm256_sll_epi32(_mm256_srli_epi32(ty, 3), row_shift), _mm256_sll_epi32(_mm256_srli_epi32(tx, 3), tile_shift)));
+        __m256i address = _mm256_add_epi32(_mm256_set1_epi32(0x10000), _mm256_slli_epi32(_mm256_and_si256(unit, _mm256_set1_epi32(0x3FF)), 5));
+
+        address = _mm256_add_epi32(address, _mm256_sll_epi32(_mm256_and_si256(ty, seven), pixel_row_shift));
+        address = _mm256_add_epi32(address, _mm256_srl_epi32(_mm256_and_si256(tx, seven), pixel_shift));
+        inside = _mm256_and_si256(inside, _mm256_cmpgt_epi32(_mm256_set1_epi32(VRAM_SIZE), address));
+
+        __m256i texel = _mm256_mask_i32gather_epi32(zero, vram, address, inside, 1);
+        __m256i color_index = _mm256_srlv_epi32(texel, _mm256_slli_epi32(_mm256_and_si256(tx, nibble), 2));
+
+        color_index = _mm256_and_si256(color_index, index_mask);
+
+        // 8 x 32 bit down to 8 bytes
+        __m128i halves = _mm_packus_epi32(_mm256_castsi256_si128(color_index), _mm256_extracti128_si256(color_index, 1));
+        _mm_storel_epi64((__m128i *)&out[i], _mm_packus_epi16(halves, halves));
+
+        x = _mm256_add_epi32(x, step_x);
+        y = _mm256_add_epi32(y, step_y);
+    }
+}
+
+#endif
+
+void affine_select(void) {
+#ifdef AFFINE_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        affine_background_line = affine_background_line_avx2;
+        affine_sprite_span = affine_sprite_span_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        affine_background_line = affine_background_line_sse2;
+        affine_sprite_span = affine_sprite_span_sse2;
+    }
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef PPU_AFFINE_H
+#define PPU_AFFINE_H
+#include <stdint.h>
+#include "ppu.h"
+
+/*
+    Texture lookups for affine backgrounds (BG2/BG3 in modes 1 and 2) and affine sprites.
+
+    Both step a texture coordinate by (pa, pc) every pixel. There is a plain C version
+    that is the reference, an SSE2 version that does the coordinates 4 pixels at a time,
+    and an AVX2 version that does 8 pixels at a time including the texel and palette
+    fetches (gathers). affine_select picks the best one the cpu has, building with
+    -DNO_SIMD leaves only the reference.
+*/
+
+typedef struct {
+    int32_t x, y;               // texture coordinate of the first pixel, 8 fractional bits
+    int16_t pa, pc;             // added to x and y every pixel
+    int32_t size;               // 128, 256, 512 or 1024 pixels square
+    uint32_t char_base;
+    uint32_t screen_base;
+    uint8_t wraparound;
+} AffineBackground;
+
+typedef struct {
+    int32_t x, y;               // texture coordinate of the first pixel, 8 fractional bits
+    int16_t pa, pc;
+    int32_t width, height;      // of the sprite, not the double size box
+    uint32_t tile;
+    uint8_t color_256;
+    uint8_t row_shift;          // log2 of the tile units between two rows of tiles
+} AffineSprite;
+
+// writes SCREEN_WIDTH colors, 0 where there is no pixel
+typedef void (*AffineBackgroundLine)(const PPU *ppu, const AffineBackground *bg, uint32_t *out);
+
+// writes count color indices (0 is transparent, 16 color sprites don't have the bank added)
+// out needs room for count rounded up to 8
+typedef void (*AffineSpriteSpan)(const PPU *ppu, const AffineSprite *sprite, uint32_t count, uint8_t *out);
+
+extern AffineBackgroundLine affine_background_line;
+extern AffineSpriteSpan affine_sprite_span;
+
+void affine_background_line_scalar(const PPU *ppu, const AffineBackground *bg, uint32_t *out);
+void affine_sprite_span_scalar(const PPU *ppu, const AffineSprite *sprite, uint32_t count, uint8_t *out);
+void affine_select(void);
+
+#endif
@@ -0,0 +1,96 @@
+#!/bin/sh
+# Regression run over a directory of roms (make regress ROMS=<dir>).
+#
+#   ./regress.sh <dir> [frames] [--update]
+#
+# Every <name>.gba in dir runs headless for frames (default 600) with erased save
+# memory, playing back <name>.movie and applying the codes in <name>.cheats if they
+# exist. The state and framebuffer hashes printed at the end are compared with the
+# ones in <name>.golden, --update writes them instead. Roms run in parallel, one
+# per core, each line has the wall time of that rom. Exits with 1 if any rom failed.
+#
+# GBA picks the emulator binary (default ./gba_emulator).
+
+GBA=${GBA:-./gba_emulator}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# one rom, called through xargs: --one <rom> <frames> <update>
+if [ "$1" = "--one" ]; then
+    rom=$2
+    frames=$3
+    update=$4
+    name=${rom%.gba}
+    inputs=""
+
+    if [ -f "$name.movie" ]; then
+        inputs="--movie $name.movie"
+    fi
+
+    if [ -f "$name.cheats" ]; then
+        inputs="$inputs --cheats $name.cheats"
+    fi
+
+    start=$(now_ms)
+    # shellcheck disable=SC2086
+    hashes=$("$GBA" --run "$frames" --rom "$rom" --hash --no-save --no-audio --ppu-inline $inputs 2>/dev/null)
+    status=$?
+    elapsed=$(($(now_ms) - start))
+    time=$(printf "%d.%03ds" $((elapsed / 1000)) $((elapsed % 1000)))
+
+    if [ $status -ne 0 ] || [ -z "$hashes" ]; then
+        echo "ERROR  $(basename "$name") $time (exit $status)"
+    elif [ "$update" = 1 ]; then
+        echo "$hashes" > "$name.golden"
+        echo "UPDATE $(basename "$name") $time $hashes"
+    elif [ ! -f "$name.golden" ]; then
+        echo "NEW    $(basename "$name") $time $hashes (no golden, run with --update)"
+    elif [ "$(cat "$name.golden")" = "$hashes" ]; then
+        echo "PASS   $(basename "$name") $time"
+    else
+        echo "FAIL   $(basename "$name") $time expected $(cat "$name.golden") got $hashes"
+    fi
+
+    exit 0
+fi
+
+if [ $# -lt 1 ] || [ ! -d "$1" ]; then
+    echo "usage: $0 <rom directory> [frames] [--update]" >&2
+    exit 2
+fi
+
+dir=$1
+frames=600
+update=0
+shift
+
+for argument in "$@"; do
+    case $argument in
+        --update) update=1 ;;
+        *) frames=$argument ;;
+    esac
+done
+
+if [ ! -x "$GBA" ]; then
+    echo "$GBA doesn't exist, run make first" >&2
+    exit 2
+fi
+
+results=$(mktemp)
+start=$(now_ms)
+
+find "$dir" -maxdepth 1 -name '*.gba' | sort |
+    xargs -P "$(nproc)" -I {} "$0" --one {} "$frames" "$update" > "$results"
+
+elapsed=$(($(now_ms) - start))
+sort -k2 "$results"
+
+total=$(wc -l < "$results")
+failed=$(grep -c '^\(FAIL\|ERROR\)' "$results")
+rm -f "$results"
+
+printf "%d roms, %d failed, %d frames each, %d.%03ds\n" "$total" "$failed" "$frames" $((elapsed / 1000)) $((elapsed % 1000))
+
+[ "$failed" -eq 0 ]
@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include "scheduler.h"
+#include "ppu.h"
+#include "apu.h"
+#include "cheats.h"
+
+/*
+    The only events right now are the LCD ones. They drive DISPSTAT/VCOUNT and
+    raise the matching interrupt flags, which is what games poll or wait on. The
+    ppu renders a line at each visible HBlank, the apu catches up and cheats are
+    applied when VBlank starts.
+*/
+
+static void set_dispstat_flag(Memory *memory, uint16_t flag, int on) {
+    uint16_t *dispstat = (uint16_t *)&memory->io[IO_DISPSTAT];
+
+    if (on) {
+        *dispstat |= flag;
+    } else {
+        *dispstat &= ~flag;
+    }
+}
+
+static void request_interrupt(Memory *memory, uint16_t irq) {
+    *(uint16_t *)&memory->io[IO_IF] |= irq;
+}
+
+void scheduler_init(Scheduler *scheduler, Memory *memory) {
+    scheduler->cycles = 0;
+    scheduler->next_event = CYCLES_PER_HDRAW;
+    scheduler->next_event_type = EVENT_HBLANK;
+    scheduler->vcount = 0;
+    scheduler->frame = 0;
+    scheduler->idle_cycles_skipped = 0;
+    scheduler->ppu = NULL;
+    scheduler->apu = NULL;
+    scheduler->cheats = NULL;
+
+    *(uint16_t *)&memory->io[IO_VCOUNT] = 0;
+    *(uint16_t *)&memory->io[IO_DISPSTAT] = 0;
+}
+
+/*
+    Fires every event that is due. Returns 1 if VBlank started (a frame finished),
+    otherwise 0.
+*/
+int scheduler_run_events(Scheduler *scheduler, Memory *memory) {
+    int frame_done = 0;
+
+    if (scheduler->apu != NULL && scheduler->cycles >= scheduler->next_event) {
+        apu_run(scheduler->apu, scheduler->cycles);
+    }
+
+    while (scheduler->cycles >= scheduler->next_event) {
+        uint16_t dispstat = *(uint16_t *)&memory->io[IO_DISPSTAT];
+
+        if (scheduler->next_event_type == EVENT_HBLANK) {
+            set_dispstat_flag(memory, 1 << 1, 1);
+
+            if (scheduler->ppu != NULL && scheduler->vcount < VISIBLE_SCANLINES) {
+                ppu_scanline(scheduler->ppu, scheduler->vcount);
+            }
+
+            // DISPSTAT bit 4 is HBlank IRQ enable
+            if ((dispstat >> 4) & 0x1) {
+                request_interrupt(memory, IRQ_HBLANK);
+            }
+
+            scheduler->next_event += CYCLES_PER_SCANLINE - CYCLES_PER_HDRAW;
+            scheduler->next_event_type = EVENT_SCANLINE_END;
+            continue;
+        }
+
+        // EVENT_SCANLINE_END
+        set_dispstat_flag(memory, 1 << 1, 0);
+
+        scheduler->vcount++;
+
+        if (scheduler->vcount == TOTAL_SCANLINES) {
+            scheduler->vcount = 0;
+            set_dispstat_flag(memory, 1 << 0, 0);
+        }
+
+        if (scheduler->vcount == VISIBLE_SCANLINES) {
+            set_dispstat_flag(memory, 1 << 0, 1);
+            scheduler->frame++;
+            frame_done = 1;
+
+            if (scheduler->cheats != NULL) {
+                cheats_apply(scheduler->cheats, memory);
+            }
+
+            // DISPSTAT bit 3 is VBlank IRQ enable
+            if ((dispstat >> 3) & 0x1) {
+                request_interrupt(memory, IRQ_VBLANK);
+            }
+        }
+
+        *(uint16_t *)&memory->io[IO_VCOUNT] = scheduler->vcount;
+
+        // DISPSTAT bits 8-15 hold the V-Count setting (LYC)
+        uint8_t vcount_setting = dispstat >> 8;
+        set_dispstat_flag(memory, 1 << 2, scheduler->vcount == vcount_setting);
+
+        // DISPSTAT bit 5 is V-Counter IRQ enable
+        if (scheduler->vcount == vcount_setting && ((dispstat >> 5) & 0x1)) {
+            request_interrupt(memory, IRQ_VCOUNTER);
+        }
+
+        scheduler->next_event += CYCLES_PER_HDRAW;
+        scheduler->next_event_type = EVENT_HBLANK;
+    }
+
+    return frame_done;
+}
+
+/*
+    Used when the cpu is known to be doing nothing until something external happens
+    (halted, or spinning in an idle loop). Nothing can change before the next event, so
+    jump the cycle counter straight to it.
+*/
+void scheduler_skip_to_next_event(Scheduler *scheduler) {
+    if (scheduler->cycles < scheduler->next_event) {
+        scheduler->idle_cycles_skipped += scheduler->next_event - scheduler->cycles;
+        scheduler->cycles = scheduler->next_event;
+    }
+}
+
+/*
+    Same for an idle loop taking iteration_cycles a time: the loop runs whole iterations,
+    so it skips to where the first one at or past the event ends, as running it would.
+*/
+void scheduler_skip_loop(Scheduler *scheduler, uint32_t iteration_cycles) {
+    if (scheduler->cycles < scheduler->next_event && iteration_cycles != 0) {
+        uint64_t iterations = (scheduler->next_event - scheduler->cycles + iteration_cycles - 1) / iteration_cycles;
+
+        scheduler->idle_cycles_skipped += iterations * iteration_cycles;
+        scheduler->cycles += iterations * iteration_cycles;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <stdint.h>
+#include "setup.h"
+
+/*
+    LCD timing (all values in CPU cycles, 16.78 MHz)
+        - one scanline is 960 cycles of HDraw followed by 272 cycles of HBlank
+        - 160 visible scanlines followed by 68 scanlines of VBlank
+*/
+#define CYCLES_PER_HDRAW 960
+#define CYCLES_PER_SCANLINE 1232
+#define VISIBLE_SCANLINES 160
+#define TOTAL_SCANLINES 228
+#define CYCLES_PER_FRAME (CYCLES_PER_SCANLINE * TOTAL_SCANLINES)
+
+// interrupt flag bits for IE/IF
+#define IRQ_VBLANK (1 << 0)
+#define IRQ_HBLANK (1 << 1)
+#define IRQ_VCOUNTER (1 << 2)
+
+enum SCHEDULER_EVENT {
+    EVENT_HBLANK = 0,       // end of HDraw for the current scanline
+    EVENT_SCANLINE_END = 1  // end of HBlank, VCOUNT moves to the next line
+};
+
+typedef struct {
+    uint64_t cycles;                // cycles since power on
+    uint64_t next_event;            // value of cycles at which next_event_type fires
+    uint8_t next_event_type;
+    uint16_t vcount;
+    uint64_t frame;
+
+    uint64_t idle_cycles_skipped;   // cycles fast-forwarded by idle detection
+
+    struct PPU *ppu;                // gets a scanline at every visible HBlank if set
+    struct APU *apu;                // catches up at every event if set
+    struct Cheats *cheats;          // applied at the start of every VBlank if set
+} Scheduler;
+
+void scheduler_init(Scheduler *scheduler, Memory *memory);
+int scheduler_run_events(Scheduler *scheduler, Memory *memory);
+void scheduler_skip_to_next_event(Scheduler *scheduler);
+void scheduler_skip_loop(Scheduler *scheduler, uint32_t iteration_cycles);
+
+#endif
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "setup.h"
+#include "search.h"
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+_Static_assert(offsetof(Memory, wram2) == offsetof(Memory, wram1) + WRAM1_SIZE, "wram2 has to follow wram1");
+
+typedef uint32_t (*SearchFilter)(Search *search, uint8_t op, uint32_t a, uint32_t b);
+
+static uint32_t filter_scalar(Search *search, uint8_t op, uint32_t a, uint32_t b);
+static SearchFilter search_filter_words = filter_scalar;
+
+// Reference
+
+static uint32_t load(const uint8_t *bytes, uint8_t width) {
+    uint32_t value = 0;
+    memcpy(&value, bytes, width);
+    return value;
+}
+
+static int matches(uint32_t value, uint32_t old, uint8_t op, uint32_t a, uint32_t b, uint32_t mask) {
+    switch (op) {
+        case SEARCH_EQUAL: return value == (a & mask);
+        case SEARCH_NOT_EQUAL: return value != (a & mask);
+        case SEARCH_RANGE: return ((value - a) & mask) <= ((b - a) & mask);
+        case SEARCH_CHANGED: return value != old;
+        case SEARCH_UNCHANGED: return value == old;
+        case SEARCH_INCREASED: return value > old;
+        case SEARCH_DECREASED: return value < old;
+        case SEARCH_DELTA: return ((value - old - a) & mask) <= ((b - a) & mask);
+    }
+
+    return 0;
+}
+
+static uint32_t filter_scalar(Search *search, uint8_t op, uint32_t a, uint32_t b) {
+    uint8_t width = search->width;
+    uint32_t chunk = 32 * width;
+    uint32_t mask = width == 4 ? 0xFFFFFFFF : (1u << (width * 8)) - 1;
+    uint32_t count = 0;
+
+    for (uint32_t j = 0; j < SEARCH_SIZE / chunk; j++) {
+        uint32_t bits = search->candidates[j];
+        uint32_t keep = 0;
+
+        if (bits == 0) {
+            continue;
+        }
+
+        const uint8_t *current = search->memory + j * chunk;
+        uint8_t *snapshot = search->snapshot + j * chunk;
+
+        for (; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+
+            if (matches(load(current + i * width, width), load(snapshot + i * width, width), op, a, b, mask)) {
+                keep |= 1u << i;
+            }
+        }
+
+        search->candidates[j] = keep;
+        count += __builtin_popcount(keep);
+
+        // only survivors are looked at again
+        if (keep) {
+            memcpy(snapshot, current, chunk);
+        }
+    }
+
+    return count;
+}
+
+#ifdef SEARCH_X86
+
+/*
+    AVX2: the lanes of a vector are values of one width, an unsigned x <= y is
+    min(x, y) == x and both ranges are one subtraction and one unsigned compare.
+    Everything takes the width as a constant so each width gets its own loop.
+*/
+
+#define AVX2_INLINE __attribute__((target("avx2"), always_inline)) static inline
+
+AVX2_INLINE __m256i equal_avx2(__m256i x, __m256i y, int width) {
+    return width == 1 ? _mm256_cmpeq_epi8(x, y) : width == 2 ? _mm256_cmpeq_epi16(x, y) : _mm256_cmpeq_epi32(x, y);
+}
+
+AVX2_INLINE __m256i sub_avx2(__m256i x, __m256i y, int width) {
+    return width == 1 ? _mm256_sub_epi8(x, y) : width == 2 ? _mm256_sub_epi16(x, y) : _mm256_sub_epi32(x, y);
+}
+
+AVX2_INLINE __m256i below_or_equal_avx2(__m256i x, __m256i y, int width) {
+    __m256i min = width == 1 ? _mm256_min_epu8(x, y) : width == 2 ? _mm256_min_epu16(x, y) : _mm256_min_epu32(x, y);
+    return equal_avx2(min, x, width);
+}
+
+AVX2_INLINE __m256i broadcast_avx2(uint32_t value, int width) {
+    return width == 1 ? _mm256_set1_epi8((char)value) : width == 2 ? _mm256_set1_epi16((short)value) : _mm256_set1_epi32((int)value);
+}
+
+// all ones in the lanes that pass
+AVX2_INLINE __m256i test_avx2(__m256i value, __m256i old, uint8_t op, __m256i a, __m256i span, int width) {
+    __m256i ones = _mm256_set1_epi8(-1);
+
+    switch (op) {
+        case SEARCH_EQUAL: return equal_avx2(value, a, width);
+        case SEARCH_NOT_EQUAL: return _mm256_xor_si256(equal_avx2(value, a, width), ones);
+        case SEARCH_RANGE: return below_or_equal_avx2(sub_avx2(value, a, width), span, width);
+        case SEARCH_CHANGED: return _mm256_xor_si256(equal_avx2(value, old, width), ones);
+        case SEARCH_UNCHANGED: return equal_avx2(value, old, width);
+        case SEARCH_INCREASED: return _mm256_xor_si256(below_or_equal_avx2(value, old, width), ones);
+        case SEARCH_DECREASED: return _mm256_xor_si256(below_or_equal_avx2(old, value, width), ones);
+        case SEARCH_DELTA: return below_or_equal_avx2(sub_avx2(sub_avx2(value, old, width), a, width), span, width);
+    }
+
+    return _mm256_setzero_si256();
+}
+
+// 32 values starting at current, 1 to 4 vectors, one bit each
+AVX2_INLINE uint32_t test_word_avx2(const uint8_t *current, const uint8_t *snapshot, uint8_t op, __m256i a, __m256i span, int width) {
+    __m256i pass[4];
+
+    for (int v = 0; v < width; v++) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(current + v * 32));
+        __m256i old = _mm256_load_si256((const __m256i *)(snapshot + v * 32));
+        pass[v] = test_avx2(value, old, op, a, span, width);
+    }
+
+    if (width == 1) {
+        return _mm256_movemask_epi8(pass[0]);
+    }
+
+    if (width == 2) {
+        // packing works per 128 bit half, put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(pass[0], pass[1]), 0xD8);
+        return _mm256_movemask_epi8(packed);
+    }
+
+    uint32_t bits = 0;
+
+    for (int v = 0; v < 4; v++) {
+        bits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(pass[v])) << (v * 8);
+    }
+
+    return bits;
+}
+
+AVX2_INLINE uint32_t filter_width_avx2(Search *search, uint8_t op, uint32_t a, uint32_t b, int width) {
+    uint32_t chunk = 32 * width;
+    __m256i broadcast_a = broadcast_avx2(a, width);
+    __m256i span = broadcast_avx2(b - a, width);
+    uint32_t count = 0;
+
+    for (uint32_t j = 0; j < SEARCH_SIZE / chunk; j++) {
+        uint32_t bits = search->candidates[j];
+
+        if (bits == 0) {
+            continue;
+        }
+
+        const uint8_t *current = search->memory + j * chunk;
+        uint8_t *snapshot = search->snapshot + j * chunk;
+        uint32_t keep = bits & test_word_avx2(current, snapshot, op, broadcast_a, span, width);
+
+        search->candidates[j] = keep;
+        count += __builtin_popcount(keep);
+
+        if (keep) {
+            memcpy(snapshot, current, chunk);
+        }
+    }
+
+    return count;
+}
+
+__attribute__((target("avx2")))
+static uint32_t filter_avx2(Search *search, uint8_t op, uint32_t a, uint32_t b) {
+    switch (search->width) {
+        case 1: return filter_width_avx2(search, op, a, b, 1);
+        case 2: return filter_width_avx2(search, op, a, b, 2);
+        default: return filter_width_avx2(search, op, a, b, 4);
+    }
+}
+
+#endif
+
+void search_select(void) {
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        search_filter_words = filter_avx2;
+    }
+#endif
+}
+
+// width is in bytes, 1, 2 or 4
+Search *search_create(Memory *memory, uint8_t width) {
+    if (width != 1 && width != 2 && width != 4) {
+        fprintf(stderr, "Can only search 1, 2 or 4 byte values, not %u\n", width);
+        return NULL;
+    }
+
+    Search *search = aligned_alloc(32, (sizeof(Search) + 31) & ~(size_t)31);
+
+    if (search == NULL) {
+        fprintf(stderr, "Could not allocate the search\n");
+        return NULL;
+    }
+
+    search_select();
+    search->memory = memory->wram1;
+    search->width = width;
+    search_reset(search);
+
+    return search;
+}
+
+// every aligned value is a candidate again, the snapshot is taken now
+void search_reset(Search *search) {
+    uint32_t words = SEARCH_SIZE / (32 * search->width);
+
+    memset(search->candidates, 0, sizeof(search->candidates));
+    memset(search->candidates, 0xFF, words * sizeof(uint32_t));
+    memcpy(search->snapshot, search->memory, SEARCH_SIZE);
+    search->count = words * 32;
+}
+
+// returns the number of candidates left
+uint32_t search_filter(Search *search, uint8_t op, uint32_t a, uint32_t b) {
+    if (op >= SEARCH_OP_COUNT) {
+        fprintf(stderr, "Unknown search test %u\n", op);
+        return search->count;
+    }
+
+    search->count = search_filter_words(search, op, a, b);
+    return search->count;
+}
+
+// writes the cpu addresses of up to max candidates in address order, returns how many
+uint32_t search_results(Search *search, uint32_t *addresses, uint32_t max) {
+    uint32_t written = 0;
+
+    for (uint32_t j = 0; j < SEARCH_WORDS && written < max; j++) {
+        for (uint32_t bits = search->candidates[j]; bits && written < max; bits &= bits - 1) {
+            uint32_t offset = (j * 32 + __builtin_ctz(bits)) * search->width;
+
+            addresses[written++] = offset < WRAM1_SIZE ? 0x02000000 + offset : 0x03000000 + offset - WRAM1_SIZE;
+        }
+    }
+
+    return written;
+}
+
+void search_destroy(Search *search) {
+    free(search);
+}
@@ -0,0 +1,59 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+#include <stdint.h>
+#include "setup.h"
+
+/*
+    Value search over wram1 and wram2, for finding where a game keeps something.
+
+    A search starts with every aligned 8, 16 or 32 bit value as a candidate and a
+    snapshot of both regions. Each search_filter keeps the candidates that pass a test
+    against a constant or against their value in the snapshot, then the snapshot of
+    the survivors is taken again, so CHANGED means changed since the previous filter.
+
+        search_create(memory, 2)                        every halfword
+        run, lose a life
+        search_filter(search, SEARCH_DELTA, -1, -1)     went down by exactly 1
+        run
+        search_filter(search, SEARCH_UNCHANGED, 0, 0)
+
+    Candidates are a bitmap, one bit per value and 32 values per word. A word covers
+    32 bytes of memory for 8 bit values up to 128 for 32 bit ones, words that are 0 are
+    skipped, so filters get cheaper as the candidates thin out. There is a plain C
+    version that is the reference and an AVX2 version that tests a whole word with
+    1 to 4 compares, search_select picks one, building with -DNO_SIMD leaves only the
+    reference.
+*/
+
+#define SEARCH_SIZE (WRAM1_SIZE + WRAM2_SIZE)      // wram2 follows wram1 in Memory
+#define SEARCH_WORDS (SEARCH_SIZE / 32)             // enough for 8 bit values
+
+// tests, a and b are truncated to the width, ranges are inclusive and may wrap
+enum SEARCH_OP {
+    SEARCH_EQUAL = 0,                               // value == a
+    SEARCH_NOT_EQUAL,                               // value != a
+    SEARCH_RANGE,                                   // a <= value <= b, unsigned
+    SEARCH_CHANGED,                                 // value != snapshot
+    SEARCH_UNCHANGED,                               // value == snapshot
+    SEARCH_INCREASED,                               // value > snapshot, unsigned
+    SEARCH_DECREASED,                               // value < snapshot, unsigned
+    SEARCH_DELTA,                                   // a <= value - snapshot <= b, signed (-3 to 3 works)
+    SEARCH_OP_COUNT
+};
+
+typedef struct Search {
+    _Alignas(32) uint8_t snapshot[SEARCH_SIZE];
+    uint32_t candidates[SEARCH_WORDS];              // bit i of word j is value 32 * j + i
+    const uint8_t *memory;                          // wram1
+    uint8_t width;                                  // 1, 2 or 4 bytes
+    uint32_t count;
+} Search;
+
+void search_select(void);
+Search *search_create(Memory *memory, uint8_t width);
+void search_reset(Search *search);
+uint32_t search_filter(Search *search, uint8_t op, uint32_t a, uint32_t b);
+uint32_t search_results(Search *search, uint32_t *addresses, uint32_t max);
+void search_destroy(Search *search);
+
+#endif
@@ -1,6 +1,18 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "setup.h"
+#include "arena.h"
+#include "bios.h"
+#include "ppu.h"
+#include "apu.h"
+#include "backup.h"
 
 #define UNUSED(x) (void)(x)
 
@@ -54,7 +66,7 @@ int HI(PSR *cpsr) {
 
 // 1001
 int LS(PSR *cpsr) {
-	return (!cpsr->c && cpsr->z);
+	return (!cpsr->c || cpsr->z);
 }
 
 
@@ -92,264 +104,515 @@ int (*condition_codes[15])(PSR *) = {
 	EQ, NE, CS, CC, MI, PL, VS, VC, HI, LS, GE, LT, GT, LE, AL
 };
 
-uint8_t fetch_memory(Memory *memory, unsigned int address) {
-	if (address < 0x00003FFF) {
-		return memory->bios[address];
+// the bios never changes, every instance reads the same read only copy
+static uint8_t *shared_bios;
+static pthread_once_t shared_bios_once = PTHREAD_ONCE_INIT;
+
+static void create_shared_bios(void) {
+	uint8_t *bios = mmap(NULL, BIOS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (bios == MAP_FAILED) {
+		fprintf(stderr, "Could not allocate the bios\n");
+		return;
 	}
 
-	if (address < 0x0203FFFF) {
-		return memory->wram1[address - 0x02000000];
+	bios_install(bios);
+	mprotect(bios, BIOS_SIZE, PROT_READ);
+	shared_bios = bios;
+}
+
+static uint32_t page_round(uint32_t size) {
+	uint32_t page = (uint32_t)sysconf(_SC_PAGESIZE);
+	return (size + page - 1) & ~(page - 1);
+}
+
+/*
+    Zeroed memory with the shared bios and an empty rom. The whole 32 MByte rom window
+    is reserved read only up front, unmapped parts of it read as 0 without using any
+    memory. With huge_pages the regions are asked to be backed by huge pages.
+*/
+Memory *memory_create(int huge_pages) {
+	pthread_once(&shared_bios_once, create_shared_bios);
+
+	Memory *memory = arena_alloc(sizeof(Memory), huge_pages);
+
+	if (memory == NULL || shared_bios == NULL) {
+		fprintf(stderr, "Could not allocate the memory\n");
+		arena_free(memory);
+		return NULL;
 	}
 
-	if (address < 0x03007FFF) {
-		return memory->wram2[address - 0x03000000];
+	memory->bios = shared_bios;
+	memory->rom = mmap(NULL, ROM_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (memory->rom == MAP_FAILED) {
+		fprintf(stderr, "Could not reserve the rom space\n");
+		arena_free(memory);
+		return NULL;
 	}
 
-	if (address < 0x040003FE) {
-		return memory->io[address - 0x04000000];
+	return memory;
+}
+
+// maps the file over the start of the rom space, anything past ROM_SIZE is ignored
+int memory_map_rom(Memory *memory, const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat file;
+
+	if (fd < 0 || fstat(fd, &file) != 0) {
+		fprintf(stderr, "Could not open %s\n", path);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		return -1;
 	}
 
-	if (address < 0x050003FF) {
-		return memory->bg_obj_palette_ram[address - 0x0500000];
+	// the last page is filled up with 0, pages past the end of the file would fault
+	uint32_t size = page_round(file.st_size < ROM_SIZE ? (uint32_t)file.st_size : ROM_SIZE);
+
+	if (size != 0 && mmap(memory->rom, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s\n", path);
+		close(fd);
+		return -1;
 	}
 
-	if (address < 0x06017FFF) {
-		return memory->vram[address - 0x06000000];
+	close(fd);
+	memory->rom_size = size;
+
+	return 0;
+}
+
+// for roms that aren't in a file, the copy is private to the instance
+int memory_copy_rom(Memory *memory, const void *data, uint32_t size) {
+	if (size > ROM_SIZE) {
+		fprintf(stderr, "Rom is %u bytes, more than the %d the cartridge space holds\n", size, ROM_SIZE);
+		return -1;
 	}
 
-	if (address < 0x070003FF) {
-		return memory->obj_attributes[address - 0x07000000];
+	uint32_t mapped = page_round(size);
+
+	if (mprotect(memory->rom, mapped, PROT_READ | PROT_WRITE) != 0) {
+		fprintf(stderr, "Could not write the rom space\n");
+		return -1;
+	}
+
+	memcpy(memory->rom, data, size);
+	mprotect(memory->rom, mapped, PROT_READ);
+	memory->rom_size = mapped;
+
+	return 0;
+}
+
+// lets the emulator itself (cheats) write the rom, the pages written become private copies
+void memory_rom_writable(Memory *memory, uint32_t offset, uint32_t size) {
+	uint32_t page = (uint32_t)sysconf(_SC_PAGESIZE);
+	uint32_t start = offset & ~(page - 1);
+
+	if (mprotect(memory->rom + start, page_round(offset + size) - start, PROT_READ | PROT_WRITE) != 0) {
+		fprintf(stderr, "Could not make the rom writable at %.8x\n", offset);
 	}
+}
 
-	if (address < 0x09FFFFFF) {
-		return memory->rom[address - 0x08000000];
+void memory_destroy(Memory *memory) {
+	if (memory == NULL) {
+		return;
 	}
 
-	fprintf(stderr, "Invalid address: %d\n", address);
-	return -1;
+	munmap(memory->rom, ROM_SIZE);
+	arena_free(memory);
 }
 
-uint32_t fetch_instruction_arm(Memory *memory, uint32_t pc) {
-    if (pc < 0x08000000 || pc > 0x09FFFFFF) {
-        fprintf(stderr, "Invalid rom pc: %d\n", pc);
-        return -1;
-    }
+/*
+    Returns a pointer to the byte backing address, or NULL if nothing is mapped there.
+    The upper 8 bits of the address select the region, regions smaller than their
+    window are mirrored.
+*/
+uint8_t *memory_pointer(Memory *memory, uint32_t address) {
+	switch (address >> 24) {
+		case 0x00:
+			if (address < BIOS_SIZE) {
+				return &memory->bios[address];
+			}
+			return NULL;
+		case 0x02:
+			return &memory->wram1[address & (WRAM1_SIZE - 1)];
+		case 0x03:
+			return &memory->wram2[address & (WRAM2_SIZE - 1)];
+		case 0x04:
+			if ((address & 0xFFFFFF) < IO_SIZE) {
+				return &memory->io[address & (IO_SIZE - 1)];
+			}
+			return NULL;
+		case 0x05:
+			return &memory->bg_obj_palette_ram[address & (PALETTE_SIZE - 1)];
+		case 0x06: {
+			// 96 KBytes mirrored in 128 KByte steps, the upper 32 KBytes mirror the last 32 KBytes
+			uint32_t offset = address & 0x1FFFF;
+
+			if (offset >= VRAM_SIZE) {
+				offset -= 0x8000;
+			}
+			return &memory->vram[offset];
+		}
+		case 0x07:
+			return &memory->obj_attributes[address & (OAM_SIZE - 1)];
+		case 0x08: case 0x09:	// wait state 0
+		case 0x0A: case 0x0B:	// wait state 1
+		case 0x0C: case 0x0D:	// wait state 2
+			return &memory->rom[address & (ROM_SIZE - 1)];
+		default:
+			return NULL;
+	}
+}
 
-    // fetches the 4 bytes at pc
-    uint32_t  instruction = *(unsigned int *)&memory->rom[pc - 0x08000000];
+/*
+    Save memory isn't in memory_pointer, it is a chip on an 8 bit bus. It is only
+    checked once the address turned out to be unmapped, wider reads see the byte
+    repeated and wider writes store the low byte.
+*/
+static inline int backup_address(Memory *memory, uint32_t address) {
+	return memory->backup != NULL && (address >> 25) == (0x0E >> 1);
+}
 
-    return instruction;
+uint8_t fetch_memory(Memory *memory, uint32_t address) {
+	uint8_t *pointer = memory_pointer(memory, address);
+
+	if (pointer == NULL) {
+		if (backup_address(memory, address)) {
+			return backup_read(memory->backup, address);
+		}
+
+		fprintf(stderr, "Invalid address: %.8x\n", address);
+		return 0;
+	}
+
+	return *pointer;
 }
 
-uint16_t fetch_instruction_thumb(Memory *memory, uint32_t pc) {
-    if (pc < 0x08000000 || pc > 0x09FFFFFF) {
-        fprintf(stderr, "Invalid rom pc: %d\n", pc);
-        return -1;
-    }
+uint16_t fetch_memory_halfword(Memory *memory, uint32_t address) {
+	uint8_t *pointer = memory_pointer(memory, address & ~1);
 
-    // fetches the 2 bytes at pc
-    uint16_t instruction = *(uint16_t *)&memory->rom[pc - 0x08000000];
+	if (pointer == NULL) {
+		if (backup_address(memory, address)) {
+			return backup_read(memory->backup, address) * 0x0101;
+		}
 
-    return instruction;
+		fprintf(stderr, "Invalid address: %.8x\n", address);
+		return 0;
+	}
+
+	return *(uint16_t *)pointer;
 }
 
+uint32_t fetch_memory_word(Memory *memory, uint32_t address) {
+	uint8_t *pointer = memory_pointer(memory, address & ~3);
 
-// Setup ARM instructions
+	if (pointer == NULL) {
+		if (backup_address(memory, address)) {
+			return backup_read(memory->backup, address) * 0x01010101;
+		}
 
+		fprintf(stderr, "Invalid address: %.8x\n", address);
+		return 0;
+	}
 
-// Data processing
-/*
-    Create an array where each element is a poitner to a function that does a specific operation on regsiters.
+	return *(uint32_t *)pointer;
+}
 
+/*
+    io registers with side effects on write. Everything else is plain storage.
 */
+static void store_io_halfword(Memory *memory, uint32_t offset, uint16_t value) {
+	if (memory->apu != NULL && offset >= IO_SOUND1CNT_L && offset < IO_APU_END) {
+		apu_write(memory->apu, offset, value);
+	}
 
-void update_carry_boolean(int *dest, PSR *cpsr) {
-    cpsr->n = (*dest < 0);
-    cpsr->z = (*dest == 0);
-    cpsr->c = 0;
-    cpsr->v = 0;
+	switch (offset) {
+		case IO_KEYINPUT:
+			// read only
+			return;
+		case IO_IF:
+			// writing a 1 acknowledges (clears) the interrupt
+			*(uint16_t *)&memory->io[offset] &= ~value;
+			return;
+		default:
+			*(uint16_t *)&memory->io[offset] = value;
+			return;
+	}
 }
 
-// 0000
-void AND(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op1 & op2;
+/*
+    Code page bitmap for a wram address (0x02 or 0x03 only), page is the bit index.
+*/
+static inline uint32_t *code_page_bitmap(Memory *memory, uint32_t address, uint32_t *page) {
+	if ((address >> 24) == 0x02) {
+		*page = (address & (WRAM1_SIZE - 1)) >> CODE_PAGE_SHIFT;
+		return memory->wram1_code_pages;
+	}
 
-    if (update_flags) {
-        update_carry_boolean(dest, cpsr);
-    }
+	*page = (address & (WRAM2_SIZE - 1)) >> CODE_PAGE_SHIFT;
+	return memory->wram2_code_pages;
 }
 
-// 0001
-void EOR(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op1 ^ op2;
+// called by the interpreter for every wram block it caches
+void mark_code_pages(Memory *memory, uint32_t start, uint32_t end) {
+	uint32_t page_size = 1 << CODE_PAGE_SHIFT;
 
-    if (update_flags) {
-        update_carry_boolean(dest, cpsr);
-    }
-}
+	for (uint32_t address = start & ~(page_size - 1); address < end; address += page_size) {
+		uint8_t region = address >> 24;
 
-// 0010
-void SUB(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op1 - op2;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = op1 >= op2;
-        cpsr->v = (op1 >= 0 && op2 <= 0 && *dest < 0) | (op1 <= 0 && op2 >= 0 && *dest > 0);
-    }
-}
+		if (region != 0x02 && region != 0x03) {
+			continue;
+		}
 
-// 0011
-void RSB(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op2 - op1;
-
-    // TODO, check if this logic is correct (Carry)
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = op2 >= op1;
-        cpsr->v = (op1 >= 0 && op2 <= 0 && *dest < 0) | (op1 <= 0 && op2 >= 0 && *dest > 0);
-    }
+		uint32_t page;
+		uint32_t *bitmap = code_page_bitmap(memory, address, &page);
+		bitmap[page / 32] |= 1u << (page % 32);
+	}
 }
 
-// 0100
-void ADD(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    uint64_t temp = op1 + op2;
-    // should cast nicely
-    *dest = temp;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = (temp >> 32) & 0x1;
-        cpsr->v = (op1 > 0 && op2 > 0 && *dest < 0) | (op1 < 0 && op2 < 0 && *dest > 0);
-    }
-}
+/*
+    Every wram store pays one bit test. Only the first store to a page with cached code
+    does anything, after that the page is unmarked until code is cached in it again.
+*/
+static inline void check_code_write(Memory *memory, uint32_t address) {
+	uint32_t page;
+	uint32_t *bitmap = code_page_bitmap(memory, address, &page);
+	uint32_t bit = 1u << (page % 32);
 
-// 0101
-void ADC(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    uint64_t temp = op1 + op2 + cpsr->c;
-    *dest = temp;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = (temp >> 32) & 0x1;
-        cpsr->v = (op1 > 0 && op2 > 0 && *dest < 0) | (op1 < 0 && op2 < 0 && *dest > 0);
-    }
-}
+	if (!(bitmap[page / 32] & bit)) {
+		return;
+	}
 
-// 0110
-void SBC(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op1 - op2 + cpsr->c - 1;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = op1 >= (op2 + cpsr->c - 1);
-        cpsr->v = (op1 >= 0 && op2 <= 0 && *dest < 0) | (op1 <= 0 && op2 >= 0 && *dest > 0);
-    }
+	bitmap[page / 32] &= ~bit;
+
+	uint32_t start = (address & 0xFF000000) | (page << CODE_PAGE_SHIFT);
+	uint32_t end = start + (1 << CODE_PAGE_SHIFT);
+
+	if (!memory->code_written) {
+		memory->code_written = 1;
+		memory->code_written_start = start;
+		memory->code_written_end = end;
+		return;
+	}
+
+	if (start < memory->code_written_start) {
+		memory->code_written_start = start;
+	}
+
+	if (end > memory->code_written_end) {
+		memory->code_written_end = end;
+	}
 }
 
-// 0111
-void RSC(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op2 - op1 + cpsr->c - 1;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = op2 >= (op1 + cpsr->c - 1);
-        cpsr->v = (op1 >= 0 && op2 <= 0 && *dest < 0) | (op1 <= 0 && op2 >= 0 && *dest > 0);
-    }
+// for writes to wram that don't go through the store functions (RegisterRamReset)
+void code_pages_written(Memory *memory, uint32_t start, uint32_t size) {
+	for (uint32_t address = start; address < start + size; address += 1 << CODE_PAGE_SHIFT) {
+		check_code_write(memory, address);
+	}
 }
 
-// 1000
-void TST(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    UNUSED(dest), UNUSED(update_flags);
-    int temp = op1 & op2;
+_Static_assert(offsetof(Memory, obj_attributes) + OAM_SIZE - offsetof(Memory, wram1) == STATE_PAGES << STATE_PAGE_SHIFT,
+			   "the hashed regions have to be back to back");
 
-    cpsr->n = (temp < 0);
-    cpsr->z = (temp== 0);
-    // other flags not updated
+// pointer has to be in wram1-oam
+static inline void mark_state_page(Memory *memory, const uint8_t *pointer) {
+	uint32_t page = (pointer - memory->wram1) >> STATE_PAGE_SHIFT;
+	memory->state_dirty_pages[page / 64] |= 1ull << (page % 64);
 }
 
-// 1001
-void TEQ(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    UNUSED(dest), UNUSED(update_flags);
-    int temp = op1 ^ op2;
+// for writes that don't go through the store functions
+void mark_state_pages(Memory *memory, const uint8_t *start, uint32_t size) {
+	uint32_t first = (start - memory->wram1) >> STATE_PAGE_SHIFT;
+	uint32_t last = (start + size - 1 - memory->wram1) >> STATE_PAGE_SHIFT;
 
-    cpsr->n = (temp < 0);
-    cpsr->z = (temp == 0);
-    // other flags not updated
+	for (uint32_t page = first; page <= last; page++) {
+		memory->state_dirty_pages[page / 64] |= 1ull << (page % 64);
+	}
 }
 
-// 1010
-void CMP(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    UNUSED(dest), UNUSED(update_flags);
-    int temp = op1 - op2;
+/*
+    Video memory (display registers, palette, vram, oam) is also written to the ppu's
+    log. The value is read back from memory so it is whatever the store ended up doing.
+*/
+static inline void log_video_write(Memory *memory, uint32_t address, uint8_t *pointer, uint8_t size) {
+	if (memory->ppu == NULL) {
+		return;
+	}
 
-    cpsr->n = (temp < 0);
-    cpsr->z = (temp == 0);
-    cpsr->c = op1 >= op2;
-    cpsr->v = (op1 >= 0 && op2 <= 0 && *dest < 0) | (op1 <= 0 && op2 >= 0 && *dest > 0);
+	if ((address >> 24) == 0x04 && (address & (IO_SIZE - 1)) >= IO_DISPLAY_SIZE) {
+		return;
+	}
+
+	ppu_log_write(memory->ppu, address, size == 4 ? *(uint32_t *)pointer : *(uint16_t *)pointer, size);
 }
 
-// 1011
-void CMN(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    UNUSED(dest), UNUSED(update_flags);
-    uint64_t temp = op1 + op2;
-    uint32_t real_temp = temp;
+void store_memory(Memory *memory, uint32_t address, uint8_t value) {
+	uint8_t *pointer = memory_pointer(memory, address);
 
-    cpsr->n = (real_temp < 0);
-    cpsr->z = (real_temp == 0);
-    cpsr->c = (temp >> 32) & 0x1;
-    cpsr->v = (op1 > 0 && op2 > 0 && real_temp < 0) | (op1 < 0 && op2 < 0 && temp > 0);
+	if (pointer == NULL) {
+		if (backup_address(memory, address)) {
+			backup_write(memory->backup, address, value);
+		}
+
+		return;
+	}
+
+	switch (address >> 24) {
+		case 0x04: {
+			uint32_t offset = address & (IO_SIZE - 1);
+
+			if (offset == IO_HALTCNT) {
+				memory->halt_requested = 1;
+				return;
+			}
+
+			uint16_t halfword = *(uint16_t *)&memory->io[offset & ~1];
+			uint8_t shift = (offset & 1) * 8;
+			halfword = (halfword & ~(0xFF << shift)) | (value << shift);
+
+			// IF only clears the bits that are written
+			if ((offset & ~1) == IO_IF) {
+				halfword = value << shift;
+			}
+
+			store_io_halfword(memory, offset & ~1, halfword);
+			log_video_write(memory, address & ~1, &memory->io[offset & ~1], 2);
+			return;
+		}
+		case 0x05:
+		case 0x06:
+			// 8 bit writes to palette and vram write the value to both bytes of the halfword
+			pointer = (uint8_t *)((uintptr_t)pointer & ~(uintptr_t)1);
+			*(uint16_t *)pointer = value | (value << 8);
+			mark_state_page(memory, pointer);
+			log_video_write(memory, address & ~1, pointer, 2);
+			return;
+		case 0x07:
+		case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
+			// 8 bit writes to OAM are ignored, rom is read only
+			return;
+		case 0x02:
+		case 0x03:
+			*pointer = value;
+			mark_state_page(memory, pointer);
+			check_code_write(memory, address);
+			return;
+		default:
+			// the bios is read only
+			return;
+	}
 }
 
-// 1100
-void ORR(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op1 | op2;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        cpsr->c = 0;
-        cpsr->v = 0;
-    }
+void store_memory_halfword(Memory *memory, uint32_t address, uint16_t value) {
+	address &= ~1;
+
+	uint8_t *pointer = memory_pointer(memory, address);
+
+	if (pointer == NULL) {
+		if (backup_address(memory, address)) {
+			backup_write(memory->backup, address, value);
+		}
+
+		return;
+	}
+
+	// the bios and rom are read only
+	if ((address >> 24) >= 0x08 || (address >> 24) == 0x00) {
+		return;
+	}
+
+	if ((address >> 24) == 0x04) {
+		if ((address & (IO_SIZE - 1)) == (IO_HALTCNT & ~1)) {
+			memory->halt_requested = 1;
+		}
+
+		store_io_halfword(memory, address & (IO_SIZE - 1), value);
+		log_video_write(memory, address, pointer, 2);
+		return;
+	}
+
+	*(uint16_t *)pointer = value;
+
+	if ((address >> 24) >= 0x02) {
+		mark_state_page(memory, pointer);
+	}
+
+	if ((address >> 24) >= 0x05) {
+		log_video_write(memory, address, pointer, 2);
+	}
+
+	if ((address >> 24) == 0x02 || (address >> 24) == 0x03) {
+		check_code_write(memory, address);
+	}
 }
 
-// 1101
-void MOV(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    UNUSED(op1);
-    *dest = op2;
-
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        // other flags not effected
-    }
+void store_memory_word(Memory *memory, uint32_t address, uint32_t value) {
+	address &= ~3;
+
+	if ((address >> 24) == 0x04) {
+		store_memory_halfword(memory, address, value & 0xFFFF);
+		store_memory_halfword(memory, address + 2, value >> 16);
+		return;
+	}
+
+	uint8_t *pointer = memory_pointer(memory, address);
+
+	if (pointer == NULL) {
+		if (backup_address(memory, address)) {
+			backup_write(memory->backup, address, value);
+		}
+
+		return;
+	}
+
+	// the bios and rom are read only
+	if ((address >> 24) >= 0x08 || (address >> 24) == 0x00) {
+		return;
+	}
+
+	*(uint32_t *)pointer = value;
+
+	if ((address >> 24) >= 0x02) {
+		mark_state_page(memory, pointer);
+	}
+
+	if ((address >> 24) == 0x02 || (address >> 24) == 0x03) {
+		check_code_write(memory, address);
+	} else if ((address >> 24) >= 0x05) {
+		log_video_write(memory, address, pointer, 4);
+	}
 }
 
-// 1110
-void BIC(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    *dest = op1 & ~op2;
+uint32_t fetch_instruction_arm(Memory *memory, uint32_t pc) {
+    uint8_t *pointer = memory_pointer(memory, pc & ~3);
 
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        // other flags not effected
+    if (pointer == NULL) {
+        fprintf(stderr, "Invalid pc: %.8x\n", pc);
+        return -1;
     }
+
+    // fetches the 4 bytes at pc
+    uint32_t  instruction = *(uint32_t *)pointer;
+
+    return instruction;
 }
 
-// 1111
-void MVN(int op1, int *dest, int op2, PSR *cpsr, int update_flags) {
-    UNUSED(op1);
-    *dest = ~op2;
+uint16_t fetch_instruction_thumb(Memory *memory, uint32_t pc) {
+    uint8_t *pointer = memory_pointer(memory, pc & ~1);
 
-    if (update_flags) {
-        cpsr->n = (*dest < 0);
-        cpsr->z = (*dest == 0);
-        // other flags not effected
+    if (pointer == NULL) {
+        fprintf(stderr, "Invalid pc: %.8x\n", pc);
+        return -1;
     }
+
+    // fetches the 2 bytes at pc
+    uint16_t instruction = *(uint16_t *)pointer;
+
+    return instruction;
 }
+
+
+// ARM data processing is in alu.c
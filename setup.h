@@ -1,7 +1,41 @@
 #ifndef SETUP_H
 #define SETUP_H
 #include <stdint.h>
-#define ROM_SIZE 32 * 1024 * 1024
+#define ROM_SIZE (32 * 1024 * 1024)
+#define BIOS_SIZE (16 * 1024)
+#define WRAM1_SIZE (256 * 1024)
+#define WRAM2_SIZE (32 * 1024)
+#define IO_SIZE 1024
+#define PALETTE_SIZE 1024
+#define VRAM_SIZE (96 * 1024)
+#define OAM_SIZE 1024
+
+// io register offsets (relative to 0x04000000)
+#define IO_DISPCNT 0x000
+#define IO_DISPSTAT 0x004
+#define IO_VCOUNT 0x006
+#define IO_KEYINPUT 0x130
+#define IO_IE 0x200
+#define IO_IF 0x202
+#define IO_IME 0x208
+#define IO_HALTCNT 0x301
+
+/*
+    Self modifying code detection. wram1 and wram2 are split into 256 byte pages with
+    one bit per page that is set while cached code lives in it. A store to a marked
+    page clears the bit and records the write so the interpreter can drop the blocks.
+*/
+#define CODE_PAGE_SHIFT 8
+#define WRAM1_CODE_PAGES (WRAM1_SIZE >> CODE_PAGE_SHIFT)
+#define WRAM2_CODE_PAGES (WRAM2_SIZE >> CODE_PAGE_SHIFT)
+
+/*
+    State hash pages. wram1 up to the end of oam is one block in Memory (wram1, wram2,
+    io, palette, vram, oam, all 1 KByte multiples), split into 1 KByte pages with one
+    dirty bit per page that every store sets. See state.c.
+*/
+#define STATE_PAGE_SHIFT 10
+#define STATE_PAGES ((WRAM1_SIZE + WRAM2_SIZE + IO_SIZE + PALETTE_SIZE + VRAM_SIZE + OAM_SIZE) >> STATE_PAGE_SHIFT)
 
 typedef struct ProgramStatusRegister {
 	unsigned int m0: 	1;
@@ -19,26 +53,64 @@ typedef struct ProgramStatusRegister {
 	unsigned int n: 	1;
 } PSR;
 
+/*
+    Memory comes from memory_create. The bios and rom are read only and live outside
+    of it: one bios for every instance, and the rom a private mapping of the file, so
+    instances running the same rom share its pages through the page cache (a cheat
+    patch copies just the page it writes). What is left is about 400 KBytes per
+    instance, handed out by the arena (arena.h), every region starting on a cache line.
+*/
 typedef struct {
 
+uint8_t *bios;											// 0x00000000-0x00003FFF 16 	KBytes, shared
+uint8_t *rom;											// 0x08000000-0x09FFFFFF 32     MB reserved, read only
+uint32_t rom_size;										// bytes mapped from the file, page rounded
+
 // General Internal Memory
-uint8_t bios[16 * 1024]; 								// 0x00000000-0x00003FFF 16 	KBytes
-uint8_t wram1[256 * 1024]; 							    // 0x02000000-0x0203FFFF 256 	KBytes
-uint8_t wram2[32 * 1024];								// 0x03000000-0x03007FFF 32 	KBytes
-uint8_t io[1024];										// 0x04000000-0x040003FE 1		KByte
+_Alignas(64) uint8_t wram1[256 * 1024]; 				// 0x02000000-0x0203FFFF 256 	KBytes
+_Alignas(64) uint8_t wram2[32 * 1024];					// 0x03000000-0x03007FFF 32 	KBytes
+_Alignas(64) uint8_t io[1024];							// 0x04000000-0x040003FE 1		KByte
 
 
 // Internal Display Memory
-uint8_t bg_obj_palette_ram[1024]; 			            // 0x05000000-0x050003FF 1		KByte
-uint8_t vram[96 * 1024];								// 0x06000000-0x06017FFF 96		KBytes
-uint8_t obj_attributes[1024];						    // 0x07000000-0x070003FF 1		KByte
-uint8_t	rom[ROM_SIZE];									// 0x08000000-0x09FFFFFF 32     MB
+_Alignas(64) uint8_t bg_obj_palette_ram[1024]; 			// 0x05000000-0x050003FF 1		KByte
+_Alignas(64) uint8_t vram[96 * 1024];					// 0x06000000-0x06017FFF 96		KBytes
+_Alignas(64) uint8_t obj_attributes[1024];				// 0x07000000-0x070003FF 1		KByte
+
+uint8_t halt_requested;									// set by a write to HALTCNT
+
+// code page bitmaps, see CODE_PAGE_SHIFT
+uint32_t wram1_code_pages[WRAM1_CODE_PAGES / 32];
+uint32_t wram2_code_pages[WRAM2_CODE_PAGES / 32];
+uint8_t code_written;									// a marked page was written since the last check
+uint32_t code_written_start;							// range of the written pages
+uint32_t code_written_end;
+
+uint64_t state_dirty_pages[(STATE_PAGES + 63) / 64];	// see STATE_PAGE_SHIFT
+
+struct PPU *ppu;										// gets every write to video memory if set, see ppu.h
+struct APU *apu;										// gets every write to the sound, DMA1/2 and timer registers if set
+struct Backup *backup;									// save memory at 0x0E000000-0x0FFFFFFF if set, see backup.h
 } Memory;
 
 extern int registers[16];
 extern int (*condition_codes[15])(PSR *);
 
+Memory *memory_create(int huge_pages);
+int memory_map_rom(Memory *memory, const char *path);
+int memory_copy_rom(Memory *memory, const void *data, uint32_t size);
+void memory_rom_writable(Memory *memory, uint32_t offset, uint32_t size);
+void memory_destroy(Memory *memory);
+uint8_t *memory_pointer(Memory *memory, uint32_t address);
 uint8_t fetch_memory(Memory *memory, uint32_t address);
+uint16_t fetch_memory_halfword(Memory *memory, uint32_t address);
+uint32_t fetch_memory_word(Memory *memory, uint32_t address);
+void store_memory(Memory *memory, uint32_t address, uint8_t value);
+void store_memory_halfword(Memory *memory, uint32_t address, uint16_t value);
+void store_memory_word(Memory *memory, uint32_t address, uint32_t value);
+void mark_code_pages(Memory *memory, uint32_t start, uint32_t end);
+void code_pages_written(Memory *memory, uint32_t start, uint32_t size);
+void mark_state_pages(Memory *memory, const uint8_t *start, uint32_t size);
 uint32_t fetch_instruction_arm(Memory *memory, uint32_t address);
 uint16_t fetch_instruction_thumb(Memory *memory, uint32_t address);
 
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "setup.h"
+#include "libgba.h"
+#include "shm_export.h"
+
+#define EXPORT_PAGE 4096
+
+static uint32_t page_align(uint32_t size) {
+    return (size + EXPORT_PAGE - 1) & ~(EXPORT_PAGE - 1);
+}
+
+Export *export_create(const char *name, int state_views) {
+    Export *export = calloc(1, sizeof(Export));
+
+    if (export == NULL) {
+        fprintf(stderr, "Could not allocate the export\n");
+        return NULL;
+    }
+
+    // header, framebuffer and then the optional views, each on its own page
+    uint32_t framebuffer_offset = EXPORT_PAGE;
+    uint32_t size = framebuffer_offset + page_align(GBA_SCREEN_WIDTH * GBA_SCREEN_HEIGHT * 4);
+    uint32_t wram1_offset = 0, wram2_offset = 0, io_offset = 0;
+
+    if (state_views) {
+        wram1_offset = size;
+        size += page_align(WRAM1_SIZE);
+        wram2_offset = size;
+        size += page_align(WRAM2_SIZE);
+        io_offset = size;
+        size += page_align(IO_SIZE);
+    }
+
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Could not open shared memory %s\n", name);
+        free(export);
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        fprintf(stderr, "Could not resize shared memory %s\n", name);
+        close(fd);
+        shm_unlink(name);
+        free(export);
+        return NULL;
+    }
+
+    uint8_t *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Could not map shared memory %s\n", name);
+        shm_unlink(name);
+        free(export);
+        return NULL;
+    }
+
+    snprintf(export->name, sizeof(export->name), "%s", name);
+    export->base = base;
+    export->size = size;
+    export->header = (ExportHeader *)base;
+
+    ExportHeader *header = export->header;
+    memset(header, 0, sizeof(ExportHeader));
+    memcpy(header->magic, EXPORT_MAGIC, sizeof(header->magic));
+    header->version = EXPORT_VERSION;
+    header->size = size;
+    header->width = GBA_SCREEN_WIDTH;
+    header->height = GBA_SCREEN_HEIGHT;
+    header->framebuffer_offset = framebuffer_offset;
+    header->wram1_offset = wram1_offset;
+    header->wram2_offset = wram2_offset;
+    header->io_offset = io_offset;
+    atomic_store_explicit(&header->sequence, 0, memory_order_release);
+
+    return export;
+}
+
+// called between frames, framebuffer is NULL if no new frame was rendered since the last call
+void export_frame(Export *export, GBA *gba, const uint32_t *framebuffer, uint64_t rendered) {
+    ExportHeader *header = export->header;
+    uint64_t sequence = atomic_load_explicit(&header->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&header->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (framebuffer != NULL) {
+        memcpy(export->base + header->framebuffer_offset, framebuffer, GBA_SCREEN_WIDTH * GBA_SCREEN_HEIGHT * 4);
+        header->rendered = rendered;
+    }
+
+    if (header->wram1_offset != 0) {
+        memcpy(export->base + header->wram1_offset, gba_memory_region(gba, GBA_REGION_WRAM1, NULL), WRAM1_SIZE);
+        memcpy(export->base + header->wram2_offset, gba_memory_region(gba, GBA_REGION_WRAM2, NULL), WRAM2_SIZE);
+        memcpy(export->base + header->io_offset, gba_memory_region(gba, GBA_REGION_IO, NULL), IO_SIZE);
+    }
+
+    header->frame = gba_frame(gba);
+    atomic_store_explicit(&header->sequence, sequence + 2, memory_order_release);
+}
+
+// the name is removed, readers that still have it mapped keep the last frame
+void export_destroy(Export *export) {
+    if (export == NULL) {
+        return;
+    }
+
+    munmap(export->base, export->size);
+    shm_unlink(export->name);
+    free(export);
+}
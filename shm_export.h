@@ -0,0 +1,56 @@
+#ifndef SHM_EXPORT_H
+#define SHM_EXPORT_H
+#include <stdint.h>
+#include <stdatomic.h>
+#include "setup.h"
+#include "libgba.h"
+
+/*
+    Frame export through a POSIX shared memory segment (shm_open name, e.g. "/gba").
+
+    The segment starts with an ExportHeader, the regions follow at the offsets in it,
+    each on its own page. The emulator writes it under a seqlock at the end of every
+    frame, the framebuffer only when the ppu has finished a new one (skipped frames
+    leave the last one), readers map the segment read only and use the data in place:
+
+        do {
+            start = atomic_load_explicit(&header->sequence, memory_order_acquire);
+            ... read what you need (skip if start is odd) ...
+            atomic_thread_fence(memory_order_acquire);
+        } while ((start & 1) || atomic_load_explicit(&header->sequence, memory_order_relaxed) != start);
+
+    sequence / 2 is the number of times it was written. The ppu isn't waited for, so
+    the framebuffer can be older than the views, rendered says which one it is.
+*/
+
+#define EXPORT_MAGIC "GBAEXPT"
+#define EXPORT_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;                          // of the whole segment
+    uint32_t width;                         // framebuffer is width * height 0xAABBGGRR pixels
+    uint32_t height;
+    uint32_t framebuffer_offset;
+    uint32_t wram1_offset;                  // 0 when the state views aren't exported
+    uint32_t wram2_offset;
+    uint32_t io_offset;
+
+    _Alignas(64) _Atomic uint64_t sequence; // odd while a frame is being written
+    uint64_t frame;                         // emulated frame number of the views
+    uint64_t rendered;                      // rendered frame number of the framebuffer, 0 for none yet
+} ExportHeader;
+
+typedef struct {
+    char name[64];
+    ExportHeader *header;
+    uint8_t *base;
+    uint32_t size;
+} Export;
+
+Export *export_create(const char *name, int state_views);
+void export_frame(Export *export, GBA *gba, const uint32_t *framebuffer, uint64_t rendered);
+void export_destroy(Export *export);
+
+#endif
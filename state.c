@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "setup.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "state.h"
+
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ull
+
+static inline uint64_t mix(uint64_t value) {
+    value ^= value >> 32;
+    value *= 0xD6E8FEB86659FD93ull;
+    value ^= value >> 32;
+    return value;
+}
+
+// 8 bytes at a time, size is a multiple of 8 for everything hashed here
+static uint64_t hash_bytes(uint64_t seed, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    uint64_t hash = seed ^ (size * HASH_MULTIPLIER);
+
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = mix(hash ^ word) + HASH_MULTIPLIER;
+    }
+
+    return mix(hash);
+}
+
+static uint64_t hash_cpu(CPU *cpu) {
+    uint32_t context[16 + 2 + BANK_COUNT * 3 + 10 + 2];
+    uint32_t *out = context;
+
+    memcpy(out, cpu->registers, sizeof(cpu->registers));
+    out += 16;
+    *out++ = psr_to_word(cpu->cpsr);
+    *out++ = psr_to_word(cpu->spsr);
+
+    for (int i = 0; i < BANK_COUNT; i++) {
+        *out++ = cpu->banked_r13[i];
+        *out++ = cpu->banked_r14[i];
+        *out++ = psr_to_word(cpu->banked_spsr[i]);
+    }
+
+    memcpy(out, cpu->banked_fiq_registers, sizeof(cpu->banked_fiq_registers));
+    out += 5;
+    memcpy(out, cpu->banked_user_registers, sizeof(cpu->banked_user_registers));
+    out += 5;
+    *out++ = cpu->halted | (cpu->intr_wait << 8) | (cpu->scheduler.next_event_type << 16);
+    *out++ = cpu->scheduler.vcount;
+
+    uint64_t hash = hash_bytes(0, context, sizeof(context));
+    hash = mix(hash ^ cpu->scheduler.cycles) + HASH_MULTIPLIER;
+    hash = mix(hash ^ cpu->scheduler.next_event) + HASH_MULTIPLIER;
+
+    return mix(hash ^ cpu->scheduler.frame);
+}
+
+StateHash *state_hash_create(void) {
+    return calloc(1, sizeof(StateHash));
+}
+
+static void rehash_page(StateHash *state, Memory *memory, uint32_t page) {
+    uint64_t hash = hash_bytes(page, memory->wram1 + (page << STATE_PAGE_SHIFT), 1 << STATE_PAGE_SHIFT);
+
+    state->memory_hash += hash - state->page_hashes[page];
+    state->page_hashes[page] = hash;
+    state->pages_hashed++;
+}
+
+// clears the dirty bits, so there should be one StateHash per Memory
+uint64_t state_hash(StateHash *state, CPU *cpu, Memory *memory) {
+    uint64_t *dirty = memory->state_dirty_pages;
+    uint32_t words = (STATE_PAGES + 63) / 64;
+
+    if (!state->primed) {
+        memset(dirty, 0xFF, words * sizeof(uint64_t));
+        dirty[words - 1] = ~0ull >> (words * 64 - STATE_PAGES);
+        state->primed = 1;
+    }
+
+    mark_state_pages(memory, memory->io, IO_SIZE);
+
+    for (uint32_t i = 0; i < words; i++) {
+        for (uint64_t bits = dirty[i]; bits; bits &= bits - 1) {
+            rehash_page(state, memory, i * 64 + __builtin_ctzll(bits));
+        }
+
+        dirty[i] = 0;
+    }
+
+    return mix(hash_cpu(cpu) ^ state->memory_hash);
+}
+
+// the frame is host side so it isn't in state_hash, compare it separately
+uint64_t framebuffer_hash(const uint32_t *framebuffer) {
+    return hash_bytes(0, framebuffer, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+}
+
+void state_hash_destroy(StateHash *state) {
+    free(state);
+}
@@ -0,0 +1,33 @@
+#ifndef STATE_H
+#define STATE_H
+#include <stdint.h>
+#include "setup.h"
+#include "cpu.h"
+
+/*
+    64 bit digest of the emulated machine: the cpu (registers, banked registers,
+    psrs, halt state), the scheduler's position and wram1, wram2, io, palette, vram
+    and oam. Two runs with the same digest at a frame are in the same state as far as
+    the game can tell. Host side things (caches, the ppu's copy of video memory, the
+    framebuffer) and save memory aren't in it.
+
+    Memory is hashed per STATE_PAGE_SHIFT page. The store functions mark the pages they
+    write (Memory.state_dirty_pages) and state_hash only rehashes those, plus io which
+    the scheduler writes directly. Each page hash is seeded with its index and the
+    memory hash is their sum, so it is updated by swapping a page's old hash for its
+    new one. Cheap enough to call every frame.
+*/
+
+typedef struct {
+    uint64_t page_hashes[STATE_PAGES];
+    uint64_t memory_hash;               // sum of page_hashes
+    uint8_t primed;                     // page_hashes are filled in
+    uint64_t pages_hashed;
+} StateHash;
+
+StateHash *state_hash_create(void);
+uint64_t state_hash(StateHash *state, CPU *cpu, Memory *memory);
+void state_hash_destroy(StateHash *state);
+uint64_t framebuffer_hash(const uint32_t *framebuffer);
+
+#endif
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "setup.h"
+#include "cpu.h"
+#include "trace.h"
+
+static inline uint8_t *put_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    *out++ = value;
+    return out;
+}
+
+static inline uint32_t zigzag(uint32_t delta) {
+    return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static inline uint32_t rotate_left(uint32_t value, uint8_t amount) {
+    return (value << amount) | (value >> (32 - amount));
+}
+
+static void put_uint32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (i * 8);
+    }
+}
+
+// Compression
+
+/*
+    LZ77 with a 64 KByte window. A sequence is a token (literal count in the high
+    nibble, match length - 4 in the low one, 15 means more length bytes follow, each
+    added until one isn't 255), the literals, a 2 byte offset and the extra match
+    length bytes. The last sequence is only literals.
+*/
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 16
+#define LZ_WINDOW 65535
+
+uint32_t trace_compress_bound(uint32_t size) {
+    return size + size / 255 + 16;
+}
+
+static inline uint32_t lz_hash(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *out, uint32_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+
+    *out++ = length;
+    return out;
+}
+
+static uint8_t *put_sequence(uint8_t *out, const uint8_t *literals, uint32_t literal_count, uint32_t offset, uint32_t match_length) {
+    uint32_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+    *out++ = ((literal_count < 15 ? literal_count : 15) << 4) | (match_code < 15 ? match_code : 15);
+
+    if (literal_count >= 15) {
+        out = put_length(out, literal_count - 15);
+    }
+
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    if (match_length == 0) {
+        return out;
+    }
+
+    *out++ = offset & 0xFF;
+    *out++ = offset >> 8;
+
+    if (match_code >= 15) {
+        out = put_length(out, match_code - 15);
+    }
+
+    return out;
+}
+
+// output has to hold trace_compress_bound(size) bytes, returns the compressed size
+uint32_t trace_compress(const uint8_t *input, uint32_t size, uint8_t *output) {
+    static _Thread_local uint32_t table[1 << LZ_HASH_BITS];     // position + 1 of the last 4 bytes with a hash
+    uint8_t *out = output;
+    uint32_t literal_start = 0;
+    uint32_t position = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (position + LZ_MIN_MATCH <= size) {
+        uint32_t hash = lz_hash(input + position);
+        uint32_t candidate = table[hash];
+        table[hash] = position + 1;
+
+        if (candidate == 0 || position - (candidate - 1) > LZ_WINDOW ||
+            memcmp(input + candidate - 1, input + position, LZ_MIN_MATCH) != 0) {
+            position++;
+            continue;
+        }
+
+        candidate--;
+
+        uint32_t length = LZ_MIN_MATCH;
+
+        while (position + length < size && input[candidate + length] == input[position + length]) {
+            length++;
+        }
+
+        out = put_sequence(out, input + literal_start, position - literal_start, position - candidate, length);
+        position += length;
+        literal_start = position;
+    }
+
+    out = put_sequence(out, input + literal_start, size - literal_start, 0, 0);
+
+    return out - output;
+}
+
+static int get_length(const uint8_t **in, const uint8_t *end, uint32_t *length) {
+    uint8_t byte;
+
+    do {
+        if (*in == end) {
+            return -1;
+        }
+
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+// returns 0 if input decompresses to exactly output_size bytes, -1 if it is broken
+int trace_decompress(const uint8_t *input, uint32_t size, uint8_t *output, uint32_t output_size) {
+    const uint8_t *in = input;
+    const uint8_t *end = input + size;
+    uint32_t position = 0;
+
+    while (in < end) {
+        uint8_t token = *in++;
+        uint32_t literal_count = token >> 4;
+
+        if (literal_count == 15 && get_length(&in, end, &literal_count) != 0) {
+            return -1;
+        }
+
+        if ((uint32_t)(end - in) < literal_count || output_size - position < literal_count) {
+            return -1;
+        }
+
+        memcpy(output + position, in, literal_count);
+        in += literal_count;
+        position += literal_count;
+
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+
+        uint32_t offset = in[0] | (in[1] << 8);
+        uint32_t length = token & 0xF;
+        in += 2;
+
+        if (length == 15 && get_length(&in, end, &length) != 0) {
+            return -1;
+        }
+
+        length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > position || output_size - position < length) {
+            return -1;
+        }
+
+        // byte by byte, a match can overlap what it produces
+        for (uint32_t i = 0; i < length; i++, position++) {
+            output[position] = output[position - offset];
+        }
+    }
+
+    return position == output_size ? 0 : -1;
+}
+
+// Writer thread
+
+static void *trace_thread(void *argument) {
+    Trace *trace = argument;
+
+    for (;;) {
+        uint8_t stopping = atomic_load_explicit(&trace->stopping, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+        if (tail == atomic_load_explicit(&trace->head, memory_order_acquire)) {
+            if (stopping) {
+                return NULL;
+            }
+
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        uint32_t index = tail & (TRACE_BUFFERS - 1);
+        uint32_t size = trace_compress(trace->buffers[index], trace->sizes[index], trace->compressed);
+        uint8_t header[8];
+
+        put_uint32(header, trace->sizes[index]);
+        put_uint32(header + 4, size);
+        fwrite(header, 1, sizeof(header), trace->file);
+        fwrite(trace->compressed, 1, size, trace->file);
+
+        trace->raw_bytes += trace->sizes[index];
+        trace->file_bytes += sizeof(header) + size;
+        atomic_store_explicit(&trace->tail, tail + 1, memory_order_release);
+    }
+}
+
+// CPU thread
+
+Trace *trace_create(const char *path) {
+    Trace *trace = aligned_alloc(64, sizeof(Trace));
+
+    if (trace == NULL) {
+        fprintf(stderr, "Could not allocate the trace\n");
+        return NULL;
+    }
+
+    memset(trace, 0, sizeof(Trace));
+
+    int allocated = (trace->compressed = malloc(trace_compress_bound(TRACE_BLOCK_SIZE))) != NULL;
+
+    for (int i = 0; i < TRACE_BUFFERS; i++) {
+        allocated &= (trace->buffers[i] = malloc(TRACE_BLOCK_SIZE)) != NULL;
+    }
+
+    if (!allocated) {
+        fprintf(stderr, "Could not allocate the trace buffers\n");
+        trace_destroy(trace);
+        return NULL;
+    }
+
+    trace->file = fopen(path, "wb");
+
+    if (trace->file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        trace_destroy(trace);
+        return NULL;
+    }
+
+    uint8_t header[16];
+    memcpy(header, TRACE_MAGIC, 8);
+    put_uint32(header + 8, TRACE_VERSION);
+    put_uint32(header + 12, TRACE_BLOCK_SIZE);
+    fwrite(header, 1, sizeof(header), trace->file);
+    trace->file_bytes = sizeof(header);
+
+    trace->write = trace->buffers[0];
+    trace->limit = trace->write + TRACE_BLOCK_SIZE;
+    atomic_init(&trace->stopping, 0);
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+
+    if (pthread_create(&trace->thread, NULL, trace_thread, trace) != 0) {
+        fprintf(stderr, "Could not start the trace thread\n");
+        trace_destroy(trace);
+        return NULL;
+    }
+
+    trace->thread_started = 1;
+
+    return trace;
+}
+
+// queues the current buffer, wait_for_next waits until there is a free one to continue in
+static void queue_buffer(Trace *trace, int wait_for_next) {
+    uint32_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint32_t index = head & (TRACE_BUFFERS - 1);
+
+    trace->sizes[index] = trace->write - trace->buffers[index];
+    atomic_store_explicit(&trace->head, ++head, memory_order_release);
+
+    if (!wait_for_next) {
+        return;
+    }
+
+    while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_BUFFERS) {
+        struct timespec pause = {0, 100000};
+        nanosleep(&pause, NULL);
+    }
+
+    trace->write = trace->buffers[head & (TRACE_BUFFERS - 1)];
+    trace->limit = trace->write + TRACE_BLOCK_SIZE;
+}
+
+// called by the interpreter before every instruction while tracing, address is its pc
+void trace_instruction(Trace *trace, CPU *cpu, Memory *memory, uint32_t address) {
+    if (trace->limit - trace->write < TRACE_RECORD_MAX) {
+        queue_buffer(trace, 1);
+    }
+
+    uint32_t *r = cpu->registers;
+    uint32_t cpsr = psr_to_word(cpu->cpsr);
+    uint8_t thumb = cpu->cpsr.t;
+    uint8_t *tag = trace->write;
+    uint8_t *out = tag + 1;
+
+    *tag = thumb ? TRACE_THUMB : 0;
+
+    if (tag == trace->buffers[atomic_load_explicit(&trace->head, memory_order_relaxed) & (TRACE_BUFFERS - 1)]) {
+        // first record of a block
+        *tag |= TRACE_KEY;
+        out = put_varint(out, cpu->scheduler.cycles);
+        out = put_varint(out, address);
+
+        for (int i = 0; i < 15; i++) {
+            out = put_varint(out, r[i]);
+            trace->registers[i] = r[i];
+        }
+
+        out = put_varint(out, cpsr);
+        trace->cpsr = cpsr;
+    } else if (address != trace->next_pc) {
+        *tag |= TRACE_JUMP;
+        out = put_varint(out, zigzag(address - trace->next_pc));
+    }
+
+    if (thumb) {
+        uint16_t opcode = fetch_instruction_thumb(memory, address);
+        out[0] = opcode;
+        out[1] = opcode >> 8;
+        out += 2;
+    } else {
+        put_uint32(out, fetch_instruction_arm(memory, address));
+        out += 4;
+    }
+
+    uint32_t mask = 0;
+
+    for (int i = 0; i < 15; i++) {
+        mask |= (r[i] != trace->registers[i]) << i;
+    }
+
+    if (cpsr != trace->cpsr) {
+        mask |= TRACE_CPSR_BIT;
+    }
+
+    if (mask) {
+        *tag |= TRACE_CHANGES;
+        out = put_varint(out, mask);
+
+        for (uint32_t bits = mask & ~TRACE_CPSR_BIT; bits; bits &= bits - 1) {
+            int i = __builtin_ctz(bits);
+            out = put_varint(out, zigzag(r[i] - trace->registers[i]));
+            trace->registers[i] = r[i];
+        }
+
+        if (mask & TRACE_CPSR_BIT) {
+            out = put_varint(out, rotate_left(cpsr ^ trace->cpsr, 4));
+            trace->cpsr = cpsr;
+        }
+    }
+
+    trace->write = out;
+    trace->next_pc = address + (thumb ? 2 : 4);
+    trace->records++;
+}
+
+// writes what is left, waits for the writer and closes the file
+void trace_destroy(Trace *trace) {
+    if (trace == NULL) {
+        return;
+    }
+
+    if (trace->thread_started) {
+        uint32_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+        if (trace->write != trace->buffers[head & (TRACE_BUFFERS - 1)]) {
+            queue_buffer(trace, 0);
+        }
+
+        atomic_store_explicit(&trace->stopping, 1, memory_order_release);
+        pthread_join(trace->thread, NULL);
+
+        fprintf(stderr, "trace: %llu instructions, %llu bytes of records, %llu bytes written\n",
+                (unsigned long long)trace->records, (unsigned long long)trace->raw_bytes,
+                (unsigned long long)trace->file_bytes);
+    }
+
+    if (trace->file != NULL) {
+        fclose(trace->file);
+    }
+
+    for (int i = 0; i < TRACE_BUFFERS; i++) {
+        free(trace->buffers[i]);
+    }
+
+    free(trace->compressed);
+    free(trace);
+}
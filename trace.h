@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "setup.h"
+
+struct CPU;
+
+/*
+    Binary instruction trace.
+
+    Every executed instruction (conditional ones that fail too) is one record: a tag
+    byte, the pc if it isn't the one after the previous record, the opcode and the
+    registers and cpsr that changed since the previous record, i.e. what the previous
+    instruction did. Numbers are LEB128 varints, registers are stored as zigzag deltas
+    and the cpsr as the xor with the old value rotated so the flags land in the low bits.
+
+    Records are written into TRACE_BLOCK_SIZE buffers owned by the thread running the
+    cpu. A full buffer is handed to a writer thread that compresses it (trace_compress,
+    an LZ77 byte format) and appends it to the file, the cpu thread only waits when all
+    TRACE_BUFFERS are still queued. Each block starts with a key record holding the
+    whole state, so blocks decode on their own.
+
+    File: TRACE_MAGIC, uint32 version, uint32 block size, then per block uint32 raw
+    size, uint32 compressed size and the compressed bytes (all little endian).
+    trace_decode turns it back into text.
+*/
+
+#define TRACE_MAGIC "GBATRACE"
+#define TRACE_VERSION 1
+#define TRACE_BLOCK_SIZE (1 << 20)
+#define TRACE_BUFFERS 4                             // power of 2
+#define TRACE_RECORD_MAX 128                        // longest record (a key record)
+
+// record tag bits
+#define TRACE_THUMB (1 << 0)                        // opcode is 2 bytes
+#define TRACE_JUMP (1 << 1)                         // zigzag pc delta from the expected pc follows
+#define TRACE_CHANGES (1 << 2)                      // change mask and values follow
+#define TRACE_KEY (1 << 3)                          // cycles, pc, r0-r14 and cpsr follow, nothing else
+
+#define TRACE_CPSR_BIT (1 << 15)                    // in the change mask, bits 0-14 are r0-r14
+
+typedef struct Trace {
+    FILE *file;
+
+    // state as of the last record, only touched by the cpu thread
+    uint32_t registers[15];
+    uint32_t cpsr;
+    uint32_t next_pc;
+    uint8_t *write;
+    uint8_t *limit;
+    uint64_t records;
+
+    uint8_t *buffers[TRACE_BUFFERS];
+    uint32_t sizes[TRACE_BUFFERS];
+    uint8_t *compressed;
+
+    pthread_t thread;
+    uint8_t thread_started;
+    _Atomic uint8_t stopping;
+    _Alignas(64) _Atomic uint32_t head;             // buffers filled
+    _Alignas(64) _Atomic uint32_t tail;             // buffers written
+    _Alignas(64) uint64_t raw_bytes;                // writer thread only
+    uint64_t file_bytes;
+} Trace;
+
+Trace *trace_create(const char *path);
+void trace_instruction(Trace *trace, struct CPU *cpu, Memory *memory, uint32_t address);
+void trace_destroy(Trace *trace);
+
+uint32_t trace_compress_bound(uint32_t size);
+uint32_t trace_compress(const uint8_t *input, uint32_t size, uint8_t *output);
+int trace_decompress(const uint8_t *input, uint32_t size, uint8_t *output, uint32_t output_size);
+
+#endif
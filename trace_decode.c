@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "instruction_parser.h"
+#include "trace.h"
+
+/*
+    Prints a trace written with --run <frames> --trace <file> as text, one line per
+    instruction in the format of the disassembly loop in gba.c. What an instruction
+    changed is printed indented below it.
+
+        trace_decode <file> [instructions]
+*/
+
+typedef struct {
+    const uint8_t *in;
+    const uint8_t *end;
+    int broken;
+} Reader;
+
+static uint64_t get_varint(Reader *reader) {
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (reader->in == reader->end) {
+            reader->broken = 1;
+            return 0;
+        }
+
+        uint8_t byte = *reader->in++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+
+    reader->broken = 1;
+    return 0;
+}
+
+static uint32_t get_bytes(Reader *reader, int count) {
+    uint32_t value = 0;
+
+    if (reader->end - reader->in < count) {
+        reader->broken = 1;
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        value |= (uint32_t)*reader->in++ << (i * 8);
+    }
+
+    return value;
+}
+
+static uint32_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ -(value & 1);
+}
+
+static uint32_t rotate_right(uint32_t value, uint8_t amount) {
+    return (value >> amount) | (value << (32 - amount));
+}
+
+typedef struct {
+    uint32_t registers[15];
+    uint32_t cpsr;
+    uint32_t next_pc;
+    uint8_t started;
+} TraceState;
+
+static void print_changes(const uint32_t *old_registers, uint32_t old_cpsr, const TraceState *state) {
+    int printed = 0;
+
+    for (int i = 0; i < 15; i++) {
+        if (state->registers[i] != old_registers[i]) {
+            printf("%s r%d=%.8x", printed++ ? "" : "           ", i, state->registers[i]);
+        }
+    }
+
+    if (state->cpsr != old_cpsr) {
+        printf("%s cpsr=%.8x", printed++ ? "" : "           ", state->cpsr);
+    }
+
+    if (printed) {
+        printf("\n");
+    }
+}
+
+// returns the amount of instructions printed, or -1 if the block is broken
+static int64_t decode_block(const uint8_t *data, uint32_t size, TraceState *state, uint64_t limit) {
+    Reader reader = {data, data + size, 0};
+    int64_t count = 0;
+
+    while (reader.in < reader.end && (uint64_t)count < limit) {
+        uint8_t tag = *reader.in++;
+        uint32_t old_registers[15];
+        uint32_t old_cpsr = state->cpsr;
+        uint32_t pc = state->next_pc;
+
+        memcpy(old_registers, state->registers, sizeof(old_registers));
+
+        if (tag & TRACE_KEY) {
+            uint64_t cycles = get_varint(&reader);
+            pc = get_varint(&reader);
+
+            for (int i = 0; i < 15; i++) {
+                state->registers[i] = get_varint(&reader);
+            }
+
+            state->cpsr = get_varint(&reader);
+
+            if (state->started) {
+                print_changes(old_registers, old_cpsr, state);
+            }
+
+            printf("-- cycle %llu\n", (unsigned long long)cycles);
+            state->started = 1;
+        } else if (tag & TRACE_JUMP) {
+            pc += unzigzag(get_varint(&reader));
+        }
+
+        uint32_t opcode = get_bytes(&reader, (tag & TRACE_THUMB) ? 2 : 4);
+
+        if (tag & TRACE_CHANGES) {
+            uint32_t mask = get_varint(&reader);
+
+            for (uint32_t bits = mask & ~TRACE_CPSR_BIT & 0x7FFF; bits; bits &= bits - 1) {
+                int i = __builtin_ctz(bits);
+                state->registers[i] += unzigzag(get_varint(&reader));
+            }
+
+            if (mask & TRACE_CPSR_BIT) {
+                state->cpsr ^= rotate_right(get_varint(&reader), 4);
+            }
+
+            print_changes(old_registers, old_cpsr, state);
+        }
+
+        if (reader.broken || !state->started) {
+            return -1;
+        }
+
+        if (tag & TRACE_THUMB) {
+            printf("0x%.8x: %.4x ", pc, opcode);
+            decode_instruction_thumb(opcode, pc, state->registers[13], state->registers[14]);
+            state->next_pc = pc + 2;
+        } else {
+            printf("0x%.8x: %.8x ", pc, opcode);
+            decode_instruction_arm(opcode);
+            state->next_pc = pc + 4;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+static uint32_t read_uint32(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <trace file> [instructions]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t limit = argc > 2 ? strtoull(argv[2], NULL, 10) : UINT64_MAX;
+    FILE *file = fopen(argv[1], "rb");
+    uint8_t header[16];
+
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, TRACE_MAGIC, 8) != 0 ||
+        read_uint32(header + 8) != TRACE_VERSION) {
+        fprintf(stderr, "%s isn't a version %d trace\n", argv[1], TRACE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    uint32_t block_size = read_uint32(header + 12);
+    uint8_t *raw = malloc(block_size);
+    uint8_t *compressed = malloc(trace_compress_bound(block_size));
+    TraceState state = {0};
+    int status = 0;
+
+    if (raw == NULL || compressed == NULL) {
+        fprintf(stderr, "Could not allocate %u byte blocks\n", block_size);
+        status = 1;
+    }
+
+    uint8_t block_header[8];
+
+    while (status == 0 && limit > 0 && fread(block_header, 1, sizeof(block_header), file) == sizeof(block_header)) {
+        uint32_t raw_size = read_uint32(block_header);
+        uint32_t size = read_uint32(block_header + 4);
+
+        if (raw_size > block_size || size > trace_compress_bound(block_size) ||
+            fread(compressed, 1, size, file) != size ||
+            trace_decompress(compressed, size, raw, raw_size) != 0) {
+            fprintf(stderr, "Broken block in %s\n", argv[1]);
+            status = 1;
+            break;
+        }
+
+        int64_t count = decode_block(raw, raw_size, &state, limit);
+
+        if (count < 0) {
+            fprintf(stderr, "Broken record in %s\n", argv[1]);
+            status = 1;
+            break;
+        }
+
+        limit -= count;
+    }
+
+    free(raw);
+    free(compressed);
+    fclose(file);
+
+    return status;
+}